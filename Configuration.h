@@ -82,6 +82,7 @@ enum Compatibility
 
 #define FILENAME_LENGTH 100
 #define GCODE_REPLY_LENGTH 2048
+#define STATUS_FRAGMENT_LENGTH 320				// Size of each memoized section of the status responses
 
 // Print estimation defaults
 #define NOZZLE_DIAMETER 0.5						// Thickness of the nozzle
@@ -206,19 +206,17 @@ void GCodes::Spin()
 
 	if (!auxGCode->Active() && (platform->GetAux()->Status() & byteAvailable))
 	{
-		uint8_t i = 0;
-		do
+		// Take up to a whole line at a time. A complete gcode can only end at the last character we get.
+		char buf[GCODE_LENGTH];
+		const size_t n = platform->GetAux()->ReadLine(buf, ARRAY_SIZE(buf));
+		for (size_t i = 0; i < n; ++i)
 		{
-			char b;
-			platform->GetAux()->Read(b);
-			if (auxGCode->Put(b))	// add char to buffer and test whether the gcode is complete
+			if (auxGCode->Put(buf[i]))	// add char to buffer and test whether the gcode is complete
 			{
 				auxDetected = true;
 				auxGCode->SetFinished(ActOnCode(auxGCode, true));
-				break;	// stop after receiving a complete gcode in case we haven't finished processing it
 			}
-			++i;
-		} while (i < GCODE_LENGTH && (platform->GetAux()->Status() & byteAvailable));
+		}
 		platform->ClassReport(longWait);
 		return;
 	}
@@ -238,13 +236,13 @@ void GCodes::Spin()
 		// Otherwise just deal in general with incoming bytes from the serial interface
 		else if (!serialGCode->Active())
 		{
-			// Read several bytes instead of just one. This approximately doubles the speed of file uploading.
-			uint8_t i = 0;
-			do
+			// Take up to a whole line at a time instead of one byte. A complete gcode can only end at the last character we get,
+			// so we never read past a gcode that we haven't finished processing.
+			char buf[GCODE_LENGTH];
+			const size_t n = platform->GetLine()->ReadLine(buf, ARRAY_SIZE(buf));
+			for (size_t i = 0; i < n; ++i)
 			{
-				char b;
-				platform->GetLine()->Read(b);
-				if (serialGCode->Put(b))	// add char to buffer and test whether the gcode is complete
+				if (serialGCode->Put(buf[i]))	// add char to buffer and test whether the gcode is complete
 				{
 					// we have a complete gcode
 					if (serialGCode->WritingFileDirectory() != NULL)
@@ -256,10 +254,8 @@ void GCodes::Spin()
 					{
 						serialGCode->SetFinished(ActOnCode(serialGCode, reprap.GetMove()->IsPaused()));
 					}
-					break;	// stop after receiving a complete gcode in case we haven't finished processing it
 				}
-				++i;
-			} while (i < GCODE_LENGTH && (platform->GetLine()->Status() & byteAvailable));
+			}
 
 			platform->ClassReport(longWait);
 			return;
@@ -309,6 +305,7 @@ void GCodes::Spin()
 
 	if (!fileGCode->Active() && reprap.GetMove()->IsRunning() && fileBeingPrinted.IsLive())
 	{
+		bool waitingForUpload = false;
 		uint8_t i = 0;
 		do
 		{
@@ -321,6 +318,26 @@ void GCodes::Spin()
 					break;
 				}
 			}
+			else if (fileBeingPrinted.IsGrowing())
+			{
+				// We have caught up with a file that is still being uploaded, so wait for more data to arrive
+				waitingForUpload = true;
+				break;
+			}
+			else if (fileBeingPrinted.WasAbandoned())
+			{
+				// The upload of the file we are printing has failed. Discard the incomplete line, let the moves
+				// we already have finish and then stop the print with the heaters off.
+				fileGCode->Init();
+				if (AllMovesAreFinishedAndMoveBufferIsLoaded())
+				{
+					platform->Message(BOTH_ERROR_MESSAGE, "Upload of the file being printed was aborted, print stopped\n");
+					fileBeingPrinted.Close();
+					reprap.GetHeat()->SwitchOffAll();
+					reprap.GetPrintMonitor()->StoppedPrint();
+				}
+				break;
+			}
 			else
 			{
 				if (fileGCode->Put('\n')) // In case there wasn't one ending the file
@@ -337,8 +354,12 @@ void GCodes::Spin()
 			++i;
 		} while (i < GCODE_LENGTH);
 
-		platform->ClassReport(longWait);
-		return;
+		// While we wait for the upload, carry on and run the other G-Code buffers so that the print can still be paused or cancelled
+		if (!waitingForUpload)
+		{
+			platform->ClassReport(longWait);
+			return;
+		}
 	}
 
 
@@ -1407,6 +1428,7 @@ void GCodes::QueueFileToPrint(const char* fileName)
 		}
 		reprap.GetMove()->ResetExtruderPositions();
 
+		f->SetAccessClass(sdAccessPrint);
 		fileToPrint.Set(f);
 	}
 	else
@@ -1527,6 +1549,7 @@ void GCodes::SetOrReportOffsets(StringRef& reply, GCodeBuffer *gb)
 		if (settingOffset)
 		{
 			tool->SetOffset(offset);
+			reprap.StatusFieldChanged(statusCoords);
 		}
 
 		// Deal with setting temperatures
@@ -1659,7 +1682,7 @@ void GCodes::DisableDrives()
 	axisIsHomed[Z_AXIS] = false;
 }
 
-// Does what it says.
+// Does what it says. The address ends at the first space, so that later parameters such as S500.5 aren't read as part of it.
 
 void GCodes::SetEthernetAddress(GCodeBuffer *gb, int mCode)
 {
@@ -1668,7 +1691,7 @@ void GCodes::SetEthernetAddress(GCodeBuffer *gb, int mCode)
 	uint8_t sp = 0;
 	uint8_t spp = 0;
 	uint8_t ipp = 0;
-	while (ipString[sp])
+	while (ipString[sp] != 0 && ipString[sp] != ' ' && ipString[sp] != '\t')
 	{
 		if (ipString[sp] == '.')
 		{
@@ -1701,6 +1724,9 @@ void GCodes::SetEthernetAddress(GCodeBuffer *gb, int mCode)
 		case 554:
 			platform->SetGateWay(eth);
 			break;
+		case 586:
+			reprap.GetNetwork()->SetTelemetryAddress(eth);
+			break;
 
 		default:
 			platform->Message(BOTH_ERROR_MESSAGE, "Setting ether parameter - dud code.\n");
@@ -1978,6 +2004,11 @@ void GCodes::SetHeaterParameters(GCodeBuffer *gb, StringRef& reply)
 				pp.thermistorSeriesR = gb->GetFValue();
 				seen = true;
 			}
+			if (gb->Seen('C'))
+			{
+				pp.thermistorShC = gb->GetFValue();
+				seen = true;
+			}
 			if (gb->Seen('L'))
 			{
 				pp.adcLowOffset = gb->GetFValue();
@@ -2008,8 +2039,8 @@ void GCodes::SetHeaterParameters(GCodeBuffer *gb, StringRef& reply)
 			}
 			else
 			{
-				reply.printf("T:%.1f B:%.1f R:%.1f L:%.1f H:%.1f X:%d\n",
-						r25, beta, pp.thermistorSeriesR, pp.adcLowOffset, pp.adcHighOffset, platform->GetThermistorNumber(heater));
+				reply.printf("T:%.1f B:%.1f C:%.3e R:%.1f L:%.1f H:%.1f X:%d\n",
+						r25, beta, pp.thermistorShC, pp.thermistorSeriesR, pp.adcLowOffset, pp.adcHighOffset, platform->GetThermistorNumber(heater));
 			}
 		}
 		else
@@ -2816,6 +2847,7 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 			if (gb->Seen('I'))		// Invert cooling
 			{
 				coolingInverted = (gb->GetIValue() > 0);
+				reprap.StatusFieldChanged(statusParams);
 				seen = true;
 			}
 
@@ -3363,6 +3395,7 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 			if (speedFactor > 0)
 			{
 				reprap.GetMove()->SetSpeedFactor(speedFactor);
+				reprap.StatusFieldChanged(statusParams);
 			}
 			else
 			{
@@ -3390,6 +3423,7 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 				if (extruder >= 0 && extruder < DRIVES - AXES && extrusionFactor >= 0)
 				{
 					reprap.GetMove()->SetExtrusionFactor(extruder, extrusionFactor);
+					reprap.StatusFieldChanged(statusParams);
 				}
 			}
 			else
@@ -3465,6 +3499,12 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 				seq = gb->GetIValue();
 			}
 
+			unsigned int changedSince = 0;	// R parameter is the last status sequence number seen by the client
+			if (gb->Seen('R'))
+			{
+				changedSince = max<long>(gb->GetLValue(), 0);
+			}
+
 			switch(type)
 			{
 				case 0:
@@ -3475,7 +3515,7 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 				case 2:
 				case 3:
 				case 4:
-					reprap.GetStatusResponse(reply, type - 2, false);
+					reprap.GetStatusResponse(reply, type - 2, false, changedSince);
 					break;
 
 				case 5:
@@ -3487,6 +3527,7 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 
 	case 500: // Store parameters in EEPROM
 		platform->WriteNvData();
+		platform->SaveMotorCurrents();
 		break;
 
 	case 501: // Load parameters from EEPROM
@@ -3563,12 +3604,19 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 				reprap.GetNetwork()->SetHttpPort(gb->GetIValue());
 			}
 
+			if (gb->Seen('T'))	// WebSocket status push interval in milliseconds, 0 to disable
+			{
+				seen = true;
+				webserver->SetStatusPushInterval(max<float>(gb->GetFValue(), 0.0) / 1000.0);
+			}
+
 			if (!seen)
 			{
 				const byte *ip = platform->IPAddress();
-				reply.printf("Network is %s, IP address: %d.%d.%d.%d, HTTP port: %d\n ",
+				reply.printf("Network is %s, IP address: %d.%d.%d.%d, HTTP port: %d, status push interval: %dms\n ",
 						reprap.GetNetwork()->IsEnabled() ? "enabled" : "disabled",
-						ip[0], ip[1], ip[2], ip[3], reprap.GetNetwork()->GetHttpPort());
+						ip[0], ip[1], ip[2], ip[3], reprap.GetNetwork()->GetHttpPort(),
+						(int)(webserver->GetStatusPushInterval() * 1000.0));
 			}
 
 		}
@@ -3933,6 +3981,46 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 		}
 		break;
 
+	case 586: // Set/report UDP telemetry: P host or multicast group, R port, S interval in ms (0 = off), F fields
+		{
+			Network *net = reprap.GetNetwork();
+			bool seen = false;
+			if (gb->Seen('R'))
+			{
+				net->SetTelemetryPort(gb->GetIValue());
+				seen = true;
+			}
+			if (gb->Seen('S'))
+			{
+				net->SetTelemetryInterval(max<float>(gb->GetFValue(), 0.0) / 1000.0);
+				seen = true;
+			}
+			if (gb->Seen('F'))
+			{
+				net->SetTelemetryFields(gb->GetIValue());
+				seen = true;
+			}
+			if (gb->Seen('P'))
+			{
+				SetEthernetAddress(gb, code);
+				seen = true;
+			}
+			if (!seen)
+			{
+				const uint8_t *ip = net->GetTelemetryAddress();
+				if (net->GetTelemetryInterval() > 0.0)
+				{
+					reply.printf("UDP telemetry to %d.%d.%d.%d:%u every %.0fms, fields %u\n", ip[0], ip[1], ip[2], ip[3],
+								net->GetTelemetryPort(), net->GetTelemetryInterval() * 1000.0, net->GetTelemetryFields());
+				}
+				else
+				{
+					reply.copy("UDP telemetry is disabled\n");
+				}
+			}
+		}
+		break;
+
     case 906: // Set/report Motor currents
 		{
 			bool seen = false;
@@ -227,6 +227,21 @@ size_t Stream::readBytes(char *buffer, size_t length)
 }
 
 
+// read the characters that have already arrived, up to length, without waiting for more
+// returns the number of characters placed in the buffer
+// streams that buffer their input can override this to copy it in blocks
+size_t Stream::readAvailable(char *buffer, size_t length)
+{
+  size_t count = 0;
+  while (count < length) {
+    int c = read();
+    if (c < 0) break;
+    *buffer++ = (char)c;
+    count++;
+  }
+  return count;
+}
+
 // as readBytes with terminator character
 // terminates if length characters have been read, timeout, or if the terminator character  detected
 // returns the number of characters placed in the buffer (0 means no valid data found)
@@ -50,6 +50,7 @@ class Stream : public Print
     virtual int peek() = 0;
     virtual void flush() = 0;
     virtual size_t canWrite() const { return 1; }	// DC42 added for Duet
+    virtual size_t readAvailable(char *buffer, size_t length);	// read the chars that have already arrived, up to length, without waiting (added for Duet)
 
     Stream() {_timeout=1000;}
 
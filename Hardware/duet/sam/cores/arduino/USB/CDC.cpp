@@ -238,6 +238,31 @@ int Serial_::read(void)
 	}
 }
 
+// Function added for Duet, to copy the received data out of the ring buffer in blocks instead of one character at a time
+size_t Serial_::readAvailable(char *dest, size_t length)
+{
+	ring_buffer *buffer = &cdc_rx_buffer;
+	size_t count = 0;
+
+	while (count < length && buffer->head != buffer->tail)
+	{
+		const uint32_t tail = buffer->tail;
+		const uint32_t head = buffer->head;
+		size_t chunk = ((head > tail) ? head : CDC_SERIAL_BUFFER_SIZE) - tail;	// contiguous characters from the tail
+		if (chunk > length - count)
+		{
+			chunk = length - count;
+		}
+		memcpy(dest + count, &buffer->buffer[tail], chunk);
+		count += chunk;
+		buffer->tail = (tail + chunk) % CDC_SERIAL_BUFFER_SIZE;
+	}
+
+	if (count != 0 && USBD_Available(CDC_RX))
+		accept();
+	return count;
+}
+
 void Serial_::flush(void)
 {
 	USBD_Flush(CDC_TX);
@@ -56,6 +56,7 @@ public:
 	virtual void accept(void);
 	virtual int peek(void);
 	virtual int read(void);
+	virtual size_t readAvailable(char *buffer, size_t length);	// Function added so that Duet can read received data in blocks
 	virtual void flush(void);
 	virtual size_t write(uint8_t);
 	virtual size_t write(const uint8_t *buffer, size_t size);
@@ -59,6 +59,18 @@ void Heat::Spin()
 	if (!active)
 		return;
 
+	// Let clients of the status response know if any heater has changed. We do this on every call,
+	// because the set temperatures and heater states may be changed at any time by GCodes and Tools.
+	bool statusChanged = false;
+	for(size_t heater=0; heater < HEATERS; heater++)
+	{
+		statusChanged |= pids[heater]->StatusChanged();
+	}
+	if (statusChanged)
+	{
+		reprap.StatusFieldChanged(statusTemps);
+	}
+
 	float t = platform->Time();
 	if (t - lastTime < platform->HeatSampleTime())
 		return;
@@ -133,6 +145,8 @@ void PID::Init()
 	  switchedOff = true;
 	  heatingUp = false;
 	  averagePWM = 0.0;
+	  reportedTemperature = reportedActiveTemperature = reportedStandbyTemperature = NAN;
+	  reportedState = 0xFF;
 }
 
 void PID::SwitchOn()
@@ -291,4 +305,21 @@ float PID::GetAveragePWM() const
 	return averagePWM * invHeatPwmAverageCount;
 }
 
+// Temperatures are reported with one decimal place, so smaller changes of the current temperature are ignored
+bool PID::StatusChanged()
+{
+	const uint8_t state = (temperatureFault ? 4 : 0) | (switchedOff ? 2 : 0) | (active ? 1 : 0);
+	if (fabs(temperature - reportedTemperature) < 0.05 && activeTemperature == reportedActiveTemperature
+			&& standbyTemperature == reportedStandbyTemperature && state == reportedState)
+	{
+		return false;
+	}
+
+	reportedTemperature = temperature;
+	reportedActiveTemperature = activeTemperature;
+	reportedStandbyTemperature = standbyTemperature;
+	reportedState = state;
+	return true;
+}
+
 // End
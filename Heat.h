@@ -46,6 +46,7 @@ class PID
     void ResetFault();								// Reset a fault condition - only call this if you know what you are doing
     float GetTemperature() const;					// Get the current temperature
     float GetAveragePWM() const;					// Return the running average PWM to the heater. Answer is a fraction in [0, 1].
+    bool StatusChanged();							// Has anything we report in the status response changed since the last call?
 
   private:
 
@@ -65,6 +66,10 @@ class PID
     float timeSetHeating;							// When we were switched on
     bool heatingUp;									// Are we heating up?
     float averagePWM;								// The running average of the PWM.
+    float reportedTemperature;						// The values we last flagged for the status response
+    float reportedActiveTemperature;
+    float reportedStandbyTemperature;
+    uint8_t reportedState;
 };
 
 /**
@@ -64,6 +64,10 @@
 //#define EMAC_TX_BUFFERS  (8)
 
 
+/** Number of received frames that can be held between the EMAC interrupt and lwIP. Each one takes 1.5KB of RAM.
+ *  This must be a power of 2. */
+#define ETHERNET_RX_QUEUE_LENGTH  (4)
+
 /** MAC PHY operation max retry count */
 #define MAC_PHY_RETRY_MAX 1000000
 
@@ -251,6 +251,31 @@ bool ethernet_read(void)
 	return data_read;
 }
 
+/**
+ *  \brief Pass the next frame in the RX queue to lwIP, without reading from the EMAC.
+ *
+ *  \return Returns true if a frame has been processed.
+ */
+bool ethernet_read_queued(void)
+{
+	return ethernetif_input_queued(&gs_net_if);
+}
+
+/**
+ *  \brief Move received frames from the EMAC into the RX queue. Call this only from the RX callback.
+ *
+ *  \return Returns false if the queue is full and frames may have been left in the EMAC.
+ */
+bool ethernet_queue_frames(uint32_t ul_status)
+{
+	return ethernetif_queue_frames(ul_status);
+}
+
+const struct ethernetif_rx_stats *ethernet_get_rx_stats(void)
+{
+	return ethernetif_get_rx_stats();
+}
+
 /*
  * \brief Sets the EMAC RX callback. It will be called when a new packet
  * can be processed and should be called with a NULL parameter inside
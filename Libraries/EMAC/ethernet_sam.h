@@ -82,6 +82,23 @@ void ethernet_status_callback(struct netif *netif);
  */
 bool ethernet_read(void);
 
+/**
+ * \brief Pass the next frame in the RX queue to lwIP, without reading from the EMAC.
+ *
+ * \return Returns true if a frame has been processed.
+ */
+bool ethernet_read_queued(void);
+
+/**
+ * \brief Move received frames from the EMAC into the RX queue. Call this only from the RX callback.
+ *
+ * \return Returns false if the queue is full and frames may have been left in the EMAC.
+ */
+bool ethernet_queue_frames(uint32_t ul_status);
+
+struct ethernetif_rx_stats;
+const struct ethernetif_rx_stats *ethernet_get_rx_stats(void);
+
 /*
  * \brief Sets the EMAC RX callback. It will be called when a new packet
  * can be processed and should be called with a NULL parameter inside
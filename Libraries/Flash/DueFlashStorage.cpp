@@ -6,7 +6,7 @@ void DueFlashStorage::read(uint32_t address, void *data, uint32_t dataLength)
 	memcpy(data, FLASH_START + address, dataLength);
 }
 
-bool DueFlashStorage::write(uint32_t address, const void *data, uint32_t dataLength)
+bool DueFlashStorage::write(uint32_t address, const void *data, uint32_t dataLength, bool erase)
 {
 	if ((uint32_t)FLASH_START + address < IFLASH1_ADDR)
 	{
@@ -38,7 +38,7 @@ bool DueFlashStorage::write(uint32_t address, const void *data, uint32_t dataLen
 	else
 	{
 		// Write data
-		retCode = flash_write((uint32_t)FLASH_START + address, data, dataLength, 1);
+		retCode = flash_write((uint32_t)FLASH_START + address, data, dataLength, (erase) ? 1 : 0);
 		if (retCode != FLASH_RC_OK)
 		{
 			FLASH_DEBUG("Flash write failed");
@@ -58,4 +58,25 @@ bool DueFlashStorage::write(uint32_t address, const void *data, uint32_t dataLen
 	return retCode == FLASH_RC_OK;
 }
 
+bool DueFlashStorage::erase(uint32_t address, uint32_t dataLength)
+{
+	if ((((uint32_t)FLASH_START + address) & (IFLASH1_PAGE_SIZE - 1)) != 0 || (dataLength & (IFLASH1_PAGE_SIZE - 1)) != 0)
+	{
+		FLASH_DEBUG("Flash erase must be whole pages\n");
+		return false;
+	}
+
+	// The erase-and-write-page command is the only way to erase a single page, so write pages of all ones with it
+	uint32_t blank[IFLASH1_PAGE_SIZE/sizeof(uint32_t)];
+	memset(blank, 0xFF, sizeof(blank));
+	for (uint32_t offset = 0; offset < dataLength; offset += IFLASH1_PAGE_SIZE)
+	{
+		if (!write(address + offset, blank, IFLASH1_PAGE_SIZE, true))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
 // End
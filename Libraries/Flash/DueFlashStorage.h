@@ -19,8 +19,8 @@ Further modified up by David Crocker
 #include "flash_efc.h"
 #include "efc.h"
 
-// 1Kb of data
-#define DATA_LENGTH   ((IFLASH1_PAGE_SIZE/sizeof(byte))*4)
+// 9Kb of data: 1Kb for data at fixed addresses followed by two 4Kb banks for the settings log
+#define DATA_LENGTH   ((IFLASH1_PAGE_SIZE/sizeof(byte))*36)
 
 // Choose a start address close to the top of the Flash 1 memory space
 #define  FLASH_START  ((uint8_t *)(IFLASH1_ADDR + IFLASH1_SIZE - DATA_LENGTH))
@@ -35,9 +35,13 @@ namespace DueFlashStorage
 	// flashStart is the address in memory where the write should start
 	// data is a pointer to the data to be written
 	// dataLength is length of data in bytes
+	// If erase is false, the pages are programmed without erasing them first. This can only clear bits, so it is
+	// used to fill in flash that has been erased and not written since.
+	// erase() sets the specified area of flash to all ones. It must start and end on page boundaries.
 
 	void read(uint32_t address, void *data, uint32_t dataLength);
-	bool write(uint32_t address, const void *data, uint32_t dataLength);
+	bool write(uint32_t address, const void *data, uint32_t dataLength, bool erase = true);
+	bool erase(uint32_t address, uint32_t dataLength);
 };
 
 #endif
@@ -0,0 +1,216 @@
+#include "FlashLog.h"
+#include "DueFlashStorage.h"
+#include <cstring>
+
+FlashLog::FlashLog(uint32_t addr, uint32_t len)
+	: address(addr), bankLength(len), currentBank(0), sequence(0), logEnd(sizeof(BankHeader)), mounted(false), damaged(false),
+	  appends(0), unchanged(0), compactions(0)
+{
+}
+
+// Find the bank in use and the end of the log in it. If nothing has been saved since the firmware was loaded, start a new log.
+bool FlashLog::Mount()
+{
+	const BankHeader * const header0 = reinterpret_cast<const BankHeader *>(BankStart(0));
+	const BankHeader * const header1 = reinterpret_cast<const BankHeader *>(BankStart(1));
+	const bool valid0 = (header0->magic == BankHeader::magicValue);
+	const bool valid1 = (header1->magic == BankHeader::magicValue);
+	mounted = true;
+	damaged = false;
+
+	if (!valid0 && !valid1)
+	{
+		// Pretend we are using an empty bank 1, so that compaction formats bank 0
+		currentBank = 1;
+		sequence = 0;
+		logEnd = sizeof(BankHeader);
+		mounted = Compact(noKey, nullptr, 0);
+		return mounted;
+	}
+
+	currentBank = (valid0 && (!valid1 || (int32_t)(header0->sequence - header1->sequence) > 0)) ? 0 : 1;
+	sequence = reinterpret_cast<const BankHeader *>(BankStart(currentBank))->sequence;
+
+	// Walk the records to find the end of the log
+	logEnd = sizeof(BankHeader);
+	while (logEnd + sizeof(RecordHeader) <= bankLength)
+	{
+		const RecordHeader * const rec = reinterpret_cast<const RecordHeader *>(BankStart(currentBank) + logEnd);
+		if (rec->key == noKey && rec->length == 0xFFFF && rec->check == 0xFFFFFFFF)
+		{
+			break;							// erased flash, so this is the end
+		}
+		if (!IsValid(rec, logEnd))
+		{
+			damaged = true;					// we were interrupted while writing this record
+			break;
+		}
+		logEnd += RecordLength(rec->length);
+	}
+
+	// Don't append after a damaged record, move the good ones to the other bank instead
+	return (damaged) ? Compact(noKey, nullptr, 0) : true;
+}
+
+// Fetch the latest value saved for a key. Return false if there isn't one or it has a different length.
+bool FlashLog::Read(uint16_t key, void *data, uint16_t length)
+{
+	if (!mounted && !Mount())
+	{
+		return false;
+	}
+
+	const RecordHeader * const rec = FindLatest(key);
+	if (rec == nullptr || rec->length != length)
+	{
+		return false;
+	}
+	memcpy(data, rec + 1, length);
+	return true;
+}
+
+// Save a value for a key. If the latest saved value is the same, leave the flash alone.
+bool FlashLog::Write(uint16_t key, const void *data, uint16_t length)
+{
+	if (key == noKey || length > maxDataLength || (!mounted && !Mount()))
+	{
+		return false;
+	}
+
+	const RecordHeader * const rec = FindLatest(key);
+	if (rec != nullptr && rec->length == length && memcmp(rec + 1, data, length) == 0)
+	{
+		++unchanged;
+		return true;
+	}
+
+	++appends;
+	if (!damaged && Append(currentBank, logEnd, key, data, length))
+	{
+		return true;
+	}
+
+	// The bank is full or the record didn't program properly, so carry on in the other bank
+	damaged = true;
+	return Compact(key, data, length);
+}
+
+const uint8_t *FlashLog::BankStart(size_t bank) const
+{
+	return FLASH_START + address + bank * bankLength;
+}
+
+const FlashLog::RecordHeader *FlashLog::NextRecord(const RecordHeader *rec) const
+{
+	return reinterpret_cast<const RecordHeader *>(reinterpret_cast<const uint8_t *>(rec) + RecordLength(rec->length));
+}
+
+// Return the latest record for a key in the current bank, or nullptr if there is none
+const FlashLog::RecordHeader *FlashLog::FindLatest(uint16_t key) const
+{
+	const RecordHeader *latest = nullptr;
+	const uint8_t * const end = BankStart(currentBank) + logEnd;
+	for (const RecordHeader *rec = reinterpret_cast<const RecordHeader *>(BankStart(currentBank) + sizeof(BankHeader));
+		 reinterpret_cast<const uint8_t *>(rec) < end; rec = NextRecord(rec))
+	{
+		if (rec->key == key)
+		{
+			latest = rec;
+		}
+	}
+	return latest;
+}
+
+bool FlashLog::IsValid(const RecordHeader *rec, uint32_t offset) const
+{
+	return rec->length <= maxDataLength && offset + RecordLength(rec->length) <= bankLength
+			&& rec->check == Check(rec->key, rec->length, rec + 1);
+}
+
+// Program a record at the given offset in a bank and advance the offset past it
+bool FlashLog::Append(size_t bank, uint32_t& offset, uint16_t key, const void *data, uint16_t length)
+{
+	const uint32_t recordLength = RecordLength(length);
+	if (offset + recordLength > bankLength)
+	{
+		return false;
+	}
+
+	// Build the whole record first so that it is programmed in one go, header first
+	uint32_t buffer[(sizeof(RecordHeader) + maxDataLength)/sizeof(uint32_t)];
+	RecordHeader * const rec = reinterpret_cast<RecordHeader *>(buffer);
+	rec->key = key;
+	rec->length = length;
+	rec->check = Check(key, length, data);
+	uint8_t * const p = reinterpret_cast<uint8_t *>(rec + 1);
+	memcpy(p, data, length);
+	memset(p + length, 0xFF, recordLength - sizeof(RecordHeader) - length);
+
+	const uint32_t recordAddress = address + bank * bankLength + offset;
+	if (!DueFlashStorage::write(recordAddress, buffer, recordLength, false) || memcmp(FLASH_START + recordAddress, buffer, recordLength) != 0)
+	{
+		return false;
+	}
+	offset += recordLength;
+	return true;
+}
+
+// Copy the latest record for each key into the other bank, followed by the new record if there is one, then switch banks.
+// The header of the new bank is programmed last, so if we are interrupted we carry on with the old bank next time.
+bool FlashLog::Compact(uint16_t key, const void *data, uint16_t length)
+{
+	const size_t newBank = 1 - currentBank;
+	if (!DueFlashStorage::erase(address + newBank * bankLength, bankLength))
+	{
+		return false;
+	}
+
+	uint32_t newEnd = sizeof(BankHeader);
+	const uint8_t * const end = BankStart(currentBank) + logEnd;
+	for (const RecordHeader *rec = reinterpret_cast<const RecordHeader *>(BankStart(currentBank) + sizeof(BankHeader));
+		 reinterpret_cast<const uint8_t *>(rec) < end; rec = NextRecord(rec))
+	{
+		if (rec->key != key && FindLatest(rec->key) == rec && !Append(newBank, newEnd, rec->key, rec + 1, rec->length))
+		{
+			return false;
+		}
+	}
+	if (key != noKey && !Append(newBank, newEnd, key, data, length))
+	{
+		return false;					// the bank is too small to hold the latest value of every key
+	}
+
+	BankHeader header;
+	header.magic = BankHeader::magicValue;
+	header.sequence = sequence + 1;
+	if (!DueFlashStorage::write(address + newBank * bankLength, &header, sizeof(header), false))
+	{
+		return false;
+	}
+
+	currentBank = newBank;
+	sequence = header.sequence;
+	logEnd = newEnd;
+	damaged = false;
+	++compactions;
+	return true;
+}
+
+// FNV-1a hash of a record, so that a record we were interrupted while writing isn't mistaken for a good one
+uint32_t FlashLog::Check(uint16_t key, uint16_t length, const void *data)
+{
+	uint32_t hash = 2166136261u;
+	const uint8_t header[4] = { (uint8_t)key, (uint8_t)(key >> 8), (uint8_t)length, (uint8_t)(length >> 8) };
+	for (size_t i = 0; i < sizeof(header); ++i)
+	{
+		hash = (hash ^ header[i]) * 16777619u;
+	}
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// End
@@ -0,0 +1,76 @@
+/*
+FlashLog keeps small key/value records in an append-only log in the flash area managed by DueFlashStorage.
+
+Saving a value appends a record after the last one, so that changing one setting programs a few words of flash
+instead of erasing and rewriting every page that holds the settings. When the current bank is full, the latest
+record for each key is copied into the other bank and the log carries on there. The banks are used in turn,
+so erases are spread over both.
+
+A bank starts with a header that is programmed last when the bank is filled by compaction, so a bank whose
+compaction was interrupted is never used. Each record carries a check word, so that a record whose
+programming was interrupted is recognised and dropped at the next compaction.
+*/
+
+#ifndef FLASHLOG_H
+#define FLASHLOG_H
+
+#include <cstdint>
+#include <cstddef>
+
+class FlashLog
+{
+public:
+	// address is relative to FLASH_START and must be page aligned. There are two banks of bankLength bytes each.
+	FlashLog(uint32_t address, uint32_t bankLength);
+
+	bool Mount();													// find the current bank and the end of its log
+	bool Read(uint16_t key, void *data, uint16_t length);			// fetch the latest value saved for a key
+	bool Write(uint16_t key, const void *data, uint16_t length);	// save a value for a key unless it is already saved
+
+	uint32_t BytesUsed() const { return logEnd; }
+	uint32_t BankLength() const { return bankLength; }
+	uint32_t Appends() const { return appends; }
+	uint32_t Unchanged() const { return unchanged; }
+	uint32_t Compactions() const { return compactions; }
+
+	static const uint16_t noKey = 0xFFFF;							// erased flash, so it can't be used as a key
+	static const uint16_t maxDataLength = 248;						// longest value we can save
+
+private:
+	struct BankHeader
+	{
+		static const uint32_t magicValue = 0x474F4C46;				// "FLOG"
+
+		uint32_t magic;
+		uint32_t sequence;											// incremented each time we move to the other bank
+	};
+
+	struct RecordHeader
+	{
+		uint16_t key;												// noKey marks the end of the log
+		uint16_t length;											// number of data bytes, which follow padded to a whole word
+		uint32_t check;												// hash of the key, length and data
+	};
+
+	const uint8_t *BankStart(size_t bank) const;
+	const RecordHeader *FindLatest(uint16_t key) const;
+	const RecordHeader *NextRecord(const RecordHeader *rec) const;
+	bool IsValid(const RecordHeader *rec, uint32_t offset) const;
+	bool Append(size_t bank, uint32_t& offset, uint16_t key, const void *data, uint16_t length);
+	bool Compact(uint16_t key, const void *data, uint16_t length);
+
+	static uint32_t RecordLength(uint16_t length) { return sizeof(RecordHeader) + ((length + 3u) & ~3u); }
+	static uint32_t Check(uint16_t key, uint16_t length, const void *data);
+
+	uint32_t address;
+	uint32_t bankLength;
+	size_t currentBank;
+	uint32_t sequence;												// sequence number of the current bank
+	uint32_t logEnd;												// offset in the current bank where the next record goes
+	bool mounted;
+	bool damaged;													// the log ends in a record that wasn't completely written
+
+	uint32_t appends, unchanged, compactions;
+};
+
+#endif
@@ -0,0 +1,225 @@
+/*
+Host test of the FlashLog format against a simulated flash.
+
+Build and run from this directory with:
+
+	g++ -std=gnu++11 -Wall -o FlashLogTest FlashLogTest.cpp && ./FlashLogTest
+
+The simulated flash behaves like the real one: erasing sets bytes to 0xFF and programming can only clear bits.
+A write can be made to fail part way through, to simulate losing power while programming.
+*/
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+// Stand in for DueFlashStorage.h, which needs the Arduino core. Defining its include guard stops FlashLog.cpp
+// from including the real one.
+#define DUEFLASHSTORAGE_H
+
+static const uint32_t logAddress = 1024;
+static const uint32_t bankLength = 4096;
+static uint8_t flashMemory[logAddress + 2 * bankLength];
+
+#define FLASH_START		(flashMemory)
+
+namespace DueFlashStorage
+{
+	bool write(uint32_t address, const void *data, uint32_t dataLength, bool erase = true);
+	bool erase(uint32_t address, uint32_t dataLength);
+};
+
+#include "../FlashLog.cpp"
+
+static int bytesBeforeFailure = -1;				// program this many more bytes and then fail, or -1 for no failure
+static uint32_t failAddress = 0xFFFFFFFF;		// fail any write that includes this address
+
+bool DueFlashStorage::write(uint32_t address, const void *data, uint32_t dataLength, bool erase)
+{
+	if (address <= failAddress && failAddress < address + dataLength)
+	{
+		return false;
+	}
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	for (uint32_t i = 0; i < dataLength; ++i)
+	{
+		if (bytesBeforeFailure == 0)
+		{
+			return false;
+		}
+		if (bytesBeforeFailure > 0)
+		{
+			--bytesBeforeFailure;
+		}
+		flashMemory[address + i] = (erase) ? p[i] : (flashMemory[address + i] & p[i]);
+	}
+	return true;
+}
+
+bool DueFlashStorage::erase(uint32_t address, uint32_t dataLength)
+{
+	memset(flashMemory + address, 0xFF, dataLength);
+	return true;
+}
+
+static int failures = 0;
+
+#define CHECK(_cond)	do { if (!(_cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #_cond); ++failures; } } while (false)
+
+static void ResetFlash()
+{
+	memset(flashMemory, 0xFF, sizeof(flashMemory));
+	bytesBeforeFailure = -1;
+	failAddress = 0xFFFFFFFF;
+}
+
+static bool ReadsValue(FlashLog& log, uint16_t key, uint32_t expected)
+{
+	uint32_t value;
+	return log.Read(key, &value, sizeof(value)) && value == expected;
+}
+
+// A new value is appended and can be read back, also after mounting again
+static void TestAppend()
+{
+	ResetFlash();
+	FlashLog log(logAddress, bankLength);
+	const uint32_t value = 0x12345678;
+	CHECK(log.Write(1, &value, sizeof(value)));
+	CHECK(log.Appends() == 1);
+	CHECK(ReadsValue(log, 1, value));
+
+	uint32_t other;
+	CHECK(!log.Read(2, &other, sizeof(other)));				// never written
+	uint16_t wrongLength;
+	CHECK(!log.Read(1, &wrongLength, sizeof(wrongLength)));	// saved with a different length
+
+	FlashLog remounted(logAddress, bankLength);
+	CHECK(ReadsValue(remounted, 1, value));
+}
+
+// Writing a key again supersedes the old value, and writing an unchanged value leaves the flash alone
+static void TestOverwrite()
+{
+	ResetFlash();
+	FlashLog log(logAddress, bankLength);
+	const uint32_t first = 1, second = 2;
+	CHECK(log.Write(1, &first, sizeof(first)));
+	CHECK(log.Write(1, &second, sizeof(second)));
+	CHECK(ReadsValue(log, 1, second));
+
+	const uint32_t used = log.BytesUsed();
+	CHECK(log.Write(1, &second, sizeof(second)));
+	CHECK(log.BytesUsed() == used);
+	CHECK(log.Unchanged() == 1);
+
+	FlashLog remounted(logAddress, bankLength);
+	CHECK(ReadsValue(remounted, 1, second));
+}
+
+// When the bank is full, the latest value of each key moves to the other bank
+static void TestCompaction()
+{
+	ResetFlash();
+	FlashLog log(logAddress, bankLength);
+	const uint32_t fixed = 0xCAFEF00D;
+	CHECK(log.Write(7, &fixed, sizeof(fixed)));
+
+	uint32_t value = 0;
+	while (log.Compactions() == 1)							// mounting the blank flash formatted the first bank
+	{
+		++value;
+		if (!log.Write(1, &value, sizeof(value)))
+		{
+			CHECK(false);
+			break;
+		}
+	}
+	CHECK(log.Compactions() == 2);
+	CHECK(ReadsValue(log, 1, value));
+	CHECK(ReadsValue(log, 7, fixed));
+	CHECK(log.BytesUsed() < bankLength / 2);					// only the latest records were kept
+
+	FlashLog remounted(logAddress, bankLength);
+	CHECK(ReadsValue(remounted, 1, value));
+	CHECK(ReadsValue(remounted, 7, fixed));
+}
+
+// A record whose programming was interrupted is dropped at the next mount, and the previous value is kept
+static void TestTornRecord()
+{
+	ResetFlash();
+	{
+		FlashLog log(logAddress, bankLength);
+		const uint32_t good = 100, torn = 200;
+		CHECK(log.Write(2, &good, sizeof(good)));
+		bytesBeforeFailure = 10;							// the header and part of the data get programmed
+		CHECK(!log.Write(2, &torn, sizeof(torn)));
+		bytesBeforeFailure = -1;
+	}
+
+	FlashLog remounted(logAddress, bankLength);
+	CHECK(ReadsValue(remounted, 2, 100));
+	CHECK(remounted.Compactions() == 1);						// the good records moved away from the damaged one
+
+	const uint32_t next = 300;
+	CHECK(remounted.Write(2, &next, sizeof(next)));
+	FlashLog again(logAddress, bankLength);
+	CHECK(ReadsValue(again, 2, next));
+}
+
+// If compaction is interrupted before the new bank's header is written, we carry on with the old bank
+static void TestInterruptedCompaction()
+{
+	ResetFlash();
+	uint32_t value = 0;
+	{
+		FlashLog log(logAddress, bankLength);
+		CHECK(log.Write(1, &value, sizeof(value)));
+		failAddress = logAddress + bankLength;				// the header of the second bank
+		for (;;)
+		{
+			const uint32_t next = value + 1;
+			if (!log.Write(1, &next, sizeof(next)))
+			{
+				break;										// this write needed the compaction that failed
+			}
+			value = next;
+			if (value > bankLength)
+			{
+				CHECK(false);
+				break;
+			}
+		}
+		failAddress = 0xFFFFFFFF;
+	}
+
+	FlashLog remounted(logAddress, bankLength);
+	CHECK(ReadsValue(remounted, 1, value));					// the last value that was written completely
+	CHECK(remounted.Compactions() == 0);						// the old bank was intact, so it was used as it is
+
+	const uint32_t next = value + 1;
+	CHECK(remounted.Write(1, &next, sizeof(next)));			// now the compaction succeeds
+	CHECK(remounted.Compactions() == 1);
+	FlashLog again(logAddress, bankLength);
+	CHECK(ReadsValue(again, 1, next));
+}
+
+int main()
+{
+	TestAppend();
+	TestOverwrite();
+	TestCompaction();
+	TestTornRecord();
+	TestInterruptedCompaction();
+
+	if (failures != 0)
+	{
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("All FlashLog tests passed\n");
+	return 0;
+}
+
+// End
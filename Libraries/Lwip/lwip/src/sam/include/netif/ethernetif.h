@@ -56,6 +56,20 @@ err_t ethernetif_init(struct netif *netif);
 void ethernetif_set_params(const u8_t macAddress[], const char *hostname);
 
 bool ethernetif_input(void *pv_parameters);
+bool ethernetif_input_queued(void *pv_parameters);
+bool ethernetif_queue_frames(u32_t ul_status);
+
+/* Counters kept by the queue between the EMAC RX interrupt and lwIP */
+struct ethernetif_rx_stats {
+	u32_t queued;			/* frames moved from the EMAC into the queue */
+	u32_t max_used;			/* highest number of frames waiting in the queue */
+	u32_t queue_full;		/* RX interrupts that found the queue full */
+	u32_t overruns;			/* frames lost by the EMAC because of a DMA overrun */
+	u32_t no_buffers;		/* times the EMAC ran out of receive buffers */
+	u32_t pbuf_drops;		/* queued frames dropped because the pbuf pool was empty */
+};
+
+const struct ethernetif_rx_stats *ethernetif_get_rx_stats(void);
 
 void ethernet_hardware_init(void);
 bool ethernet_establish_link(void);
@@ -94,6 +94,22 @@ static u8_t gs_uc_mac_address[] =
 /** The EMAC driver instance */
 static emac_device_t gs_emac_dev;
 
+/**
+ * Queue of received frames between the EMAC RX interrupt and lwIP. The EMAC buffer ring
+ * only holds a few full-size frames, so the interrupt copies them out here even when lwIP
+ * is busy. There is only one producer (the interrupt) and one consumer at a time (whoever
+ * holds the lwIP lock), so the free-running head and tail counters need no other locking.
+ */
+struct rx_frame {
+	u32_t length;
+	u8_t data[NET_RW_BUFF_SIZE];
+};
+
+static struct rx_frame gs_rx_queue[ETHERNET_RX_QUEUE_LENGTH];
+static volatile u32_t gs_rx_head = 0;	/* frames added, written only by the producer */
+static volatile u32_t gs_rx_tail = 0;	/* frames removed, written only by the consumer */
+static struct ethernetif_rx_stats gs_rx_stats;
+
 /**
  * Helper struct to hold private data used to operate your ethernet interface.
  * Keeping the ethernet address of the MAC in this struct is not necessary
@@ -418,24 +434,142 @@ static struct pbuf *low_level_input(struct netif *netif)
  * \return Returns true if data has been processed.
  */
 
+/* Pass a received frame to lwIP */
+static void ethernetif_process(struct netif *netif, struct pbuf *p)
+{
+	if( ERR_OK != netif->input( p, netif ) )
+	{
+		pbuf_free(p);
+	}
+}
+
+/**
+ * \brief Take the oldest frame from the RX queue and pass it to lwIP. If no pbuf is
+ * available, the frame is dropped just like one read straight from the EMAC would be.
+ * Call this only while holding the lwIP lock.
+ *
+ * \return Returns true if a frame has been taken from the queue.
+ */
+bool ethernetif_input_queued(void *pv_parameters)
+{
+	struct netif *netif = (struct netif *)pv_parameters;
+	if (gs_rx_tail == gs_rx_head)
+	{
+		return false;
+	}
+
+	const struct rx_frame *f = &gs_rx_queue[gs_rx_tail % ETHERNET_RX_QUEUE_LENGTH];
+	struct pbuf *p = pbuf_alloc(PBUF_RAW, f->length + ETH_PAD_SIZE, PBUF_POOL);
+	if (p != NULL)
+	{
+#if ETH_PAD_SIZE
+		pbuf_header(p, -ETH_PAD_SIZE);		/* drop the padding word */
+#endif
+		pbuf_take(p, f->data, f->length);
+#if ETH_PAD_SIZE
+		pbuf_header(p, ETH_PAD_SIZE);		/* reclaim the padding word */
+#endif
+		LINK_STATS_INC(link.recv);
+	}
+	else
+	{
+		LINK_STATS_INC(link.memerr);
+		LINK_STATS_INC(link.drop);
+		gs_rx_stats.pbuf_drops++;
+	}
+
+	__DMB();								/* finish with the slot before handing it back to the producer */
+	gs_rx_tail++;
+
+	if (p != NULL)
+	{
+		ethernetif_process(netif, p);
+	}
+	return true;
+}
+
+/**
+ * \brief Pass the next received frame to lwIP, taking it from the RX queue first and
+ * from the EMAC only when the queue is empty. Reading from the EMAC is safe only from
+ * the RX interrupt or while the RX callback is disabled.
+ *
+ * \return Returns true if data has been processed.
+ */
 bool ethernetif_input(void * pvParameters)
 {
-	struct netif      *netif = (struct netif *)pvParameters;
-	struct pbuf       *p;
+	if (ethernetif_input_queued(pvParameters))
+	{
+		return true;
+	}
 
 	/* move received packet into a new pbuf */
-	p = low_level_input( netif );
+	struct pbuf *p = low_level_input( (struct netif *)pvParameters );
 	if( p == NULL )
 	{
 		return false;
 	}
 
-	if( ERR_OK != netif->input( p, netif ) )
+	ethernetif_process((struct netif *)pvParameters, p);
+	return true;
+}
+
+/**
+ * \brief Move as many frames as possible from the EMAC into the RX queue. Called only by
+ * the EMAC RX interrupt.
+ *
+ * \param ul_status The RX status flags passed to the RX callback.
+ *
+ * \return Returns false if the queue filled up, so frames may be left in the EMAC.
+ */
+bool ethernetif_queue_frames(u32_t ul_status)
+{
+	if (ul_status & EMAC_RSR_OVR)
 	{
-		pbuf_free(p);
-		p = NULL;
+		gs_rx_stats.overruns++;
 	}
-	return true;
+	if (ul_status & EMAC_RSR_BNA)
+	{
+		gs_rx_stats.no_buffers++;
+	}
+
+	for (;;)
+	{
+		const u32_t used = gs_rx_head - gs_rx_tail;
+		if (used >= ETHERNET_RX_QUEUE_LENGTH)
+		{
+			gs_rx_stats.queue_full++;
+			return false;
+		}
+
+		struct rx_frame *f = &gs_rx_queue[gs_rx_head % ETHERNET_RX_QUEUE_LENGTH];
+		u32_t ul_frmlen;
+		const u32_t uc_rc = emac_dev_read(&gs_emac_dev, f->data, sizeof(f->data), &ul_frmlen);
+		if (uc_rc == EMAC_RX_NULL)
+		{
+			return true;
+		}
+		if (uc_rc != EMAC_OK)
+		{
+			LINK_STATS_INC(link.lenerr);
+			LINK_STATS_INC(link.drop);
+			continue;						/* the EMAC has discarded this frame, try the next one */
+		}
+
+		f->length = ul_frmlen;
+		__DMB();							/* fill the slot before handing it to the consumer */
+		gs_rx_head++;
+
+		gs_rx_stats.queued++;
+		if (used + 1 > gs_rx_stats.max_used)
+		{
+			gs_rx_stats.max_used = used + 1;
+		}
+	}
+}
+
+const struct ethernetif_rx_stats *ethernetif_get_rx_stats(void)
+{
+	return &gs_rx_stats;
 }
 
 
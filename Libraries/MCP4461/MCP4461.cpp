@@ -36,30 +36,42 @@ void MCP4461::setMCP4461Address(uint8_t mcp4461_addr) {
 	_mcp4461_address = mcp4461_addr;
 }
 
-void MCP4461::setVolatileWiper(uint8_t wiper, uint16_t wiper_value){
+uint8_t MCP4461::getMCP4461Address() const {
+	return _mcp4461_address;
+}
+
+//work out the two bytes that write a value to a volatile or non-volatile wiper, without sending them
+//this lets callers that cannot wait for the Wire library queue the write and send it themselves
+uint8_t MCP4461::wiperCommand(uint8_t wiper, uint16_t wiper_value, bool non_volatile, uint8_t& d_byte){
   uint16_t value = wiper_value;
   if (value > 0xFF) value = 0x100;
-  uint8_t d_byte = (uint8_t)value;
+  d_byte = (uint8_t)value;
   uint8_t c_byte;
   if (value > 0xFF)c_byte = 0x1; //the 8th data bit is 1
   else c_byte =0;
   switch (wiper) {
       case 0:
-        c_byte |= MCP4461_VW0;
+        c_byte |= (non_volatile) ? MCP4461_NVW0 : MCP4461_VW0;
         break;
       case 1:
-        c_byte |= MCP4461_VW1;
+        c_byte |= (non_volatile) ? MCP4461_NVW1 : MCP4461_VW1;
         break;
       case 2:
-        c_byte |= MCP4461_VW2;
+        c_byte |= (non_volatile) ? MCP4461_NVW2 : MCP4461_VW2;
         break;
       case 3:
-        c_byte |= MCP4461_VW3;
+        c_byte |= (non_volatile) ? MCP4461_NVW3 : MCP4461_VW3;
         break;
       default: 
         break; //not a valid wiper
   } 
   c_byte |= MCP4461_WRITE;
+  return c_byte;
+}
+
+void MCP4461::setVolatileWiper(uint8_t wiper, uint16_t wiper_value){
+  uint8_t d_byte;
+  uint8_t c_byte = wiperCommand(wiper, wiper_value, false, d_byte);
   //send command byte
   Wire1.beginTransmission(_mcp4461_address);
   Wire1.write(c_byte);
@@ -68,29 +80,8 @@ void MCP4461::setVolatileWiper(uint8_t wiper, uint16_t wiper_value){
   }
 
 void MCP4461::setNonVolatileWiper(uint8_t wiper, uint16_t wiper_value){
-  uint16_t value = wiper_value;
-  if (value > 0xFF) value = 0x100;
-  uint8_t d_byte = (uint8_t)value;
-  uint8_t c_byte;
-  if (value > 0xFF)c_byte = 0x1; //the 8th data bit is 1
-  else c_byte =0;
-  switch (wiper) {
-      case 0:
-        c_byte |= MCP4461_NVW0;
-        break;
-      case 1:
-        c_byte |= MCP4461_NVW1;
-        break;
-      case 2:
-        c_byte |= MCP4461_NVW2;
-        break;
-      case 3:
-        c_byte |= MCP4461_NVW3;
-        break;
-      default: 
-        break; //not a valid wiper
-  } 
-  c_byte |= MCP4461_WRITE;
+  uint8_t d_byte;
+  uint8_t c_byte = wiperCommand(wiper, wiper_value, true, d_byte);
   //send command byte
   Wire1.beginTransmission(_mcp4461_address);
   Wire1.write(c_byte);
@@ -34,6 +34,8 @@ public:
   MCP4461();
   void begin();
   void setMCP4461Address(uint8_t);
+  uint8_t getMCP4461Address() const;
+  static uint8_t wiperCommand(uint8_t, uint16_t, bool, uint8_t&); //build the command byte and data byte of a wiper write
   void setVolatileWiper(uint8_t, uint16_t);
   void setNonVolatileWiper(uint8_t, uint16_t);
   void setVolatileWipers(uint16_t);
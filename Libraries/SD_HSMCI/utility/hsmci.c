@@ -104,6 +104,11 @@ static uint32_t hsmci_transfert_pos;
 static uint16_t hsmci_block_size;
 //! Total number of block requested by last hsmci_adtc_start()
 static uint16_t hsmci_nb_block;
+//! True from hsmci_start_write_blocks() until the end of the write
+static bool hsmci_writing = false;
+//! True if the card may still be programming the last data written,
+//! because we returned without waiting for the end of its busy signal
+static bool hsmci_write_busy = false;
 
 static void hsmci_reset(void);
 static void hsmci_set_speed(uint32_t speed, uint32_t mck);
@@ -197,6 +202,15 @@ static bool hsmci_send_cmd_execute(uint32_t cmdr, sdmmc_cmd_def_t cmd,
 {
 	uint32_t sr;
 
+	// Let the card finish programming the data of the last write,
+	// if hsmci_is_busy() has not already found that it has
+	if (hsmci_write_busy) {
+		hsmci_write_busy = false;
+		if (!hsmci_wait_busy()) {
+			return false;
+		}
+	}
+
 	cmdr |= HSMCI_CMDR_CMDNB(cmd) | HSMCI_CMDR_SPCMD_STD;
 	if (cmd & SDMMC_RESP_PRESENT) {
 		cmdr |= HSMCI_CMDR_MAXLAT;
@@ -248,7 +262,12 @@ static bool hsmci_send_cmd_execute(uint32_t cmdr, sdmmc_cmd_def_t cmd,
 	} while (!(sr & HSMCI_SR_CMDRDY));
 
 	if (cmd & SDMMC_RESP_BUSY) {
-		if (!hsmci_wait_busy()) {
+		if (hsmci_writing && cmd == SDMMC_CMD12_STOP_TRANSMISSION) {
+			// End of a multiple block write. The card stays busy while it
+			// programs the blocks, so leave it to do that in the background.
+			hsmci_writing = false;
+			hsmci_write_busy = true;
+		} else if (!hsmci_wait_busy()) {
 			return false;
 		}
 	}
@@ -352,6 +371,19 @@ void hsmci_deselect_device(uint8_t slot)
 	// Nothing to do
 }
 
+bool hsmci_is_busy(void)
+{
+	uint32_t sr;
+
+	if (hsmci_write_busy) {
+		sr = HSMCI->HSMCI_SR;
+		if ((sr & HSMCI_SR_NOTBUSY) && ((sr & HSMCI_SR_DTIP) == 0)) {
+			hsmci_write_busy = false;
+		}
+	}
+	return hsmci_write_busy;
+}
+
 void hsmci_send_clock(void)
 {
 	// Configure command
@@ -408,6 +440,7 @@ bool hsmci_adtc_start(sdmmc_cmd_def_t cmd, uint32_t arg, uint16_t block_size, ui
 {
 	uint32_t cmdr;
 
+	hsmci_writing = false;
 #ifdef HSMCI_SR_DMADONE
 	if (access_block) {
 		// Enable DMA for HSMCI
@@ -688,6 +721,7 @@ bool hsmci_start_write_blocks(const void *src, uint16_t nb_block)
 
 	// Start DMA transfer
 	dmac_channel_enable(DMAC, CONF_HSMCI_DMA_CHANNEL);
+	hsmci_writing = true;
 	hsmci_transfert_pos += nb_data;
 	return true;
 }
@@ -713,6 +747,12 @@ bool hsmci_wait_end_of_write_blocks(void)
 			if (sr & HSMCI_SR_DMADONE) {
 				return true;
 			}
+		} else if (hsmci_nb_block == 1 && (sr & HSMCI_SR_BLKE)) {
+			// The block and its CRC status have been sent. Don't wait
+			// for the card to program it, see hsmci_is_busy().
+			hsmci_writing = false;
+			hsmci_write_busy = true;
+			return true;
 		}
 	} while (!(sr & HSMCI_SR_NOTBUSY));
 	Assert(HSMCI->HSMCI_SR & HSMCI_SR_FIFOEMPTY);
@@ -98,6 +98,15 @@ void hsmci_select_device(uint8_t slot, uint32_t clock, uint8_t bus_width,
  */
 void hsmci_deselect_device(uint8_t slot);
 
+/** \brief Check whether the card is still programming the data of the last write
+ * Note: Writes return once the data has been sent, without waiting for the
+ * card to program it. The next command waits if the card is still busy then,
+ * so callers that don't want to block can poll this first.
+ *
+ * \return true if the card is busy
+ */
+bool hsmci_is_busy(void);
+
 /** \brief Send 74 clock cycles on the line of selected slot
  * Note: It is required after card plug and before card install.
  */
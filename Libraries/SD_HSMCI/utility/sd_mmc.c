@@ -111,6 +111,7 @@
 #define driver_wait_end_of_read_blocks  ATPASTE2(driver, _wait_end_of_read_blocks)
 #define driver_start_write_blocks       ATPASTE2(driver, _start_write_blocks)
 #define driver_wait_end_of_write_blocks ATPASTE2(driver, _wait_end_of_write_blocks)
+#define driver_is_busy                  ATPASTE2(driver, _is_busy)
 
 
 #if (!defined SD_MMC_0_CD_GPIO) || (!defined SD_MMC_0_CD_DETECT_VALUE)
@@ -2035,6 +2036,11 @@ sd_mmc_err_t sd_mmc_wait_end_of_write_blocks(void)
 	return SD_MMC_OK;
 }
 
+bool sd_mmc_is_busy(void)
+{
+	return driver_is_busy();
+}
+
 #ifdef SDIO_SUPPORT_ENABLE
 sd_mmc_err_t sdio_read_direct(uint8_t slot, uint8_t func_num, uint32_t addr,
 		uint8_t *dest)
@@ -245,6 +245,16 @@ sd_mmc_err_t sd_mmc_start_write_blocks(const void *src, uint16_t nb_block);
  */
 sd_mmc_err_t sd_mmc_wait_end_of_write_blocks(void);
 
+/**
+ * \brief Check whether the card is still programming written data
+ *
+ * The next access waits for the card if it is. Callers that must not
+ * block can poll this and come back later instead.
+ *
+ * \return true if the card is busy
+ */
+bool sd_mmc_is_busy(void);
+
 #ifdef SDIO_SUPPORT_ENABLE
 /**
  * \brief Read one byte from SDIO using RW_DIRECT command.
@@ -108,6 +108,11 @@ void Move::Init()
   {
 	  rawExtruderPos[extruder] = 0.0;
   }
+  for(size_t drive = 0; drive < DRIVES; drive++)
+  {
+	  reportedCoordinates[drive] = NAN;
+  }
+  reportedAxesHomed = 0xFF;
 
   int8_t slow = platform->SlowestDrive();
   lastRingMove->Init(ep, platform->HomeFeedRate(slow), platform->InstantDv(slow), platform->MaxFeedrate(slow), platform->Acceleration(slow), 0, zeroExtruderPositions);
@@ -152,6 +157,41 @@ void Move::Init()
   active = true;
 }
 
+// Coordinates are reported with at most two decimal places, so smaller changes are ignored
+
+void Move::CheckStatusChanges()
+{
+	bool changed = false;
+	for(size_t drive = 0; drive < DRIVES; drive++)
+	{
+		const float coordinate = liveCoordinates[drive];
+		if (!(fabs(coordinate - reportedCoordinates[drive]) < 0.005))
+		{
+			reportedCoordinates[drive] = coordinate;
+			changed = true;
+		}
+	}
+
+	uint8_t axesHomed = 0;
+	for(uint8_t axis = 0; axis < AXES; axis++)
+	{
+		if (gCodes->GetAxisIsHomed(axis))
+		{
+			axesHomed |= (1 << axis);
+		}
+	}
+	if (axesHomed != reportedAxesHomed)
+	{
+		reportedAxesHomed = axesHomed;
+		changed = true;
+	}
+
+	if (changed)
+	{
+		reprap.StatusFieldChanged(statusCoords);
+	}
+}
+
 void Move::Exit()
 {
   platform->Message(BOTH_MESSAGE, "Move class exited.\n");
@@ -163,6 +203,10 @@ void Move::Spin()
 	if (!active)
 		return;
 
+	// Tell the status response if our coordinates have changed
+
+	CheckStatusChanges();
+
 	// Do some look-ahead work, if there's any to do
 
 	DoLookAhead();
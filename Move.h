@@ -275,6 +275,7 @@ class Move
     bool SetUpIsolatedMove(float to[], float feedRate,
     		bool axesOnly);
     bool SplitNextMove();								// Split the next move to improve 5-point bed compensation
+    void CheckStatusChanges();							// Flag the coordinates in the status response if they have changed
 
     Platform* platform;									// The RepRap machine
     GCodes* gCodes;										// The G Codes processing class
@@ -304,6 +305,8 @@ class Move
     volatile float liveCoordinates[DRIVES + 1];		// The last endpoint that the machine moved to
     float pauseCoordinates[DRIVES + 1];				// The endpoint we were at when the machine was paused
     volatile float rawExtruderPos[DRIVES - AXES];	// The raw and unmodified extruder positions
+    float reportedCoordinates[DRIVES];				// The live coordinates we last flagged for the status response
+    uint8_t reportedAxesHomed;						// Bitmap of the homed axes we last flagged for the status response
     float rawEDistances[DRIVES - AXES];				// The raw and untransformed E distances of the next move
     float nextMove[DRIVES + 1];  					// The endpoint of the next move to processExtra entry is for feedrate
     bool doingSplitMove;							// We need to split the move into two for five-point bed compensation
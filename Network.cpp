@@ -48,6 +48,8 @@ extern "C"
 {
 #include "lwipopts.h"
 #include "lwip/src/include/lwip/tcp.h"
+#include "lwip/src/include/lwip/udp.h"
+#include "lwip/src/sam/include/netif/ethernetif.h"
 #include "contrib/apps/netbios/netbios.h"
 }
 
@@ -61,12 +63,29 @@ static bool closingDataPort = false;
 static volatile bool lwipLocked = false;
 
 static NetworkTransaction *sendingTransaction = NULL;
-static char sendingWindow[TCP_WND];
+static char sendingWindow[TCP_WND] __attribute__ ((aligned(4)));		// word-aligned for the HSMCI DMA
 static uint16_t sendingWindowSize, sentDataOutstanding;
 static uint8_t sendingRetries;
 
 static uint16_t httpPort = 80;
 
+// Network statistics, reported by M122 and rr_network
+static const char * const protocolNames[numNetworkProtocols] = { "HTTP", "FTP", "FTP data", "Telnet" };
+static uint32_t connectionsAccepted[numNetworkProtocols] = { 0 };
+static uint32_t bytesReceived[numNetworkProtocols] = { 0 };
+static uint32_t bytesSent[numNetworkProtocols] = { 0 };
+static uint32_t windowsSent[numNetworkProtocols] = { 0 };		// number of tcp_write calls, each of up to TCP_WND bytes
+static uint32_t retransmits[numNetworkProtocols] = { 0 };		// windows sent again by conn_poll
+static uint32_t sendTimeouts = 0;								// connections aborted because sent data was not acknowledged
+static uint32_t sendBufferShortages = 0;
+static uint32_t transactionShortages = 0;
+static uint32_t connectionShortages = 0;
+static uint32_t httpRequests = 0;								// HTTP requests processed
+static uint32_t httpRequestsReused = 0;							// HTTP requests that arrived on a connection used before
+static uint32_t httpRequestsPipelined = 0;						// HTTP requests that arrived before the previous one was answered
+static uint32_t lastBytesReceived = 0, lastBytesSent = 0;		// totals at the last M122, to report the throughput
+static float lastDiagnosticsTime = 0.0;
+
 // Called only by LWIP to put out a message.
 // May be called from C as well as C++
 
@@ -103,18 +122,21 @@ void UnlockLWIP()
 
 static void emac_read_packet(uint32_t ul_status)
 {
-	// Because the LWIP stack can become corrupted if we work with it in parallel,
-	// we may have to wait for the next Spin() call to read the next packet.
+	// First move the new frames out of the EMAC buffer ring into the RX queue, so that the EMAC can receive more
+	const bool allQueued = ethernet_queue_frames(ul_status);
 
+	// Because the LWIP stack can become corrupted if we work with it in parallel, we pass the frames to it only
+	// if it is free. Otherwise the next Spin() call will do it.
 	if (LockLWIP())
 	{
 		do {
-			// read all queued packets from the RX buffer
+			// read all queued packets from the RX queue and the EMAC
 		} while (ethernet_read());
 		UnlockLWIP();
 	}
-	else
+	else if (!allQueued)
 	{
+		// The RX queue is full, so leave the remaining frames in the EMAC until Spin() has caught up
 		reprap.GetNetwork()->ReadPacket();
 		ethernet_set_rx_callback(NULL);
 	}
@@ -152,9 +174,11 @@ static err_t conn_poll(void *arg, tcp_pcb *pcb)
 		if (sendingRetries == 4)
 		{
 			reprap.GetPlatform()->Message(HOST_MESSAGE, "Network: Poll received error!\n");
+			++sendTimeouts;
 			tcp_abort(pcb);
 			return ERR_ABRT;
 		}
+		++retransmits[cs->protocol];
 
 		// Try to send the remaining data once again
 
@@ -321,8 +345,12 @@ void telnetd_init()
 Network::Network(Platform* p)
 	: platform(p), isEnabled(true), state(NetworkInactive), readingData(false),
 	  freeTransactions(NULL), readyTransactions(NULL), writingTransactions(NULL),
-	  dataCs(NULL), ftpCs(NULL), telnetCs(NULL), freeSendBuffers(NULL), freeConnections(NULL)
+	  dataCs(NULL), ftpCs(NULL), telnetCs(NULL), freeSendBuffers(NULL), freeConnections(NULL), pipelinedTransaction(NULL),
+	  telemetryPcb(NULL), telemetryPort(defaultTelemetryPort), telemetryInterval(0.0), telemetryFields(telemetryAllFields),
+	  lastTelemetryTime(0.0), telemetrySeq(0), telemetryFailures(0)
 {
+	memset(telemetryAddress, 0, sizeof(telemetryAddress));
+
 	for (size_t i = 0; i < networkTransactionCount; i++)
 	{
 		freeTransactions = new NetworkTransaction(freeTransactions);
@@ -392,11 +420,18 @@ void Network::Spin()
 			readingData = false;
 
 			do {
-				// read all queued packets from the RX buffer
+				// read all queued packets from the RX queue and the EMAC
 			} while (ethernet_read());
 
 			ethernet_set_rx_callback(&emac_read_packet);
 		}
+		else
+		{
+			while (ethernet_read_queued())
+			{
+				// pass on the frames queued by the RX interrupt while we were busy
+			}
+		}
 
 		// See if we can send anything
 
@@ -421,6 +456,9 @@ void Network::Spin()
 				PrependTransaction(&writingTransactions, rn);
 			}
 		}
+
+		// Send a telemetry datagram if one is due
+		SendTelemetry();
 	}
 	else if (state == NetworkInitializing && establish_ethernet_link())
 	{
@@ -452,36 +490,54 @@ void Network::Interrupt()
 void Network::Diagnostics()
 {
 	platform->AppendMessage(BOTH_MESSAGE, "Network Diagnostics:\n");
+	platform->AppendMessage(BOTH_MESSAGE, "Free connections: %u of %d\n", CountFreeConnections(), numConnections);
+	platform->AppendMessage(BOTH_MESSAGE, "Free transactions: %u of %d\n", CountFreeTransactions(), networkTransactionCount);
+	platform->AppendMessage(BOTH_MESSAGE, "Free send buffers: %u of %d\n", CountFreeSendBuffers(), tcpOutputBufferCount);
+	platform->AppendMessage(BOTH_MESSAGE, "Shortages: connections %u, transactions %u, send buffers %u; send timeouts %u\n",
+							connectionShortages, transactionShortages, sendBufferShortages, sendTimeouts);
 
-	uint8_t numFreeConnections = 0;
-	ConnectionState *freeConn = freeConnections;
-	while (freeConn != NULL)
+	uint32_t totalReceived = 0, totalSent = 0;
+	for (size_t i = 0; i < numNetworkProtocols; i++)
 	{
-		numFreeConnections++;
-		freeConn = freeConn->next;
+		platform->AppendMessage(BOTH_MESSAGE, "%s: %u connections, %u bytes in, %u bytes out in %u windows, %u retransmits\n",
+								protocolNames[i], connectionsAccepted[i], bytesReceived[i], bytesSent[i], windowsSent[i], retransmits[i]);
+		totalReceived += bytesReceived[i];
+		totalSent += bytesSent[i];
 	}
-	platform->AppendMessage(BOTH_MESSAGE, "Free connections: %d of %d\n", numFreeConnections, numConnections);
 
-	uint8_t numFreeTransactions = 0;
-	NetworkTransaction *freeTrans = freeTransactions;
-	while (freeTrans != NULL)
-	{
-		numFreeTransactions++;
-		freeTrans = freeTrans->next;
-	}
-	platform->AppendMessage(BOTH_MESSAGE, "Free transactions: %d of %d\n", numFreeTransactions, networkTransactionCount);
+	// Report how well HTTP clients make use of persistent connections
+	platform->AppendMessage(BOTH_MESSAGE, "HTTP requests: %u on %u connections, %u on reused connections, %u pipelined; %.1f requests per connection\n",
+							httpRequests, connectionsAccepted[protocolHttp], httpRequestsReused, httpRequestsPipelined,
+							(connectionsAccepted[protocolHttp] == 0) ? 0.0 : (float)httpRequests/(float)connectionsAccepted[protocolHttp]);
+	platform->AppendMessage(BOTH_MESSAGE, "Telemetry datagrams: %u sent, %u failed\n", telemetrySeq - telemetryFailures, telemetryFailures);
 
-	uint16_t numFreeSendBuffs = 0;
-	SendBuffer *freeSendBuff = freeSendBuffers;
-	while (freeSendBuff != NULL)
+	// Report the throughput since the last time we were asked
+	const float now = platform->Time();
+	const float interval = now - lastDiagnosticsTime;
+	if (interval > 0.0)
 	{
-		numFreeSendBuffs++;
-		freeSendBuff = freeSendBuff->next;
+		platform->AppendMessage(BOTH_MESSAGE, "Throughput: %.1f KiB/s in, %.1f KiB/s out\n",
+								(float)(totalReceived - lastBytesReceived)/(1024.0 * interval), (float)(totalSent - lastBytesSent)/(1024.0 * interval));
 	}
-	platform->AppendMessage(BOTH_MESSAGE, "Free send buffers: %d of %d\n", numFreeSendBuffs, tcpOutputBufferCount);
+	lastDiagnosticsTime = now;
+	lastBytesReceived = totalReceived;
+	lastBytesSent = totalSent;
 
+	const ethernetif_rx_stats *rxStats = ethernet_get_rx_stats();
+	platform->AppendMessage(BOTH_MESSAGE, "RX queue: %u frames queued, %u of %u slots used at most, full %u times; dropped: %u overruns, %u no buffer, %u no pbuf\n",
+							rxStats->queued, rxStats->max_used, ETHERNET_RX_QUEUE_LENGTH, rxStats->queue_full,
+							rxStats->overruns, rxStats->no_buffers, rxStats->pbuf_drops);
 
 #if LWIP_STATS
+	platform->AppendMessage(BOTH_MESSAGE, "LWIP TCP segments: %u sent, %u received, %u dropped, %u out of memory\n",
+							lwip_stats.tcp.xmit, lwip_stats.tcp.recv, lwip_stats.tcp.drop, lwip_stats.tcp.memerr);
+	platform->AppendMessage(BOTH_MESSAGE, "LWIP pools (used/max/size, failures): pbufs %u/%u/%u %u, TCP segments %u/%u/%u %u, TCP PCBs %u/%u/%u %u\n",
+							lwip_stats.memp[MEMP_PBUF_POOL].used, lwip_stats.memp[MEMP_PBUF_POOL].max, lwip_stats.memp[MEMP_PBUF_POOL].avail, lwip_stats.memp[MEMP_PBUF_POOL].err,
+							lwip_stats.memp[MEMP_TCP_SEG].used, lwip_stats.memp[MEMP_TCP_SEG].max, lwip_stats.memp[MEMP_TCP_SEG].avail, lwip_stats.memp[MEMP_TCP_SEG].err,
+							lwip_stats.memp[MEMP_TCP_PCB].used, lwip_stats.memp[MEMP_TCP_PCB].max, lwip_stats.memp[MEMP_TCP_PCB].avail, lwip_stats.memp[MEMP_TCP_PCB].err);
+	platform->AppendMessage(BOTH_MESSAGE, "LWIP heap: %u used, %u max, %u size, %u failures\n",
+							lwip_stats.mem.used, lwip_stats.mem.max, lwip_stats.mem.avail, lwip_stats.mem.err);
+
 	// Normally we should NOT try to display LWIP stats here, because it uses debugPrintf(), which will hang the system is no USB cable is connected.
 	if (reprap.Debug(moduleNetwork))
 	{
@@ -490,6 +546,66 @@ void Network::Diagnostics()
 #endif
 }
 
+// Report the network statistics as a JSON object for rr_network. The counters are never reset, so clients can work out
+// the throughput from the difference between two responses.
+void Network::GetStatisticsResponse(StringRef& response) const
+{
+	response.printf("{\"uptime\":%.1f,\"protocols\":[", platform->Time());
+	for (size_t i = 0; i < numNetworkProtocols; i++)
+	{
+		response.catf("%c{\"name\":\"%s\",\"connections\":%u,\"rxBytes\":%u,\"txBytes\":%u,\"txWindows\":%u,\"retransmits\":%u}",
+						(i == 0) ? ' ' : ',', protocolNames[i], connectionsAccepted[i], bytesReceived[i], bytesSent[i], windowsSent[i], retransmits[i]);
+	}
+	response.catf("],\"free\":{\"connections\":%u,\"transactions\":%u,\"sendBuffers\":%u}",
+					CountFreeConnections(), CountFreeTransactions(), CountFreeSendBuffers());
+	response.catf(",\"http\":{\"requests\":%u,\"reused\":%u,\"pipelined\":%u}",
+					httpRequests, httpRequestsReused, httpRequestsPipelined);
+	response.catf(",\"shortages\":{\"connections\":%u,\"transactions\":%u,\"sendBuffers\":%u},\"sendTimeouts\":%u",
+					connectionShortages, transactionShortages, sendBufferShortages, sendTimeouts);
+	const ethernetif_rx_stats *rxStats = ethernet_get_rx_stats();
+	response.catf(",\"rxQueue\":{\"size\":%u,\"queued\":%u,\"maxUsed\":%u,\"full\":%u,\"overruns\":%u,\"noBuffers\":%u,\"pbufDrops\":%u}",
+					ETHERNET_RX_QUEUE_LENGTH, rxStats->queued, rxStats->max_used, rxStats->queue_full,
+					rxStats->overruns, rxStats->no_buffers, rxStats->pbuf_drops);
+#if LWIP_STATS
+	response.catf(",\"tcp\":{\"xmit\":%u,\"recv\":%u,\"drop\":%u,\"memerr\":%u}",
+					lwip_stats.tcp.xmit, lwip_stats.tcp.recv, lwip_stats.tcp.drop, lwip_stats.tcp.memerr);
+	response.catf(",\"pbufPool\":[%u,%u,%u,%u],\"tcpSegPool\":[%u,%u,%u,%u]",
+					lwip_stats.memp[MEMP_PBUF_POOL].used, lwip_stats.memp[MEMP_PBUF_POOL].max, lwip_stats.memp[MEMP_PBUF_POOL].avail, lwip_stats.memp[MEMP_PBUF_POOL].err,
+					lwip_stats.memp[MEMP_TCP_SEG].used, lwip_stats.memp[MEMP_TCP_SEG].max, lwip_stats.memp[MEMP_TCP_SEG].avail, lwip_stats.memp[MEMP_TCP_SEG].err);
+#endif
+	response.cat("}");
+}
+
+unsigned int Network::CountFreeConnections() const
+{
+	unsigned int numFreeConnections = 0;
+	for (const ConnectionState *freeConn = freeConnections; freeConn != NULL; freeConn = freeConn->next)
+	{
+		numFreeConnections++;
+	}
+	return numFreeConnections;
+}
+
+unsigned int Network::CountFreeTransactions() const
+{
+	unsigned int numFreeTransactions = 0;
+	for (const NetworkTransaction *freeTrans = freeTransactions; freeTrans != NULL; freeTrans = freeTrans->next)
+	{
+		numFreeTransactions++;
+	}
+	return numFreeTransactions;
+}
+
+unsigned int Network::CountFreeSendBuffers() const
+{
+	unsigned int numFreeSendBuffs = 0;
+	for (const SendBuffer *freeSendBuff = freeSendBuffers; freeSendBuff != NULL; freeSendBuff = freeSendBuff->next)
+	{
+		numFreeSendBuffs++;
+	}
+	return numFreeSendBuffs;
+}
+
 void Network::Enable()
 {
 	if (!isEnabled)
@@ -543,6 +659,7 @@ bool Network::AllocateSendBuffer(SendBuffer *&buffer)
 	buffer = freeSendBuffers;
 	if (buffer == NULL)
 	{
+		++sendBufferShortages;
 		platform->Message(HOST_MESSAGE, "Network: Could not allocate send buffer!\n");
 		return false;
 	}
@@ -604,6 +721,7 @@ ConnectionState *Network::ConnectionAccepted(tcp_pcb *pcb)
 	ConnectionState *cs = freeConnections;
 	if (cs == NULL)
 	{
+		++connectionShortages;
 		platform->Message(HOST_MESSAGE, "Network::ConnectionAccepted() - no free ConnectionStates!\n");
 		return NULL;
 	}
@@ -611,12 +729,14 @@ ConnectionState *Network::ConnectionAccepted(tcp_pcb *pcb)
 	NetworkTransaction* r = freeTransactions;
 	if (r == NULL)
 	{
+		++transactionShortages;
 		platform->Message(HOST_MESSAGE, "Network::ConnectionAccepted() - no free transactions!\n");
 		return NULL;
 	}
 
 	freeConnections = cs->next;
 	cs->Init(pcb);
+	++connectionsAccepted[cs->protocol];
 
 	r->Set(NULL, cs, connected);
 	freeTransactions = r->next;
@@ -685,6 +805,7 @@ void Network::ConnectionClosedGracefully(ConnectionState *cs)
 	NetworkTransaction* r = freeTransactions;
 	if (r == NULL)
 	{
+		++transactionShortages;
 		platform->Message(HOST_MESSAGE, "Network::ConnectionClosedGracefully() - no free transactions!\n");
 		return;
 	}
@@ -719,9 +840,11 @@ void Network::ReceiveInput(pbuf *pb, ConnectionState* cs)
 	NetworkTransaction* r = freeTransactions;
 	if (r == NULL)
 	{
+		++transactionShortages;
 		platform->Message(HOST_MESSAGE, "Network::ReceiveInput() - no free transactions!\n");
 		return;
 	}
+	bytesReceived[cs->protocol] += pb->tot_len;
 
 	freeTransactions = r->next;
 	r->Set(pb, cs, dataReceiving);
@@ -787,9 +910,108 @@ NetworkTransaction *Network::GetTransaction(const ConnectionState *cs)
 	return NULL;
 }
 
+// Move the unprocessed input of a transaction that is about to be used for sending to a new transaction.
+// The new one goes to the head of readyTransactions, so the next request on this connection is processed next.
+bool Network::KeepPipelinedInput(NetworkTransaction *r)
+{
+	NetworkTransaction *p = freeTransactions;
+	if (p == NULL)
+	{
+		++transactionShortages;
+		return false;
+	}
+
+	freeTransactions = p->next;
+	p->Set(r->pb, r->cs, dataReceiving);
+	p->bufferLength = r->bufferLength;
+	p->inputPointer = r->inputPointer;
+	r->pb = NULL;
+	r->bufferLength = 0;
+
+	PrependTransaction(&readyTransactions, p);
+	pipelinedTransaction = p;
+	return true;
+}
+
+// Move the current transaction and any others on the same connection behind all other ready transactions.
+// This is used when a transaction cannot be processed yet, so that it does not hold up the other connections.
+void Network::DeferTransaction()
+{
+	NetworkTransaction *r = readyTransactions;
+	if (r == NULL || r->next == NULL)
+	{
+		return;
+	}
+
+	const ConnectionState *cs = r->cs;
+	NetworkTransaction *deferred = NULL;
+	NetworkTransaction * volatile *deferredTail = &deferred;
+	NetworkTransaction * volatile *list = &readyTransactions;
+	while (*list != NULL)
+	{
+		NetworkTransaction *t = *list;
+		if (t->cs == cs)
+		{
+			*list = t->next;
+			t->next = NULL;
+			*deferredTail = t;
+			deferredTail = &t->next;
+		}
+		else
+		{
+			list = &t->next;
+		}
+	}
+	*list = deferred;
+}
+
+// Called by the webserver when a protocol interpreter has processed a complete request from transaction req.
+// The last 'unprocessed' bytes of the buffer it read have not been used yet and must be processed next time.
+// countRequest is false when only the start of a request has been processed and the rest will follow.
+void Network::RequestProcessed(NetworkTransaction *req, unsigned int unprocessed, bool countRequest)
+{
+	NetworkTransaction *p = pipelinedTransaction;
+	pipelinedTransaction = NULL;
+
+	ConnectionState *cs = req->GetConnection();
+	if (countRequest && cs != NULL && cs->protocol == protocolHttp)
+	{
+		++httpRequests;
+		if (cs->requestsProcessed != 0)
+		{
+			++httpRequestsReused;
+		}
+		++cs->requestsProcessed;
+	}
+
+	if (readyTransactions == req)
+	{
+		// No response has been sent yet, so the transaction still holds the input
+		req->UnreadBuffer(unprocessed);
+	}
+	else if (p != NULL && readyTransactions == p && p->cs == cs)
+	{
+		// The response has been sent and the remaining input has been moved to a new transaction.
+		// Free that one again if no further request has arrived with this one.
+		p->UnreadBuffer(unprocessed);
+		if (p->pb != NULL && p->inputPointer < p->pb->tot_len)
+		{
+			if (cs != NULL && cs->protocol == protocolHttp)
+			{
+				++httpRequestsPipelined;
+			}
+		}
+		else
+		{
+			CloseTransaction();
+		}
+	}
+}
+
 // Send the output data we already have, optionally with a file appended, then close the connection unless keepConnectionOpen is true.
 // The file may be too large for our buffer, so we may have to send it in multiple transactions.
-void Network::SendAndClose(FileStore *f, bool keepConnectionOpen)
+// Only fileBytes bytes are sent from the current position of the file, which allows parts of a file to be sent.
+void Network::SendAndClose(FileStore *f, bool keepConnectionOpen, uint32_t fileBytes)
 {
 	NetworkTransaction *r = readyTransactions;
 	if (r == NULL)
@@ -822,9 +1044,20 @@ void Network::SendAndClose(FileStore *f, bool keepConnectionOpen)
 		}
 		else
 		{
+			// Clients may send further requests on a persistent connection before they get our response, so keep
+			// any input we have not processed yet. If we cannot do that, close the connection to make them retry.
+			if (keepConnectionOpen && r->pb != NULL && !KeepPipelinedInput(r))
+			{
+				keepConnectionOpen = false;
+			}
 			r->FreePbuf();
 			r->cs->persistConnection = keepConnectionOpen;
+			if (f != NULL)
+			{
+				f->SetAccessClass(sdAccessWebFile);
+			}
 			r->fileBeingSent = f;
+			r->fileBytesLeft = fileBytes;
 			r->status = dataSending;
 			if (f != NULL && r->sendBuffer == NULL)
 			{
@@ -989,6 +1222,11 @@ bool Network::AcquireTelnetTransaction()
 	return AcquireTransaction(telnetCs);
 }
 
+bool Network::AcquireHttpTransaction(ConnectionState *cs)
+{
+	return AcquireTransaction(cs);
+}
+
 // Retrieves the NetworkTransaction of a sending connection to which data can be appended to,
 // or prepares a released NetworkTransaction, which can easily be sent via SendAndClose.
 bool Network::AcquireTransaction(ConnectionState *cs)
@@ -1028,6 +1266,7 @@ bool Network::AcquireTransaction(ConnectionState *cs)
 		transactionToUse = freeTransactions;
 		if (transactionToUse == NULL)
 		{
+			++transactionShortages;
 			platform->Message(HOST_MESSAGE, "Network: Could not acquire free transaction!\n");
 			return false;
 		}
@@ -1040,6 +1279,60 @@ bool Network::AcquireTransaction(ConnectionState *cs)
 	return true;
 }
 
+void Network::SetTelemetryAddress(const uint8_t ip[4])
+{
+	memcpy(telemetryAddress, ip, sizeof(telemetryAddress));
+}
+
+// Send a compact status datagram to the telemetry host or multicast group every telemetryInterval seconds.
+// This is called from Spin, so we already own LWIP.
+void Network::SendTelemetry()
+{
+	if (telemetryInterval <= 0.0 || telemetryPort == 0 || telemetryAddress[0] == 0)
+	{
+		return;
+	}
+
+	const float now = platform->Time();
+	if (now - lastTelemetryTime < telemetryInterval)
+	{
+		return;
+	}
+	lastTelemetryTime = now;
+
+	++telemetrySeq;
+	if (telemetryPcb == NULL)
+	{
+		telemetryPcb = udp_new();
+		if (telemetryPcb == NULL)
+		{
+			++telemetryFailures;
+			return;
+		}
+	}
+
+	char telemetryBuffer[telemetryLength];
+	StringRef datagram(telemetryBuffer, ARRAY_SIZE(telemetryBuffer));
+	reprap.GetTelemetryResponse(datagram, telemetryFields, telemetrySeq);
+	const size_t length = datagram.strlen();
+
+	pbuf *p = pbuf_alloc(PBUF_TRANSPORT, length, PBUF_RAM);
+	if (p == NULL)
+	{
+		++telemetryFailures;
+		return;
+	}
+	memcpy(p->payload, telemetryBuffer, length);
+
+	ip_addr_t destination;
+	IP4_ADDR(&destination, telemetryAddress[0], telemetryAddress[1], telemetryAddress[2], telemetryAddress[3]);
+	if (udp_sendto(telemetryPcb, p, &destination, telemetryPort) != ERR_OK)
+	{
+		++telemetryFailures;
+	}
+	pbuf_free(p);
+}
+
 // Set the DHCP hostname. Removes all whitespaces and converts the name to lower-case.
 void Network::SetHostname(const char *name)
 {
@@ -1075,6 +1368,13 @@ void ConnectionState::Init(tcp_pcb *p)
 	next = NULL;
 	sendingTransaction = NULL;
 	persistConnection = true;
+	requestsProcessed = 0;
+
+	const uint16_t localPort = p->local_port;
+	protocol = (localPort == ftpPort) ? protocolFtp
+				: (localPort == telnetPort) ? protocolTelnet
+				: (localPort == reprap.GetNetwork()->GetHttpPort()) ? protocolHttp
+				: protocolFtpData;
 }
 
 // Get local port from a ConnectionState
@@ -1106,6 +1406,7 @@ void NetworkTransaction::Set(pbuf *p, ConnectionState *c, TransactionStatus s)
 	inputPointer = 0;
 	sendBuffer = NULL;
 	fileBeingSent = NULL;
+	fileBytesLeft = 0;
 	closeRequested = false;
 	nextWrite = NULL;
 	lastWriteTime = NAN;
@@ -1148,7 +1449,7 @@ bool NetworkTransaction::Read(char& b)
 	return true;
 }
 
-// Read an entire pbuf from the NetworkTransaction
+// Read the rest of the current pbuf from the NetworkTransaction
 bool NetworkTransaction::ReadBuffer(char *&buffer, unsigned int &len)
 {
 	if (LostConnection() || pb == NULL)
@@ -1174,13 +1475,22 @@ bool NetworkTransaction::ReadBuffer(char *&buffer, unsigned int &len)
 		}
 	}
 
-	len = pb->len;
-	buffer = static_cast<char *>(pb->payload);
+	len = pb->len - inputPointer;
+	buffer = static_cast<char *>(pb->payload) + inputPointer;
 	inputPointer += len;
 
 	return true;
 }
 
+// Give back the last 'len' bytes returned by ReadBuffer, so that they can be read again
+void NetworkTransaction::UnreadBuffer(unsigned int len)
+{
+	if (pb != NULL && len <= inputPointer)
+	{
+		inputPointer -= len;
+	}
+}
+
 // Webserver calls this to write bytes that need to go out to the network
 
 void NetworkTransaction::Write(char b)
@@ -1370,6 +1680,7 @@ bool NetworkTransaction::Send()
 			if (timeNow - lastWriteTime > writeTimeout)
 			{
 				reprap.GetPlatform()->Message(HOST_MESSAGE, "Network: Timing out connection cs=%08x\n", (unsigned int)cs);
+				++sendTimeouts;
 				tcp_abort(cs->pcb);
 				cs->pcb = NULL;
 			}
@@ -1398,18 +1709,31 @@ bool NetworkTransaction::Send()
 	{
 		int bytesRead;
 		size_t bytesToRead;
+		MassStorage *storage = reprap.GetPlatform()->GetMassStorage();
 		while (bytesLeftToSend && fileBeingSent != NULL)
 		{
-			bytesToRead = min<size_t>(256, bytesLeftToSend);  // FIXME: doesn't work with higher block sizes
+			// Fill the window with as few reads as possible. If the window is larger than a sector, stop at a sector
+			// boundary of the file, so that the next read can transfer whole sectors straight into our buffer.
+			bytesToRead = min<size_t>(bytesLeftToSend, fileBytesLeft);
+			if (bytesToRead > SECTOR_LEN)
+			{
+				const size_t sectorEnd = (fileBeingSent->Position() + bytesToRead) & ~(SECTOR_LEN - 1);
+				bytesToRead = sectorEnd - fileBeingSent->Position();
+			}
+			if (!storage->CanAccess(sdAccessWebFile, bytesToRead))
+			{
+				break;
+			}
 			bytesRead = fileBeingSent->Read(sendingWindow + bytesBeingSent, bytesToRead);
 
 			if (bytesRead > 0)
 			{
 				bytesBeingSent += bytesRead;
 				bytesLeftToSend = TCP_WND - bytesBeingSent;
+				fileBytesLeft -= bytesRead;
 			}
 
-			if (bytesRead != bytesToRead)
+			if (bytesRead != bytesToRead || fileBytesLeft == 0)
 			{
 				fileBeingSent->Close();
 				fileBeingSent = NULL;
@@ -1419,6 +1743,12 @@ bool NetworkTransaction::Send()
 
 	if (!bytesBeingSent)
 	{
+		// If we still have a file to send, the SD card is busy with the print file, so try again next time
+		if (fileBeingSent != NULL)
+		{
+			return false;
+		}
+
 		// If we have no data to send and fileBeingSent is NULL, we can close the connection
 		if (!cs->persistConnection && nextWrite == NULL)
 		{
@@ -1446,6 +1776,8 @@ bool NetworkTransaction::Send()
 			sendingTransaction = this;
 			sendingRetries = 0;
 			sendingWindowSize = sentDataOutstanding = bytesBeingSent;
+			bytesSent[cs->protocol] += bytesBeingSent;
+			++windowsSent[cs->protocol];
 
 			lastWriteTime = reprap.GetPlatform()->Time();
 
@@ -36,6 +36,16 @@ const uint8_t numConnections = 16;							// number of ConnectionState instances
 const uint8_t networkTransactionCount = 24;					// number of NetworkTransactions to be used for network IO
 const float writeTimeout = 4.0;	 							// seconds to wait for data we have written to be acknowledged
 
+// UDP telemetry, configured by M586. Each field of the datagram can be selected by a bit of the M586 F parameter.
+const uint16_t defaultTelemetryPort = 10000;
+const size_t telemetryLength = 512;							// maximum size of a telemetry datagram
+const unsigned int telemetryState = 1;						// status character and sequence number
+const unsigned int telemetryTemps = 2;						// current and active heater temperatures
+const unsigned int telemetryProgress = 4;					// fraction of the file printed
+const unsigned int telemetryPosition = 8;					// XYZ position
+const unsigned int telemetryErrors = 16;					// heater faults
+const unsigned int telemetryAllFields = 31;
+
 #define IP_ADDRESS {192, 168, 1, 10} // Need some sort of default...
 #define NET_MASK {255, 255, 255, 0}
 #define GATE_WAY {192, 168, 1, 1}
@@ -45,11 +55,22 @@ const float writeTimeout = 4.0;	 							// seconds to wait for data we have writ
 /****************************************************************************************************/
 
 struct tcp_pcb;
+struct udp_pcb;
 struct pbuf;
 
 class NetworkTransaction;
 class SendBuffer;
 
+// Protocols for which network statistics are kept
+enum NetworkProtocol
+{
+	protocolHttp = 0,
+	protocolFtp = 1,
+	protocolFtpData = 2,
+	protocolTelnet = 3,
+	numNetworkProtocols
+};
+
 // ConnectionState structure that we use to track TCP connections. It is usually combined with NetworkTransactions.
 struct ConnectionState
 {
@@ -57,6 +78,8 @@ struct ConnectionState
 	NetworkTransaction *sendingTransaction;		// NetworkTransaction that is currently sending via this connection
 	ConnectionState *next;						// next ConnectionState in this list
 	bool persistConnection;						// do we expect this connection to stay alive?
+	uint16_t requestsProcessed;					// number of requests received on this connection, used for statistics
+	uint8_t protocol;							// NetworkProtocol of this connection, used for statistics
 
 	void Init(tcp_pcb *p);
 	uint16_t GetLocalPort() const;
@@ -85,6 +108,7 @@ public:
 	uint16_t DataLength() const;
 	bool Read(char& b);
 	bool ReadBuffer(char *&buffer, unsigned int &len);
+	void UnreadBuffer(unsigned int len);
 	void Write(char b);
 	void Write(const char* s);
 	void Write(StringRef ref);
@@ -113,6 +137,7 @@ private:
 
 	SendBuffer *sendBuffer;
 	FileStore *fileBeingSent;
+	uint32_t fileBytesLeft;						// number of bytes of fileBeingSent still to be sent
 
 	TransactionStatus status;
 	float lastWriteTime;
@@ -151,8 +176,10 @@ public:
 	void ConnectionClosedGracefully(ConnectionState *cs);
 
 	NetworkTransaction *GetTransaction(const ConnectionState *cs = NULL);
-	void SendAndClose(FileStore *f, bool keepConnectionOpen = false);
+	void SendAndClose(FileStore *f, bool keepConnectionOpen = false, uint32_t fileBytes = 0xFFFFFFFF);
 	void CloseTransaction();
+	void RequestProcessed(NetworkTransaction *req, unsigned int unprocessed, bool countRequest = true);
+	void DeferTransaction();
 	void WaitForDataConection();
 
 	void OpenDataPort(uint16_t port);
@@ -167,12 +194,14 @@ public:
 	bool AcquireFTPTransaction();
 	bool AcquireDataTransaction();
 	bool AcquireTelnetTransaction();
+	bool AcquireHttpTransaction(ConnectionState *cs);
 
 	Network(Platform* p);
 	void Init();
 	void Spin();
 	void Interrupt();
 	void Diagnostics();
+	void GetStatisticsResponse(StringRef& response) const;
 
 	bool Lock();
 	void Unlock();
@@ -187,6 +216,15 @@ public:
 
 	void SetHostname(const char *name);
 
+	void SetTelemetryAddress(const uint8_t ip[4]);
+	const uint8_t *GetTelemetryAddress() const { return telemetryAddress; }
+	void SetTelemetryPort(uint16_t port) { telemetryPort = port; }
+	uint16_t GetTelemetryPort() const { return telemetryPort; }
+	void SetTelemetryInterval(float seconds) { telemetryInterval = seconds; }
+	float GetTelemetryInterval() const { return telemetryInterval; }
+	void SetTelemetryFields(unsigned int fields) { telemetryFields = fields; }
+	unsigned int GetTelemetryFields() const { return telemetryFields; }
+
 private:
 
 	Platform* platform;
@@ -195,10 +233,17 @@ private:
 	void AppendTransaction(NetworkTransaction* volatile * list, NetworkTransaction *r);
 	void PrependTransaction(NetworkTransaction* volatile * list, NetworkTransaction *r);
 	bool AcquireTransaction(ConnectionState *cs);
+	bool KeepPipelinedInput(NetworkTransaction *r);
 
 	bool AllocateSendBuffer(SendBuffer *&buffer);
 	SendBuffer *ReleaseSendBuffer(SendBuffer *buffer);
 
+	unsigned int CountFreeConnections() const;
+	unsigned int CountFreeTransactions() const;
+	unsigned int CountFreeSendBuffers() const;
+
+	void SendTelemetry();
+
 	NetworkTransaction * volatile freeTransactions;
 	NetworkTransaction * volatile readyTransactions;
 	NetworkTransaction * volatile writingTransactions;
@@ -213,8 +258,18 @@ private:
 	ConnectionState *telnetCs;
 
 	ConnectionState * volatile freeConnections;
+	NetworkTransaction *pipelinedTransaction;		// transaction holding input that arrived with the last request processed
 
 	SendBuffer *freeSendBuffers;
+
+	udp_pcb *telemetryPcb;
+	uint8_t telemetryAddress[4];
+	uint16_t telemetryPort;
+	float telemetryInterval;		// seconds between datagrams, 0 if telemetry is disabled
+	unsigned int telemetryFields;
+	float lastTelemetryTime;
+	uint32_t telemetrySeq;
+	uint32_t telemetryFailures;
 };
 
 #endif
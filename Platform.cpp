@@ -21,6 +21,7 @@
 
 #include "RepRapFirmware.h"
 #include "DueFlashStorage.h"
+#include "Wire.h"
 
 extern char _end;
 extern "C" char *sbrk(int i);
@@ -87,7 +88,7 @@ bool PidParameters::operator==(const PidParameters& other) const
 	return kI == other.kI && kD == other.kD && kP == other.kP && kT == other.kT && kS == other.kS
 				&& fullBand == other.fullBand && pidMin == other.pidMin
 				&& pidMax == other.pidMax && thermistorBeta == other.thermistorBeta && thermistorInfR == other.thermistorInfR
-				&& thermistorSeriesR == other.thermistorSeriesR && adcLowOffset == other.adcLowOffset
+				&& thermistorSeriesR == other.thermistorSeriesR && thermistorShC == other.thermistorShC && adcLowOffset == other.adcLowOffset
 				&& adcHighOffset == other.adcHighOffset;
 
 }
@@ -97,10 +98,11 @@ bool PidParameters::operator==(const PidParameters& other) const
 
 Platform::Platform() :
 		tickState(0), fileStructureInitialised(false), active(false), errorCodeBits(0), debugCode(0),
-		messageString(messageStringBuffer, ARRAY_SIZE(messageStringBuffer)), autoSaveEnabled(false)
+		messageString(messageStringBuffer, ARRAY_SIZE(messageStringBuffer)), autoSaveEnabled(false),
+		nvLog(FlashData::logAddress, FlashData::logBankLength)
 {
-	line = new Line(SerialUSB);
-	aux = new Line(Serial);
+	line = new Line(SerialUSB, usbLineInBufsize);
+	aux = new Line(Serial, auxLineInBufsize);
 
 	// Files
 
@@ -129,9 +131,12 @@ void Platform::Init()
 	SerialUSB.begin(baudRates[0]);
 	Serial.begin(baudRates[1]);					// this can't be done in the constructor because the Arduino port initialisation isn't complete at that point
 
-	static_assert(sizeof(FlashData) + sizeof(SoftwareResetData) <= 1024, "NVData too large");
+	static_assert(sizeof(SoftwareResetData) <= FlashData::logAddress, "SoftwareResetData too large");
 
 	ResetNvData();
+	nvDataDirty = false;
+	nvDataChangedTime = 0.0;
+	nvWriteRecord = 0;
 
 	line->Init();
 	aux->Init();
@@ -153,6 +158,11 @@ void Platform::Init()
 
 	mcpDuet.begin(); //only call begin once in the entire execution, this begins the I2C comms on that channel for all objects
 	mcpExpansion.setMCP4461Address(0x2E); //not required for mcpDuet, as this uses the default address
+	potsPending = 0;
+	potWriteState = PotWriteState::idle;
+	potWriteStateTime = 0;
+	potWriteDrive = 0;
+	potWrites = potWritesCoalesced = potWritesFailed = 0;
 	sysDir = SYS_DIR;
 	configFile = CONFIG_FILE;
 	defaultFile = DEFAULT_FILE;
@@ -232,6 +242,8 @@ void Platform::Init()
 			pinMode(highStopPins[drive], INPUT_PULLUP);
 		}
 		motorCurrents[drive] = 0.0;
+		potValues[drive] = 0;
+		potValuesSent[drive] = potValueUnknown;
 		DisableDrive(drive);
 		driveState[drive] = DriveStatus::disabled;
 	}
@@ -248,14 +260,9 @@ void Platform::Init()
 		analogReadResolution(12);
 		thermistorFilters[heater].Init(analogRead(tempSensePins[heater]));
 		heaterAdcChannels[heater] = PinToAdcChannel(tempSensePins[heater]);
-
-		// Calculate and store the ADC average sum that corresponds to an overheat condition, so that we can check is quickly in the tick ISR
-		float thermistorOverheatResistance = nvData.pidParams[heater].GetRInf()
-				* exp(-nvData.pidParams[heater].GetBeta() / (BAD_HIGH_TEMPERATURE - ABS_ZERO));
-		float thermistorOverheatAdcValue = (adRangeReal + 1) * thermistorOverheatResistance
-				/ (thermistorOverheatResistance + nvData.pidParams[heater].thermistorSeriesR);
-		thermistorOverheatSums[heater] = (uint32_t) (thermistorOverheatAdcValue + 0.9) * numThermistorReadingsAveraged;
+		UpdateThermistorTable(heater);
 	}
+	UpdateAdcChannels();
 
 	if (coolingFanPin >= 0)
 	{
@@ -278,6 +285,7 @@ void Platform::SetThermistorNumber(size_t heater, size_t thermistor)
 //pre(heater < HEATERS && thermistor < HEATERS)
 {
 	heaterAdcChannels[heater] = PinToAdcChannel(tempSensePins[thermistor]);
+	UpdateAdcChannels();
 }
 
 int Platform::GetThermistorNumber(size_t heater) const
@@ -318,7 +326,7 @@ void Platform::InitZProbe()
 
 int Platform::GetRawZHeight() const
 {
-	return (nvData.zProbeType != 0) ? analogRead(zProbePin) : 0;
+	return (nvData.zProbeType != 0) ? GetAdcReading(zProbeAdcChannel) : 0;		// the latest conversion by the tick ISR
 }
 
 // Return the Z probe data.
@@ -383,7 +391,7 @@ void Platform::SetZProbeAxes(const bool axes[AXES])
 
 	if (autoSaveEnabled)
 	{
-		WriteNvData();
+		ScheduleNvWrite();
 	}
 }
 
@@ -419,8 +427,9 @@ void Platform::SetZProbeType(int pt)
 		nvData.zProbeType = newZProbeType;
 		if (autoSaveEnabled)
 		{
-			WriteNvData();
+			ScheduleNvWrite();
 		}
+		reprap.StatusFieldChanged(statusStatic);
 	}
 	InitZProbe();
 }
@@ -443,7 +452,7 @@ void Platform::SetZProbeChannel(int channel)
 		nvData.zProbeChannel = channel;
 		if (autoSaveEnabled)
 		{
-			WriteNvData();
+			ScheduleNvWrite();
 		}
 	}
 }
@@ -469,6 +478,7 @@ bool Platform::GetZProbeParameters(struct ZProbeParameters& params) const
 
 bool Platform::SetZProbeParameters(const struct ZProbeParameters& params)
 {
+	reprap.StatusFieldChanged(statusStatic);
 	switch (nvData.zProbeType)
 	{
 	case 0:
@@ -477,7 +487,7 @@ bool Platform::SetZProbeParameters(const struct ZProbeParameters& params)
 			nvData.switchZProbeParameters = params;
 			if (autoSaveEnabled)
 			{
-				WriteNvData();
+				ScheduleNvWrite();
 			}
 		}
 		return true;
@@ -488,7 +498,7 @@ bool Platform::SetZProbeParameters(const struct ZProbeParameters& params)
 			nvData.irZProbeParameters = params;
 			if (autoSaveEnabled)
 			{
-				WriteNvData();
+				ScheduleNvWrite();
 			}
 		}
 		return true;
@@ -498,7 +508,7 @@ bool Platform::SetZProbeParameters(const struct ZProbeParameters& params)
 			nvData.alternateZProbeParameters = params;
 			if (autoSaveEnabled)
 			{
-				WriteNvData();
+				ScheduleNvWrite();
 			}
 		}
 		return true;
@@ -534,6 +544,7 @@ void Platform::ResetNvData()
 		PidParameters& pp = nvData.pidParams[i];
 		pp.thermistorSeriesR = defaultThermistorSeriesRs[i];
 		pp.SetThermistorR25AndBeta(defaultThermistor25RS[i], defaultThermistorBetas[i]);
+		pp.thermistorShC = 0.0;
 		pp.kI = defaultPidKis[i];
 		pp.kD = defaultPidKds[i];
 		pp.kP = defaultPidKps[i];
@@ -543,6 +554,7 @@ void Platform::ResetNvData()
 		pp.pidMin = defaultPidMins[i];
 		pp.pidMax = defaultPidMaxes[i];
 		pp.adcLowOffset = pp.adcHighOffset = 0.0;
+		UpdateThermistorTable(i);
 	}
 
 #ifdef FLASH_SAVE_ENABLED
@@ -553,27 +565,117 @@ void Platform::ResetNvData()
 void Platform::ReadNvData()
 {
 #ifdef FLASH_SAVE_ENABLED
-	DueFlashStorage::read(FlashData::nvAddress, &nvData, sizeof(nvData));
-	if (nvData.magic != FlashData::magicValue)
+	if (nvDataDirty)
+	{
+		WriteNvData();		// don't lose auto-saved changes that are still waiting to be written
+	}
+	uint16_t magic;
+	if (!nvLog.Read(nvMagicKey, &magic, sizeof(magic)) || magic != FlashData::magicValue)
 	{
 		// Nonvolatile data has not been initialized since the firmware was last written, so set up default values
 		ResetNvData();
 		// No point in writing it back here
 	}
+	else
+	{
+		uint16_t key, length;
+		uint8_t *data;
+		for (size_t i = 0; GetNvRecord(i, key, data, length); ++i)
+		{
+			nvLog.Read(key, data, length);		// if a record is missing, keep the value we have
+		}
+	}
+	for (size_t heater = 0; heater < HEATERS; heater++)
+	{
+		UpdateThermistorTable(heater);
+	}
 #else
 	Message(BOTH_ERROR_MESSAGE, "Cannot load non-volatile data, because Flash support has been disabled!\n");
 #endif
 }
 
+// Write the non-volatile data to flash now, including any auto-saved changes that are still waiting
 void Platform::WriteNvData()
 {
 #ifdef FLASH_SAVE_ENABLED
-	DueFlashStorage::write(FlashData::nvAddress, &nvData, sizeof(nvData));
+	nvWriteRecord = 0;
+	while (WriteNvDataRecord()) { }
+	nvDataDirty = false;
 #else
 	Message(BOTH_ERROR_MESSAGE, "Cannot write non-volatile data, because Flash support has been disabled!\n");
 #endif
 }
 
+// Note that the auto-saved non-volatile data has changed. Spin writes it when it has stopped changing for a while,
+// so that a config file that sets several parameters causes one write instead of one per parameter.
+void Platform::ScheduleNvWrite()
+{
+	nvDataDirty = true;
+	nvDataChangedTime = Time();
+	nvWriteRecord = 0;
+}
+
+// Save the next record of the non-volatile data to the settings log. The log leaves the flash alone if the record
+// hasn't changed, otherwise it appends the record. Return false if there was nothing left to write.
+bool Platform::WriteNvDataRecord()
+{
+#ifdef FLASH_SAVE_ENABLED
+	uint16_t key, length;
+	uint8_t *data;
+	if (!GetNvRecord(nvWriteRecord, key, data, length))
+	{
+		return false;
+	}
+	if (!nvLog.Write(key, data, length))
+	{
+		Message(BOTH_ERROR_MESSAGE, "Failed to write non-volatile data to flash!\n");
+	}
+	++nvWriteRecord;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Get the key, address and length of a record of the non-volatile data. Return false if there is no such record.
+// The records are listed here rather than in a static table because FlashData isn't standard-layout, so offsetof
+// can't be used on it. The magic value must come first. Don't change the keys, or saved settings will be lost.
+#define NV_RECORD(_key, _member, _count)	{ _key, reinterpret_cast<uint8_t *>(&nvData._member), sizeof(nvData._member), _count }
+
+bool Platform::GetNvRecord(size_t index, uint16_t& key, uint8_t*& data, uint16_t& length)
+{
+	const NvRecord nvRecords[] =
+	{
+		NV_RECORD(nvMagicKey, magic, 1),
+		NV_RECORD(1, switchZProbeParameters, 1),
+		NV_RECORD(2, irZProbeParameters, 1),
+		NV_RECORD(3, alternateZProbeParameters, 1),
+		NV_RECORD(4, zProbeType, 1),
+		NV_RECORD(5, zProbeChannel, 1),
+		NV_RECORD(6, zProbeAxes, 1),
+		NV_RECORD(7, ipAddress, 1),
+		NV_RECORD(8, netMask, 1),
+		NV_RECORD(9, gateWay, 1),
+		NV_RECORD(10, macAddress, 1),
+		NV_RECORD(11, compatibility, 1),
+		NV_RECORD(16, pidParams[0], HEATERS)		// keys 16 onwards, one per heater
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(nvRecords); ++i)
+	{
+		const NvRecord& rec = nvRecords[i];
+		if (index < rec.count)
+		{
+			key = rec.key + index;
+			data = rec.data + index * rec.length;
+			length = rec.length;
+			return true;
+		}
+		index -= rec.count;
+	}
+	return false;
+}
+
 void Platform::SetAutoSave(bool enabled)
 {
 #ifdef FLASH_SAVE_ENABLED
@@ -635,7 +737,7 @@ void Platform::SetEmulating(Compatibility c)
 		nvData.compatibility = c;
 		if (autoSaveEnabled)
 		{
-			WriteNvData();
+			ScheduleNvWrite();
 		}
 	}
 }
@@ -653,7 +755,7 @@ void Platform::UpdateNetworkAddress(byte dst[4], const byte src[4])
 	}
 	if (changed && autoSaveEnabled)
 	{
-		WriteNvData();
+		ScheduleNvWrite();
 	}
 }
 
@@ -684,13 +786,34 @@ void Platform::Spin()
 
 	line->Spin();
 	aux->Spin();
+	massStorage->Spin();
+	SpinDigipots();
+
+	// Write auto-saved settings that have stopped changing
+	if (nvDataDirty && Time() - nvDataChangedTime >= nvSaveDelay && !WriteNvDataRecord())
+	{
+		nvDataDirty = false;
+	}
+
+	// Refill the read-ahead buffers of files being printed, so that GCodes doesn't have to wait for the SD card
+	for (size_t i = 0; i < MAX_FILES; i++)
+	{
+		files[i]->ReadAhead();
+	}
 
 	ClassReport(longWait);
 }
 
 void Platform::SoftwareReset(uint16_t reason)
 {
-	if (reason != SoftwareResetReason::user)
+	if (reason == SoftwareResetReason::user)
+	{
+		if (nvDataDirty)
+		{
+			WriteNvData();		// save auto-saved changes that are still waiting to be written
+		}
+	}
+	else
 	{
 		if (line->inWrite)
 		{
@@ -785,7 +908,6 @@ void Platform::InitialiseInterrupts()
 
 	// Tick interrupt for ADC conversions
 	tickState = 0;
-	currentHeater = 0;
 
 	active = true;							// this enables the tick interrupt, which keeps the watchdog happy
 }
@@ -813,13 +935,18 @@ void Platform::SetInterrupt(float s) // Seconds
 
 // Process a 1ms tick interrupt
 // This function must be kept fast so as not to disturb the stepper timing, so don't do any floating point maths in here.
-// This is what we need to do:
+// The ADC converts all the channels we use in one burst each time it is started, which takes a few tens of microseconds,
+// so the results are always ready by the next tick. This is what we need to do:
 // 0.  Kick the watchdog.
-// 1.  Kick off a new ADC conversion.
-// 2.  Fetch and process the result of the last ADC conversion.
-// 3a. If the last ADC conversion was for the Z probe, toggle the modulation output if using a modulated IR sensor.
-// 3b. If the last ADC reading was a thermistor reading, check for an over-temperature situation and turn off the heater if necessary.
+// 1.  Fetch the results of the conversions we started on the last tick and feed them to the averaging filters.
+// 2.  Check each thermistor for an over-temperature situation and turn off the heater if necessary.
 //     We do this here because the usual polling loop sometimes gets stuck trying to send data to the USB port.
+// 3.  If using a modulated IR sensor, toggle the modulation output on alternate ticks.
+// 4.  Kick off the next burst of ADC conversions.
+//
+// tickState is the phase of the last burst we started. The IR emitter is on during phases 1 and 2 and off during phases 3 and 4.
+// The output of a modulated sensor needs time to settle after the emitter is switched, so we don't use its readings
+// from phases 1 and 3. Other types of Z probe are read on every tick.
 
 //#define TIME_TICK_ISR	1		// define this to store the tick ISR time in errorCodeBits
 
@@ -828,59 +955,63 @@ void Platform::Tick()
 #ifdef TIME_TICK_ISR
 	uint32_t now = micros();
 #endif
-	switch (tickState)
+	if (tickState != 0)
 	{
-	case 1:			// last conversion started was a thermistor
-	case 3:
-	{
-		ThermistorAveragingFilter& currentFilter = const_cast<ThermistorAveragingFilter&>(thermistorFilters[currentHeater]);
-		currentFilter.ProcessReading(GetAdcReading(heaterAdcChannels[currentHeater]));
-		StartAdcConversion(zProbeAdcChannel);
-		if (currentFilter.IsValid())
+		for (size_t heater = 0; heater < HEATERS; heater++)
 		{
-			uint32_t sum = currentFilter.GetSum();
-			if (sum < thermistorOverheatSums[currentHeater] || sum >= adDisconnectedReal * numThermistorReadingsAveraged)
+			ThermistorAveragingFilter& currentFilter = const_cast<ThermistorAveragingFilter&>(thermistorFilters[heater]);
+			currentFilter.ProcessReading(GetAdcReading(heaterAdcChannels[heater]));
+			if (currentFilter.IsValid())
 			{
-				// We have an over-temperature or bad reading from this thermistor, so turn off the heater
-				// NB - the SetHeater function we call does floating point maths, but this is an exceptional situation so we allow it
-				SetHeater(currentHeater, 0.0);
-				errorCodeBits |= ErrorBadTemp;
+				uint32_t sum = currentFilter.GetSum();
+				if (sum < thermistorOverheatSums[heater] || sum >= adDisconnectedReal * numThermistorReadingsAveraged)
+				{
+					// We have an over-temperature or bad reading from this thermistor, so turn off the heater
+					// NB - the SetHeater function we call does floating point maths, but this is an exceptional situation so we allow it
+					SetHeater(heater, 0.0);
+					errorCodeBits |= ErrorBadTemp;
+				}
 			}
 		}
-		++currentHeater;
-		if (currentHeater == HEATERS)
-		{
-			currentHeater = 0;
-		}
-	}
-		++tickState;
-		break;
 
-	case 2:			// last conversion started was the Z probe, with IR LED on
-		const_cast<ZProbeAveragingFilter&>(zProbeOnFilter).ProcessReading(GetAdcReading(zProbeAdcChannel));
-		StartAdcConversion(heaterAdcChannels[currentHeater]);	// read a thermistor
-		if (nvData.zProbeType == 2)								// if using a modulated IR sensor
+		const bool modulated = (nvData.zProbeType == 2);
+		switch (tickState)
 		{
-			digitalWrite(zProbeModulationPin, LOW);		// turn off the IR emitter
-		}
-		++tickState;
-		break;
+		case 1:			// IR emitter just turned on
+			if (!modulated)
+			{
+				const_cast<ZProbeAveragingFilter&>(zProbeOnFilter).ProcessReading(GetAdcReading(zProbeAdcChannel));
+			}
+			break;
 
-	case 4:			// last conversion started was the Z probe, with IR LED off if modulation is enabled
-		const_cast<ZProbeAveragingFilter&>(zProbeOffFilter).ProcessReading(GetAdcReading(zProbeAdcChannel));
-		// no break
-	case 0:			// this is the state after initialisation, no conversion has been started
-	default:
-	{
-		StartAdcConversion(heaterAdcChannels[currentHeater]);	// read a thermistor
-		if (nvData.zProbeType == 2)								// if using a modulated IR sensor
-		{
-			digitalWrite(zProbeModulationPin, HIGH);		// turn on the IR emitter
+		case 2:			// IR emitter on
+			const_cast<ZProbeAveragingFilter&>(zProbeOnFilter).ProcessReading(GetAdcReading(zProbeAdcChannel));
+			if (modulated)
+			{
+				digitalWrite(zProbeModulationPin, LOW);		// turn off the IR emitter
+			}
+			break;
+
+		case 3:			// IR emitter just turned off, if modulation is enabled
+			if (!modulated)
+			{
+				const_cast<ZProbeAveragingFilter&>(zProbeOffFilter).ProcessReading(GetAdcReading(zProbeAdcChannel));
+			}
+			break;
+
+		case 4:			// IR emitter off, if modulation is enabled
+		default:
+			const_cast<ZProbeAveragingFilter&>(zProbeOffFilter).ProcessReading(GetAdcReading(zProbeAdcChannel));
+			if (modulated)
+			{
+				digitalWrite(zProbeModulationPin, HIGH);	// turn on the IR emitter
+			}
+			break;
 		}
 	}
-		tickState = 1;
-		break;
-	}
+
+	tickState = (tickState >= 4) ? 1 : tickState + 1;
+	StartAdcConversions();
 #ifdef TIME_TICK_ISR
 	uint32_t now2 = micros();
 	if (now2 - now > errorCodeBits)
@@ -890,17 +1021,28 @@ void Platform::Tick()
 #endif
 }
 
+// Work out which channels the ADC has to convert on each tick
+void Platform::UpdateAdcChannels()
+{
+	uint32_t mask = 1u << zProbeAdcChannel;
+	for (size_t heater = 0; heater < HEATERS; heater++)
+	{
+		mask |= 1u << heaterAdcChannels[heater];
+	}
+	ADC->ADC_CHDR = ~mask & 0xFFFF;						// stop converting a thermistor channel that is no longer used
+	adcChannelMask = mask;
+}
+
 /*static*/uint16_t Platform::GetAdcReading(adc_channel_num_t chan)
 {
-	uint16_t rslt = (uint16_t) adc_get_channel_value(ADC, chan);
-	adc_disable_channel(ADC, chan);
-	return rslt;
+	return (uint16_t) adc_get_channel_value(ADC, chan);
 }
 
-/*static*/void Platform::StartAdcConversion(adc_channel_num_t chan)
+// Start converting all our channels. The channels are enabled again every time, because analogRead disables them.
+void Platform::StartAdcConversions()
 {
-	adc_enable_channel(ADC, chan);
-	adc_start(ADC );
+	ADC->ADC_CHER = adcChannelMask;
+	adc_start(ADC);
 }
 
 // Convert an Arduino Due pin number to the corresponding ADC channel number
@@ -982,6 +1124,19 @@ void Platform::Diagnostics()
 	// Show the longest write time
 	AppendMessage(BOTH_MESSAGE, "Longest block write time: %.1fms\n", FileStore::GetAndClearLongestWriteTime());
 
+	// Show the serial transfer rates since the last report
+	line->Diagnostics("USB");
+	aux->Diagnostics("Aux");
+
+	// Show how the settings log in flash is doing
+	AppendMessage(BOTH_MESSAGE, "Settings log: %u of %u bytes used, %u records appended, %u unchanged, %u compactions%s\n",
+					nvLog.BytesUsed(), nvLog.BankLength(), nvLog.Appends(), nvLog.Unchanged(), nvLog.Compactions(),
+					(nvDataDirty) ? ", write pending" : "");
+
+	// Show how many digipot writes the motor current changes needed
+	AppendMessage(BOTH_MESSAGE, "Digipot writes: %u, superseded before sending %u, failed %u\n", potWrites, potWritesCoalesced, potWritesFailed);
+	massStorage->Diagnostics();
+
 	reprap.Timing();
 }
 
@@ -1052,37 +1207,126 @@ void Platform::ClassReport(float &lastTime)
 // and the temperature, T = BETA/ln(R/R_INF)
 // To get degrees celsius (instead of kelvin) add -273.15 to T
 
+// If a Steinhart-Hart C coefficient is set, we use 1/T = 1/T0 + ln(R/R0)/BETA + C.(ln(R)^3 - ln(R0)^3) instead,
+// which is the Steinhart-Hart equation with its A and B coefficients chosen to fit R0 and BETA.
+// See http://en.wikipedia.org/wiki/Steinhart%E2%80%93Hart_equation
+
 // Result is in degrees celsius
 
+// Looking up the temperature is much faster than calculating it, which matters because it is done for every heater
+// on every PID cycle. The table gives the temperature to within about 0.15C of the formula.
 float Platform::GetTemperature(size_t heater) const
 {
 	int rawTemp = GetRawTemperature(heater);
 
-	// If the ADC reading is N then for an ideal ADC, the input voltage is at least N/(AD_RANGE + 1) and less than (N + 1)/(AD_RANGE + 1), times the analog reference.
-	// So we add 0.5 to to the reading to get a better estimate of the input.
-
-	float reading = (float) rawTemp + 0.5;
-
 	// Recognise the special case of thermistor disconnected.
 	// For some ADCs, the high-end offset is negative, meaning that the ADC never returns a high enough value. We need to allow for this here.
 
 	const PidParameters& p = nvData.pidParams[heater];
+	int disconnectedTemp = rawTemp;
 	if (p.adcHighOffset < 0.0)
 	{
-		rawTemp -= (int) p.adcHighOffset;
+		disconnectedTemp -= (int) p.adcHighOffset;
 	}
-	if (rawTemp >= adDisconnectedVirtual)
+	if (disconnectedTemp >= adDisconnectedVirtual)
 	{
 		return ABS_ZERO;		// thermistor is disconnected
 	}
 
+	const float *table = thermistorTables[heater];
+	const float reading = (float) rawTemp;
+	if (!thermistorTableValid[heater] || reading > table[0] || reading < table[thermistorTableLength - 1])
+	{
+		return CalcTemperature(heater, rawTemp);
+	}
+
+	// Binary search for the two entries either side of the reading, then interpolate between them
+	size_t low = 0, high = thermistorTableLength - 1;
+	while (high - low > 1)
+	{
+		const size_t mid = (low + high)/2;
+		if (table[mid] >= reading)
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	return thermistorTableMinTemperature + thermistorTableStep * ((float)low + (table[low] - reading)/(table[low] - table[high]));
+}
+
+// Convert a raw ADC reading to a temperature using the thermistor formula
+float Platform::CalcTemperature(size_t heater, int rawTemp) const
+{
+	// If the ADC reading is N then for an ideal ADC, the input voltage is at least N/(AD_RANGE + 1) and less than (N + 1)/(AD_RANGE + 1), times the analog reference.
+	// So we add 0.5 to to the reading to get a better estimate of the input.
+
+	float reading = (float) rawTemp + 0.5;
+
 	// Correct for the low and high ADC offsets
+	const PidParameters& p = nvData.pidParams[heater];
 	reading -= p.adcLowOffset;
 	reading *= (adRangeVirtual + 1) / (adRangeVirtual + 1 + p.adcHighOffset - p.adcLowOffset);
 
 	float resistance = reading * p.thermistorSeriesR / ((adRangeVirtual + 1) - reading);
-	return (resistance <= p.GetRInf()) ? 2000.0			// thermistor short circuit, return a high temperature
-			: ABS_ZERO + p.GetBeta() / log(resistance / p.GetRInf());
+	if (resistance <= p.GetRInf())
+	{
+		return 2000.0;			// thermistor short circuit, return a high temperature
+	}
+	if (p.thermistorShC == 0.0)
+	{
+		return ABS_ZERO + p.GetBeta() / log(resistance / p.GetRInf());
+	}
+
+	const float lnR = log(resistance);
+	const float lnR25 = log(p.GetThermistorR25());
+	return ABS_ZERO + 1.0/(log(resistance / p.GetRInf())/p.GetBeta() + p.thermistorShC * (lnR * lnR * lnR - lnR25 * lnR25 * lnR25));
+}
+
+// Calculate the raw ADC reading (before correcting for the ADC offsets) that corresponds to a temperature.
+// This is the inverse of CalcTemperature.
+float Platform::CalcReading(size_t heater, float temperature) const
+{
+	const PidParameters& p = nvData.pidParams[heater];
+
+	// Solve for ln(R). With a Steinhart-Hart C coefficient there is no closed form we want to use,
+	// so we refine the solution of the beta equation by a few Newton-Raphson iterations.
+	float lnR = log(p.GetRInf()) + p.GetBeta()/(temperature - ABS_ZERO);
+	if (p.thermistorShC != 0.0)
+	{
+		const float lnR25 = log(p.GetThermistorR25());
+		const float a = 1.0/(25.0 - ABS_ZERO) - lnR25/p.GetBeta() - p.thermistorShC * lnR25 * lnR25 * lnR25 - 1.0/(temperature - ABS_ZERO);
+		for (int i = 0; i < 4; i++)
+		{
+			lnR -= (a + lnR/p.GetBeta() + p.thermistorShC * lnR * lnR * lnR)/(1.0/p.GetBeta() + 3.0 * p.thermistorShC * lnR * lnR);
+		}
+	}
+
+	const float resistance = exp(lnR);
+	const float reading = (adRangeVirtual + 1) * resistance / (resistance + p.thermistorSeriesR);
+	return reading * (adRangeVirtual + 1 + p.adcHighOffset - p.adcLowOffset) / (adRangeVirtual + 1) + p.adcLowOffset - 0.5;
+}
+
+// Rebuild the temperature lookup table and the overheat threshold of a heater. Call this whenever its thermistor parameters change.
+void Platform::UpdateThermistorTable(size_t heater)
+{
+	float *table = thermistorTables[heater];
+	bool valid = true;
+	for (size_t i = 0; i < thermistorTableLength; i++)
+	{
+		table[i] = CalcReading(heater, thermistorTableMinTemperature + thermistorTableStep * i);
+		if (isnan(table[i]) || (i != 0 && table[i] >= table[i - 1]))
+		{
+			valid = false;			// odd parameters, so always use the formula
+		}
+	}
+	thermistorTableValid[heater] = valid;
+
+	// Calculate and store the ADC average sum that corresponds to an overheat condition, so that we can check is quickly in the tick ISR
+	const float thermistorOverheatAdcValue = (CalcReading(heater, BAD_HIGH_TEMPERATURE) + 0.5)/(1 << adOversampleBits);
+	thermistorOverheatSums[heater] = (uint32_t) (thermistorOverheatAdcValue + 0.9) * numThermistorReadingsAveraged;
 }
 
 void Platform::SetPidParameters(size_t heater, const PidParameters& params)
@@ -1090,9 +1334,10 @@ void Platform::SetPidParameters(size_t heater, const PidParameters& params)
 	if (heater < HEATERS && params != nvData.pidParams[heater])
 	{
 		nvData.pidParams[heater] = params;
+		UpdateThermistorTable(heater);
 		if (autoSaveEnabled)
 		{
-			WriteNvData();
+			ScheduleNvWrite();
 		}
 	}
 }
@@ -1160,6 +1405,7 @@ void Platform::EnableDrive(size_t drive)
 	{
 		driveState[drive] = DriveStatus::enabled;
 		UpdateMotorCurrent(drive);
+		FlushDigipots(1u << drive);			// don't start moving at the idle current
 
 		const int pin = enablePins[drive];
 		if (pin >= 0)
@@ -1204,7 +1450,8 @@ void Platform::SetMotorCurrent(size_t drive, float current)
 	}
 }
 
-// This must not be called from an ISR, or with interrupts disabled.
+// Queue the digipot wiper value for a drive. SpinDigipots sends it later, and if the value changes again before then
+// only the latest one is sent. This must not be called from an ISR, or with interrupts disabled.
 void Platform::UpdateMotorCurrent(size_t drive)
 {
 	if (drive < DRIVES)
@@ -1214,20 +1461,154 @@ void Platform::UpdateMotorCurrent(size_t drive)
 		{
 			current *= idleCurrentFactor;
 		}
-		unsigned short pot = (unsigned short)((0.256*current*8.0*senseResistor + maxStepperDigipotVoltage/2)/maxStepperDigipotVoltage);
-		if (drive < 4)
+		potValues[drive] = PotValue(current);
+		const uint32_t driveBit = 1u << drive;
+		if ((potsPending & driveBit) != 0)
 		{
-			mcpDuet.setNonVolatileWiper(potWipes[drive], pot);
-			mcpDuet.setVolatileWiper(potWipes[drive], pot);
+			++potWritesCoalesced;
 		}
-		else
+		potsPending |= driveBit;
+	}
+}
+
+// Move the current digipot write on by one step, or start the next one. The volatile wiper write is a command byte
+// followed by a data byte. We drive the TWI peripheral directly and never wait for it, because the Wire library
+// busy-waits for each byte.
+void Platform::SpinDigipots()
+{
+	Twi * const twi = WIRE1_INTERFACE;
+	if (potWriteState == PotWriteState::idle)
+	{
+		StartDigipotWrite(twi);
+		return;
+	}
+
+	const uint32_t status = TWI_GetStatus(twi);
+	const uint32_t driveBit = 1u << potWriteDrive;
+	if ((status & TWI_SR_NACK) != 0)
+	{
+		// The pot didn't acknowledge, which usually means there is no expansion board. Don't keep retrying.
+		++potWritesFailed;
+		potValuesSent[potWriteDrive] = potWriteValue;
+		SetPotWriteState(PotWriteState::idle);
+		return;
+	}
+	if ((status & TWI_SR_ARBLST) != 0)
+	{
+		// Something else drove the bus while we were using it, so the write was lost. Send it again later.
+		++potWritesFailed;
+		potsPending |= driveBit;
+		SetPotWriteState(PotWriteState::idle);
+		return;
+	}
+
+	switch (potWriteState)
+	{
+	case PotWriteState::sendingCommand:
+		if ((status & TWI_SR_TXRDY) != 0)
+		{
+			TWI_WriteByte(twi, potWriteData);
+			SetPotWriteState(PotWriteState::sendingData);
+			return;
+		}
+		break;
+
+	case PotWriteState::sendingData:
+		if ((status & TWI_SR_TXRDY) != 0)
+		{
+			TWI_Stop(twi);
+			SetPotWriteState(PotWriteState::stopping);
+			return;
+		}
+		break;
+
+	case PotWriteState::stopping:
+		if ((status & TWI_SR_TXCOMP) != 0)
+		{
+			// Record the value we sent, which may since have been superseded and queued again
+			potValuesSent[potWriteDrive] = potWriteValue;
+			++potWrites;
+			SetPotWriteState(PotWriteState::idle);
+			return;
+		}
+		break;
+
+	default:
+		return;
+	}
+
+	// The TWI hasn't finished the step we gave it. A byte takes about 0.1ms at 100kHz, so if it still hasn't
+	// finished long after we gave it the step, it is stuck, perhaps because a glitch on the bus left it waiting
+	// for a byte that will never go. The time is measured from when the TWI was given the step, and we have
+	// just read its status, so a slow pass through the main loop can't make a healthy write look stuck.
+	if (millis() - potWriteStateTime > potWriteTimeout)
+	{
+		++potWritesFailed;
+		Wire1.begin();
+		potsPending |= driveBit;
+		SetPotWriteState(PotWriteState::idle);
+	}
+}
+
+// Start writing the wiper of the next drive whose value has changed, if there is one
+void Platform::StartDigipotWrite(Twi *twi)
+{
+	while (potsPending != 0)
+	{
+		// Take the drives in turn, so that a drive whose current keeps changing can't hold up the others
+		potWriteDrive = (potWriteDrive + 1) % DRIVES;
+		const uint32_t driveBit = 1u << potWriteDrive;
+		if ((potsPending & driveBit) != 0)
 		{
-			mcpExpansion.setNonVolatileWiper(potWipes[drive], pot);
-			mcpExpansion.setVolatileWiper(potWipes[drive], pot);
+			potsPending &= ~driveBit;
+			const uint16_t pot = potValues[potWriteDrive];
+			if (pot != potValuesSent[potWriteDrive])
+			{
+				const MCP4461& mcp = (potWriteDrive < 4) ? mcpDuet : mcpExpansion;
+				const uint8_t command = MCP4461::wiperCommand(potWipes[potWriteDrive], pot, false, potWriteData);
+				potWriteValue = pot;
+				TWI_StartWrite(twi, mcp.getMCP4461Address(), 0, 0, command);
+				SetPotWriteState(PotWriteState::sendingCommand);
+				return;
+			}
 		}
 	}
 }
 
+void Platform::SetPotWriteState(PotWriteState state)
+{
+	potWriteState = state;
+	potWriteStateTime = millis();
+}
+
+// Finish sending the queued wiper values for the given drives, and the write in progress if there is one.
+// With all drives, this leaves the I2C bus free for the Wire library.
+void Platform::FlushDigipots(uint32_t drives)
+{
+	const uint32_t startTime = millis();
+	while (((potsPending & drives) != 0 || potWriteState != PotWriteState::idle) && millis() - startTime < 100)
+	{
+		SpinDigipots();
+	}
+}
+
+// Write the configured motor currents to the non-volatile wipers, so that the pots power up with them.
+// The pot takes several milliseconds to program each one, so we only do this when the user saves the settings.
+void Platform::SaveMotorCurrents()
+{
+	FlushDigipots();
+	for (size_t drive = 0; drive < DRIVES; ++drive)
+	{
+		MCP4461& mcp = (drive < 4) ? mcpDuet : mcpExpansion;
+		mcp.setNonVolatileWiper(potWipes[drive], PotValue(motorCurrents[drive]));
+	}
+}
+
+uint16_t Platform::PotValue(float current) const
+{
+	return (unsigned short)((0.256*current*8.0*senseResistor + maxStepperDigipotVoltage/2)/maxStepperDigipotVoltage);
+}
+
 float Platform::MotorCurrent(size_t drive) const
 {
 	return (drive < DRIVES) ? motorCurrents[drive] : 0.0;
@@ -1285,6 +1666,7 @@ void Platform::SetFanValue(float speed)
 
 		// The cooling fan output pin gets inverted if HEAT_ON == 0
 		analogWriteDuet(coolingFanPin, (HEAT_ON == 0) ? (255 - p) : p, true);
+		reprap.StatusFieldChanged(statusParams);
 	}
 }
 
@@ -1497,6 +1879,7 @@ bool Platform::AtxPower() const
 void Platform::SetAtxPower(bool on)
 {
 	digitalWrite(atxPowerPin, (on) ? HIGH : LOW);
+	reprap.StatusFieldChanged(statusParams);
 }
 
 void Platform::SetBaudRate(size_t chan, uint32_t br)
@@ -1557,7 +1940,33 @@ void Platform::ResetChannel(size_t chan)
 MassStorage::MassStorage(Platform* p) : platform(p), combinedName(combinedNameBuff, ARRAY_SIZE(combinedNameBuff))
 {
 	memset(&fileSystem, 0, sizeof(FATFS));
-	findDir = new DIR();
+	findIterator = new DirectoryIterator();
+	limitAccess = false;
+	for (size_t i = 0; i < numSdAccessClasses; i++)
+	{
+		accessCredit[i] = sdAccessBudgets[i];
+		waiting[i] = false;
+		waitingSince[i] = 0;
+		transfers[i] = bytesTransferred[i] = busyTime[i] = 0;
+		deferrals[i] = waits[i] = totalWaitTime[i] = longestWaitTime[i] = 0;
+	}
+	busyDeferrals = 0;
+	for (size_t i = 0; i < LINK_MAP_TABLES; i++)
+	{
+		linkMapInUse[i] = false;
+	}
+	linkMapsBuilt = linkMapsTooSmall = linkMapShortages = 0;
+	for (size_t i = 0; i < READ_AHEAD_BUFFERS; i++)
+	{
+		readAheadBufferInUse[i] = false;
+	}
+	readAheadShortages = 0;
+	for (size_t i = 0; i < DIR_CACHE_DIRECTORIES; i++)
+	{
+		dirCache[i].valid = false;
+	}
+	dirCacheGeneration = 0;
+	dirCacheHits = dirCacheLoads = dirCacheOverflows = dirCacheInvalidations = 0;
 }
 
 void MassStorage::Init()
@@ -1694,13 +2103,50 @@ const char* MassStorage::CombineName(const char* directory, const char* fileName
 
 	return combinedName.Pointer();
 }
+
+// Convert the directory entry returned by FatFs
+static void SetFileInfo(const FILINFO& entry, FileInfo &file_info)
+{
+	file_info.isDirectory = (entry.fattrib & AM_DIR);
+	file_info.size = entry.fsize;
+	uint16_t day = entry.fdate & 0x1F;
+	if (day == 0)
+	{
+		// This can happen if a transfer hasn't been processed completely.
+		day = 1;
+	}
+	file_info.day = day;
+	file_info.month = (entry.fdate & 0x01E0) >> 5;
+	file_info.year = (entry.fdate >> 9) + 1980;
+	file_info.hours = entry.ftime >> 11;
+	file_info.minutes = (entry.ftime >> 5) & 0x3F;
+	file_info.seconds = (entry.ftime & 0x1F) * 2;
+	if (file_info.fileName[0] == 0)
+	{
+		strncpy(file_info.fileName, entry.fname, ARRAY_SIZE(file_info.fileName));
+	}
+}
+
 // Open a directory to read a file list. Returns true if it contains any files, false otherwise.
 bool MassStorage::FindFirst(const char *directory, FileInfo &file_info)
 {
-	TCHAR loc[FILENAME_LENGTH];
+	return FindFirst(directory, file_info, findIterator);
+}
+
+// Find the next file in a directory. Returns true if another file has been read.
+bool MassStorage::FindNext(FileInfo &file_info)
+{
+	return FindNext(file_info, findIterator);
+}
+
+// As above, but use an iterator owned by the caller. This allows a file list to be read in several
+// steps without being disturbed by other users of FindFirst and FindNext.
+bool MassStorage::FindFirst(const char *directory, FileInfo &file_info, DirectoryIterator *iterator)
+{
+	char *loc = iterator->directory;
 
 	// Remove the trailing '/' from the directory name
-	size_t len = strnlen(directory, ARRAY_UPB(loc));
+	size_t len = strnlen(directory, ARRAY_UPB(iterator->directory));
 	if (len == 0)
 	{
 		loc[0] = 0;
@@ -1716,73 +2162,260 @@ bool MassStorage::FindFirst(const char *directory, FileInfo &file_info)
 		loc[len] = 0;
 	}
 
-	findDir->lfn = nullptr;
-	FRESULT res = f_opendir(findDir, loc);
-	if (res == FR_OK)
+	iterator->nextEntry = 0;
+	iterator->cacheSlot = GetCachedDirectory(loc);
+	if (iterator->cacheSlot >= 0)
 	{
-		FILINFO entry;
-		entry.lfname = file_info.fileName;
-		entry.lfsize = ARRAY_SIZE(file_info.fileName);
+		iterator->generation = dirCache[iterator->cacheSlot].generation;
+		return FindNext(file_info, iterator);
+	}
 
-		for(;;)
-		{
-			res = f_readdir(findDir, &entry);
-			if (res != FR_OK || entry.fname[0] == 0) break;
-			if (StringEquals(entry.fname, ".") || StringEquals(entry.fname, "..")) continue;
+	// The directory is too large to cache, so read it from the card as we go
+	iterator->dir.lfn = nullptr;
+	return f_opendir(&iterator->dir, loc) == FR_OK && FindNext(file_info, iterator);
+}
 
-			file_info.isDirectory = (entry.fattrib & AM_DIR);
-			file_info.size = entry.fsize;
-			uint16_t day = entry.fdate & 0x1F;
-			if (day == 0)
-			{
-				// This can happen if a transfer hasn't been processed completely.
-				day = 1;
-			}
-			file_info.day = day;
-			file_info.month = (entry.fdate & 0x01E0) >> 5;
-			file_info.year = (entry.fdate >> 9) + 1980;
-			if (file_info.fileName[0] == 0)
+bool MassStorage::FindNext(FileInfo &file_info, DirectoryIterator *iterator)
+{
+	if (iterator->cacheSlot >= 0)
+	{
+		CachedDirectory *cache = &dirCache[iterator->cacheSlot];
+		if (!cache->valid || cache->generation != iterator->generation)
+		{
+			// The directory has changed or made way for another one since the listing started,
+			// so read it again and carry on from the same position
+			iterator->cacheSlot = GetCachedDirectory(iterator->directory);
+			if (iterator->cacheSlot < 0)
 			{
-				strncpy(file_info.fileName, entry.fname, ARRAY_SIZE(file_info.fileName));
+				// It doesn't fit in the cache any more, so read it from the card instead
+				FILINFO entry;
+				entry.lfname = file_info.fileName;
+				entry.lfsize = ARRAY_SIZE(file_info.fileName);
+				iterator->dir.lfn = nullptr;
+				if (f_opendir(&iterator->dir, iterator->directory) != FR_OK)
+				{
+					return false;
+				}
+				for (size_t i = 0; i < iterator->nextEntry; i++)
+				{
+					if (!ReadDirectory(&iterator->dir, entry))
+					{
+						return false;
+					}
+				}
+				return FindNext(file_info, iterator);
 			}
+			cache = &dirCache[iterator->cacheSlot];
+			iterator->generation = cache->generation;
+		}
 
-			return true;
+		if (iterator->nextEntry >= cache->numEntries)
+		{
+			return false;
 		}
-	}
 
-	return false;
-}
+		const CachedEntry& cachedEntry = cache->entries[iterator->nextEntry];
+		FILINFO entry;
+		entry.fsize = cachedEntry.size;
+		entry.fdate = cachedEntry.date;
+		entry.ftime = cachedEntry.time;
+		entry.fattrib = cachedEntry.attributes;
+		strncpy(file_info.fileName, cache->names + cachedEntry.nameOffset, ARRAY_SIZE(file_info.fileName));
+		SetFileInfo(entry, file_info);
+		cache->lastUsed = millis();
+		++iterator->nextEntry;
+		return true;
+	}
 
-// Find the next file in a directory. Returns true if another file has been read.
-bool MassStorage::FindNext(FileInfo &file_info)
-{
 	FILINFO entry;
 	entry.lfname = file_info.fileName;
 	entry.lfsize = ARRAY_SIZE(file_info.fileName);
-
-	findDir->lfn = nullptr;
-	if (f_readdir(findDir, &entry) != FR_OK || entry.fname[0] == 0)
+	if (!ReadDirectory(&iterator->dir, entry))
 	{
-		//f_closedir(findDir);
+		//f_closedir(dir);
 		return false;
 	}
 
-	file_info.isDirectory = (entry.fattrib & AM_DIR);
-	file_info.size = entry.fsize;
-	uint16_t day = entry.fdate & 0x1F;
-	if (day == 0)
+	SetFileInfo(entry, file_info);
+	++iterator->nextEntry;
+	return true;
+}
+
+// Read the next entry of a directory from the card, skipping the "." and ".." entries
+bool MassStorage::ReadDirectory(DIR *dir, FILINFO &entry)
+{
+	dir->lfn = nullptr;
+	for (;;)
 	{
-		// This can happen if a transfer hasn't been processed completely.
-		day = 1;
+		if (f_readdir(dir, &entry) != FR_OK || entry.fname[0] == 0)
+		{
+			return false;
+		}
+		if (!StringEquals(entry.fname, ".") && !StringEquals(entry.fname, ".."))
+		{
+			return true;
+		}
 	}
-	file_info.day = day;
-	file_info.month = (entry.fdate & 0x01E0) >> 5;
-	file_info.year = (entry.fdate >> 9) + 1980;
-	if (file_info.fileName[0] == 0)
+}
+
+// Return the cache slot holding the listing of a directory if it is already cached, or -1 if it isn't.
+// This never reads the card or replaces another cached directory.
+int MassStorage::FindCachedDirectory(const char *directory)
+{
+	for (size_t i = 0; i < DIR_CACHE_DIRECTORIES; i++)
 	{
-		strncpy(file_info.fileName, entry.fname, ARRAY_SIZE(file_info.fileName));
+		CachedDirectory& cache = dirCache[i];
+		if (cache.valid && StringEquals(cache.directory, directory))
+		{
+			++dirCacheHits;
+			cache.lastUsed = millis();
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Return the cache slot holding the listing of a directory, reading it from the card into the least recently used
+// slot if necessary. Returns -1 if the directory can't be read or is too large to cache.
+int MassStorage::GetCachedDirectory(const char *directory)
+{
+	const int cachedSlot = FindCachedDirectory(directory);
+	if (cachedSlot >= 0)
+	{
+		return cachedSlot;
+	}
+
+	int slot = -1;
+	for (size_t i = 0; i < DIR_CACHE_DIRECTORIES; i++)
+	{
+		const CachedDirectory& cache = dirCache[i];
+		if (slot < 0 || (dirCache[slot].valid && (!cache.valid || cache.lastUsed < dirCache[slot].lastUsed)))
+		{
+			slot = i;
+		}
+	}
+
+	++dirCacheLoads;
+	CachedDirectory& cache = dirCache[slot];
+	cache.valid = false;
+
+	DIR dir;
+	dir.lfn = nullptr;
+	if (f_opendir(&dir, directory) != FR_OK)
+	{
+		return -1;
+	}
+
+	char longName[FILENAME_LENGTH];
+	FILINFO entry;
+	entry.lfname = longName;
+	entry.lfsize = ARRAY_SIZE(longName);
+	size_t namesLength = 0;
+	cache.numEntries = 0;
+	for (;;)
+	{
+		if (f_readdir(&dir, &entry) != FR_OK)
+		{
+			return -1;
+		}
+		if (entry.fname[0] == 0)
+		{
+			break;
+		}
+		if (StringEquals(entry.fname, ".") || StringEquals(entry.fname, ".."))
+		{
+			continue;
+		}
+
+		const char *name = (longName[0] != 0) ? longName : entry.fname;
+		const size_t nameLength = strlen(name) + 1;
+		if (cache.numEntries == DIR_CACHE_ENTRIES || namesLength + nameLength > DIR_CACHE_NAME_SPACE)
+		{
+			++dirCacheOverflows;
+			return -1;
+		}
+
+		CachedEntry& cachedEntry = cache.entries[cache.numEntries++];
+		cachedEntry.size = entry.fsize;
+		cachedEntry.date = entry.fdate;
+		cachedEntry.time = entry.ftime;
+		cachedEntry.attributes = entry.fattrib;
+		cachedEntry.nameOffset = namesLength;
+		memcpy(cache.names + namesLength, name, nameLength);
+		namesLength += nameLength;
+	}
+
+	strncpy(cache.directory, directory, ARRAY_SIZE(cache.directory));
+	cache.generation = ++dirCacheGeneration;
+	cache.lastUsed = millis();
+	cache.valid = true;
+	return slot;
+}
+
+// Called whenever a file or directory is created, written, renamed or deleted through MassStorage or FileStore.
+// Working out which cached listings are affected isn't worth it, so we forget them all.
+void MassStorage::DirectoryChanged()
+{
+	for (size_t i = 0; i < DIR_CACHE_DIRECTORIES; i++)
+	{
+		if (dirCache[i].valid)
+		{
+			dirCache[i].valid = false;
+			++dirCacheInvalidations;
+		}
+	}
+}
+
+// Get the size and date of a single file or directory. If its directory is already cached, look there first,
+// so that clients asking about each file they have just listed don't cost a card access every time.
+bool MassStorage::GetFileInfo(const char *directory, const char *fileName, FileInfo &file_info)
+{
+	const char* location = (directory != NULL)
+							? CombineName(directory, fileName)
+								: fileName;
+
+	const char *lastSlash = strrchr(location, '/');
+	if (lastSlash != nullptr && lastSlash[1] != 0 && (size_t)(lastSlash - location) < FILENAME_LENGTH)
+	{
+		// Split the location into the directory, without the trailing '/' as the cache stores it, and the name
+		char dirName[FILENAME_LENGTH];
+		const size_t dirLength = lastSlash - location;
+		memcpy(dirName, location, dirLength);
+		dirName[dirLength] = 0;
+
+		const int slot = FindCachedDirectory(dirName);
+		if (slot >= 0)
+		{
+			const CachedDirectory& cache = dirCache[slot];
+			for (size_t i = 0; i < cache.numEntries; i++)
+			{
+				const CachedEntry& cachedEntry = cache.entries[i];
+				if (StringEquals(cache.names + cachedEntry.nameOffset, lastSlash + 1))
+				{
+					FILINFO entry;
+					entry.fsize = cachedEntry.size;
+					entry.fdate = cachedEntry.date;
+					entry.ftime = cachedEntry.time;
+					entry.fattrib = cachedEntry.attributes;
+					strncpy(file_info.fileName, cache.names + cachedEntry.nameOffset, ARRAY_SIZE(file_info.fileName));
+					SetFileInfo(entry, file_info);
+					return true;
+				}
+			}
+		}
 	}
 
+	// The directory isn't cached or the name may be a short alias, so ask the card
+	FILINFO entry;
+	entry.lfname = file_info.fileName;
+	entry.lfsize = ARRAY_SIZE(file_info.fileName);
+
+	if (f_stat(location, &entry) != FR_OK)
+	{
+		return false;
+	}
+
+	SetFileInfo(entry, file_info);
 	return true;
 }
 
@@ -1801,6 +2434,7 @@ bool MassStorage::Delete(const char* directory, const char* fileName)
 	const char* location = (directory != NULL)
 							? platform->GetMassStorage()->CombineName(directory, fileName)
 								: fileName;
+	DirectoryChanged();
 	if (f_unlink(location) != FR_OK)
 	{
 		platform->Message(BOTH_ERROR_MESSAGE, "Can't delete file %s\n", location);
@@ -1813,6 +2447,7 @@ bool MassStorage::Delete(const char* directory, const char* fileName)
 bool MassStorage::MakeDirectory(const char *parentDir, const char *dirName)
 {
 	const char* location = platform->GetMassStorage()->CombineName(parentDir, dirName);
+	DirectoryChanged();
 	if (f_mkdir(location) != FR_OK)
 	{
 		platform->Message(BOTH_ERROR_MESSAGE, "Can't create directory %s\n", location);
@@ -1823,6 +2458,7 @@ bool MassStorage::MakeDirectory(const char *parentDir, const char *dirName)
 
 bool MassStorage::MakeDirectory(const char *directory)
 {
+	DirectoryChanged();
 	if (f_mkdir(directory) != FR_OK)
 	{
 		platform->Message(BOTH_ERROR_MESSAGE, "Can't create directory %s\n", directory);
@@ -1834,6 +2470,7 @@ bool MassStorage::MakeDirectory(const char *directory)
 // Rename a file or directory
 bool MassStorage::Rename(const char *oldFilename, const char *newFilename)
 {
+	DirectoryChanged();
 	if (f_rename(oldFilename, newFilename) != FR_OK)
 	{
 		platform->Message(BOTH_ERROR_MESSAGE, "Can't rename file or directory %s to %s\n", oldFilename, newFilename);
@@ -1866,6 +2503,179 @@ bool MassStorage::PathExists(const char* directory, const char* subDirectory)
 	return PathExists(location);
 }
 
+// Start a new main loop iteration. The print file reader never waits, so we only need to know whether there is one.
+// Each class gets its budget again, but a class in debt stays in debt until enough loops have passed to pay it off.
+void MassStorage::Spin()
+{
+	limitAccess = reprap.GetGCodes()->PrintingAFile();
+	for (size_t i = 0; i < numSdAccessClasses; i++)
+	{
+		accessCredit[i] = (limitAccess) ? min<int32_t>(accessCredit[i] + sdAccessBudgets[i], sdAccessBudgets[i]) : sdAccessBudgets[i];
+	}
+}
+
+// Writes return once the data has reached the card, which may then take hundreds of milliseconds to program it.
+// The next FatFs call would wait for that, so we keep the main loop running and let the clients wait instead.
+bool MassStorage::CardBusy() const
+{
+	return sd_mmc_is_busy();
+}
+
+// Clients that can postpone their transfers call this first. If it returns false, they must try again on a later Spin.
+// A transfer needs as much credit as it has bytes, or all of the budget if it is larger. Every transfer is charged to
+// its class in Accessed, so a transfer larger than the budget makes the class wait for the following loops.
+bool MassStorage::CanAccess(SdAccessClass cls, size_t bytes)
+{
+	if (CardBusy())
+	{
+		++busyDeferrals;
+	}
+	else if (!limitAccess || sdAccessBudgets[cls] == 0 || accessCredit[cls] >= (int32_t)min<size_t>(bytes, sdAccessBudgets[cls]))
+	{
+		return true;
+	}
+
+	++deferrals[cls];
+	if (!waiting[cls])
+	{
+		waiting[cls] = true;
+		waitingSince[cls] = micros();
+	}
+	return false;
+}
+
+// Called by FileStore after each FatFs transfer
+void MassStorage::Accessed(SdAccessClass cls, size_t bytes, uint32_t microseconds)
+{
+	if (sdAccessBudgets[cls] != 0)
+	{
+		accessCredit[cls] -= bytes;
+	}
+	++transfers[cls];
+	bytesTransferred[cls] += bytes;
+	busyTime[cls] += microseconds;
+	if (waiting[cls])
+	{
+		const uint32_t waitTime = micros() - waitingSince[cls];
+		waiting[cls] = false;
+		++waits[cls];
+		totalWaitTime[cls] += waitTime;
+		if (waitTime > longestWaitTime[cls])
+		{
+			longestWaitTime[cls] = waitTime;
+		}
+	}
+}
+
+// Take a table from the pool and let FatFs fill it with the cluster chain of the file, so that it can find the cluster
+// holding any offset without following the chain. Returns the table or NULL if the file has to be seeked the slow way.
+DWORD *MassStorage::BuildLinkMap(FIL *file)
+{
+	for (size_t i = 0; i < LINK_MAP_TABLES; i++)
+	{
+		if (!linkMapInUse[i])
+		{
+			DWORD *table = linkMaps[i];
+			table[0] = LINK_MAP_LENGTH;
+			file->cltbl = table;
+			if (f_lseek(file, CREATE_LINKMAP) != FR_OK)
+			{
+				// The file is too fragmented for our table
+				file->cltbl = NULL;
+				++linkMapsTooSmall;
+				return NULL;
+			}
+
+			linkMapInUse[i] = true;
+			++linkMapsBuilt;
+			return table;
+		}
+	}
+
+	++linkMapShortages;
+	return NULL;
+}
+
+void MassStorage::ReleaseLinkMap(DWORD *table)
+{
+	for (size_t i = 0; i < LINK_MAP_TABLES; i++)
+	{
+		if (linkMaps[i] == table)
+		{
+			linkMapInUse[i] = false;
+			break;
+		}
+	}
+}
+
+byte *MassStorage::AllocateReadAheadBuffer()
+{
+	for (size_t i = 0; i < READ_AHEAD_BUFFERS; i++)
+	{
+		if (!readAheadBufferInUse[i])
+		{
+			readAheadBufferInUse[i] = true;
+			return reinterpret_cast<byte*>(readAheadBuffers[i]);
+		}
+	}
+
+	++readAheadShortages;
+	return NULL;
+}
+
+void MassStorage::ReleaseReadAheadBuffer(byte *buffer)
+{
+	for (size_t i = 0; i < READ_AHEAD_BUFFERS; i++)
+	{
+		if (reinterpret_cast<byte*>(readAheadBuffers[i]) == buffer)
+		{
+			readAheadBufferInUse[i] = false;
+			break;
+		}
+	}
+}
+
+void MassStorage::Diagnostics()
+{
+	static const char *className[numSdAccessClasses] = { "print", "upload", "web file", "file info", "other" };
+
+	platform->AppendMessage(BOTH_MESSAGE, "SD card transfers (count, KiB, busy ms, deferrals, avg/max wait ms):\n");
+	for (size_t i = 0; i < numSdAccessClasses; i++)
+	{
+		platform->AppendMessage(BOTH_MESSAGE, "%s: %u, %u, %.1f, %u, %.1f/%.1f\n", className[i], transfers[i], bytesTransferred[i]/1024,
+								(float)busyTime[i]/1000.0, deferrals[i], (waits[i] == 0) ? 0.0 : (float)totalWaitTime[i]/(1000.0 * waits[i]),
+								(float)longestWaitTime[i]/1000.0);
+		transfers[i] = bytesTransferred[i] = busyTime[i] = 0;
+		deferrals[i] = waits[i] = totalWaitTime[i] = longestWaitTime[i] = 0;
+	}
+	platform->AppendMessage(BOTH_MESSAGE, "Deferrals while the card was busy writing: %u\n", busyDeferrals);
+	busyDeferrals = 0;
+
+	unsigned int linkMapsInUse = 0;
+	for (size_t i = 0; i < LINK_MAP_TABLES; i++)
+	{
+		if (linkMapInUse[i])
+		{
+			++linkMapsInUse;
+		}
+	}
+	platform->AppendMessage(BOTH_MESSAGE, "Fast seek tables: %u of %u in use, %u built, %u files too fragmented, %u shortages\n",
+							linkMapsInUse, LINK_MAP_TABLES, linkMapsBuilt, linkMapsTooSmall, linkMapShortages);
+
+	unsigned int readAheadBuffersInUse = 0;
+	for (size_t i = 0; i < READ_AHEAD_BUFFERS; i++)
+	{
+		if (readAheadBufferInUse[i])
+		{
+			++readAheadBuffersInUse;
+		}
+	}
+	platform->AppendMessage(BOTH_MESSAGE, "Read-ahead buffers: %u of %u in use, %u shortages\n",
+							readAheadBuffersInUse, READ_AHEAD_BUFFERS, readAheadShortages);
+	platform->AppendMessage(BOTH_MESSAGE, "Directory cache: %u hits, %u loads, %u directories too large, %u invalidations\n",
+							dirCacheHits, dirCacheLoads, dirCacheOverflows, dirCacheInvalidations);
+}
+
 //------------------------------------------------------------------------------------------------
 
 FileStore::FileStore(Platform* p) : platform(p)
@@ -1874,11 +2684,19 @@ FileStore::FileStore(Platform* p) : platform(p)
 
 void FileStore::Init()
 {
+	buf = ownBuf;
+	nextBuf = NULL;
+	bufferSize = FILE_BUF_LEN;
 	bufferPointer = 0;
 	inUse = false;
 	writing = false;
 	lastBufferEntry = 0;
+	nextBufferValid = false;
 	openCount = 0;
+	accessClass = sdAccessOther;
+	writer = NULL;
+	abandoned = false;
+	linkMap = NULL;
 }
 
 // Open a local file (for example on an SD card).
@@ -1890,8 +2708,12 @@ bool FileStore::Open(const char* directory, const char* fileName, bool write)
 							? platform->GetMassStorage()->CombineName(directory, fileName)
 								: fileName;
 	writing = write;
-	lastBufferEntry = FILE_BUF_LEN - 1;
+	lastBufferEntry = 0;
 	bytesRead = 0;
+	if (writing)
+	{
+		platform->GetMassStorage()->DirectoryChanged();
+	}
 
 	FRESULT openReturn = f_open(&file, location, (writing) ? FA_CREATE_ALWAYS | FA_WRITE : FA_OPEN_EXISTING | FA_READ);
 	if (openReturn != FR_OK)
@@ -1900,9 +2722,34 @@ bool FileStore::Open(const char* directory, const char* fileName, bool write)
 		return false;
 	}
 
-	bufferPointer = (writing) ? 0 : FILE_BUF_LEN;
+	buf = ownBuf;
+	nextBuf = NULL;
+	bufferSize = FILE_BUF_LEN;
+	bufferPointer = 0;
+	nextBufferValid = false;
 	inUse = true;
 	openCount = 1;
+	accessClass = sdAccessOther;
+	writer = NULL;
+	abandoned = false;
+	linkMap = NULL;
+
+	// If we are opening a file for reading that is still being uploaded, follow the FileStore that is writing it.
+	// Both refer to the same directory entry, and with the tiny FatFs configuration they share the sector window,
+	// so everything the writer has passed to FatFs can be read back.
+	if (!writing)
+	{
+		for (size_t i = 0; i < MAX_FILES; i++)
+		{
+			FileStore *f = platform->files[i];
+			if (f != this && f->inUse && f->writing && f->file.dir_sect == file.dir_sect && f->file.dir_ptr == file.dir_ptr)
+			{
+				writer = f;
+				FollowWriter();
+				break;
+			}
+		}
+	}
 	return true;
 }
 
@@ -1932,14 +2779,131 @@ bool FileStore::Close()
 	if (writing)
 	{
 		ok = Flush();
+		ReleaseReaders(false);
+		platform->GetMassStorage()->DirectoryChanged();		// the size and date of the file have changed
 	}
+	if (linkMap != NULL)
+	{
+		platform->GetMassStorage()->ReleaseLinkMap(linkMap);
+		linkMap = NULL;
+	}
+	ReleaseReadAheadBuffers();
 	FRESULT fr = f_close(&file);
 	inUse = false;
 	writing = false;
 	lastBufferEntry = 0;
+	writer = NULL;
 	return ok && fr == FR_OK;
 }
 
+// The file being printed is read a character at a time by GCodes, so give it a pair of large buffers from the pool
+// and fill the second one from Platform::Spin while the first is being used. Other files keep their small buffer.
+void FileStore::SetAccessClass(SdAccessClass cls)
+{
+	accessClass = cls;
+	if (cls != sdAccessPrint || !inUse || writing || nextBuf != NULL)
+	{
+		return;
+	}
+
+	MassStorage *ms = platform->GetMassStorage();
+	byte *first = ms->AllocateReadAheadBuffer();
+	if (first == NULL)
+	{
+		return;
+	}
+	byte *second = ms->AllocateReadAheadBuffer();
+	if (second == NULL)
+	{
+		ms->ReleaseReadAheadBuffer(first);
+		return;
+	}
+
+	// Keep whatever has been read into the small buffer but not consumed yet
+	const unsigned int bytesLeft = (bufferPointer < (int)lastBufferEntry) ? lastBufferEntry - bufferPointer : 0;
+	memcpy(first, buf + bufferPointer, bytesLeft);
+	buf = first;
+	nextBuf = second;
+	bufferSize = READ_AHEAD_BUF_LEN;
+	bufferPointer = 0;
+	lastBufferEntry = bytesLeft;
+	nextBufferValid = false;
+}
+
+void FileStore::ReleaseReadAheadBuffers()
+{
+	if (nextBuf != NULL)
+	{
+		MassStorage *ms = platform->GetMassStorage();
+		ms->ReleaseReadAheadBuffer(buf);
+		ms->ReleaseReadAheadBuffer(nextBuf);
+		buf = ownBuf;
+		nextBuf = NULL;
+		bufferSize = FILE_BUF_LEN;
+		nextBufferValid = false;
+	}
+}
+
+bool FileStore::IsGrowing() const
+{
+	return writer != NULL;
+}
+
+bool FileStore::WasAbandoned() const
+{
+	return abandoned;
+}
+
+// Called by the writer of a file when it is about to be closed and deleted without having been completed
+void FileStore::Abandon()
+{
+	if (inUse && writing)
+	{
+		ReleaseReaders(true);
+	}
+}
+
+// Detach any readers that are following this file. They keep the final length unless the file has been abandoned.
+void FileStore::ReleaseReaders(bool abandon)
+{
+	for (size_t i = 0; i < MAX_FILES; i++)
+	{
+		FileStore *f = platform->files[i];
+		if (f->writer == this)
+		{
+			f->FollowWriter();
+			f->writer = NULL;
+			f->abandoned = abandon;
+		}
+	}
+}
+
+// Without a cluster link map table, FatFs follows the cluster chain from the start of the file on every backwards seek.
+// So large files get a table on their first seek, unless they are still growing, which would make the table stale.
+void FileStore::UseLinkMap()
+{
+	if (linkMap == NULL && writer == NULL && file.fsize >= FAST_SEEK_MIN_LENGTH)
+	{
+		linkMap = platform->GetMassStorage()->BuildLinkMap(&file);
+	}
+}
+
+// If we are following a file that is being written, pick up the data that has been written since we last looked.
+// Returns true if more data has become available.
+bool FileStore::FollowWriter()
+{
+	if (writer == NULL || writer->file.fsize <= file.fsize)
+	{
+		return false;
+	}
+	if (file.sclust == 0)
+	{
+		file.sclust = writer->file.sclust;		// the file was empty when we opened it
+	}
+	file.fsize = writer->file.fsize;
+	return true;
+}
+
 unsigned long FileStore::Position() const
 {
 	return bytesRead;
@@ -1956,10 +2920,16 @@ bool FileStore::Seek(unsigned long pos)
 	{
 		WriteBuffer();
 	}
+	else
+	{
+		FollowWriter();
+		UseLinkMap();
+	}
 	FRESULT fr = f_lseek(&file, pos);
 	if (fr == FR_OK)
 	{
-		bufferPointer = (writing) ? 0 : FILE_BUF_LEN;
+		bufferPointer = lastBufferEntry = 0;
+		nextBufferValid = false;
 		bytesRead = pos;
 		return true;
 	}
@@ -1997,27 +2967,78 @@ int8_t FileStore::Status()
 	if (!inUse)
 		return nothing;
 
-	if (lastBufferEntry == FILE_BUF_LEN)
-		return byteAvailable;
-
-	if (bufferPointer < lastBufferEntry)
+	if (bufferPointer < (int)lastBufferEntry || (nextBufferValid && nextBufferEntries != 0) || file.fptr < file.fsize)
 		return byteAvailable;
 
 	return nothing;
 }
 
+// Refill the buffer once it has been used up, from the read-ahead buffer if it holds any data
 bool FileStore::ReadBuffer()
 {
-	FRESULT readStatus = f_read(&file, buf, FILE_BUF_LEN, &lastBufferEntry);	// Read a chunk of file
+	bufferPointer = 0;
+	if (nextBufferValid)
+	{
+		byte *temp = buf;
+		buf = nextBuf;
+		nextBuf = temp;
+		lastBufferEntry = nextBufferEntries;
+		nextBufferValid = false;
+		if (lastBufferEntry != 0)
+		{
+			return true;
+		}
+	}
+
+	FollowWriter();
+	if (file.fptr >= file.fsize)
+	{
+		lastBufferEntry = 0;			// nothing more to read, at least until the writer of the file catches up
+		return true;
+	}
+
+	uint32_t time = micros();
+	FRESULT readStatus = f_read(&file, buf, bufferSize, &lastBufferEntry);	// Read a chunk of file
+	platform->GetMassStorage()->Accessed(accessClass, lastBufferEntry, micros() - time);
 	if (readStatus)
 	{
+		lastBufferEntry = 0;
 		platform->Message(BOTH_ERROR_MESSAGE, "Error reading file.\n");
 		return false;
 	}
-	bufferPointer = 0;
 	return true;
 }
 
+// Called from Platform::Spin. If the current buffer is being consumed and the next one is empty, fill it.
+// If the card is still busy after a write, we try again next time rather than wait for it.
+void FileStore::ReadAhead()
+{
+	if (!inUse || nextBuf == NULL || nextBufferValid || abandoned || bufferPointer >= (int)lastBufferEntry
+			|| platform->GetMassStorage()->CardBusy())
+	{
+		return;
+	}
+
+	FollowWriter();
+	if (file.fptr < file.fsize)
+	{
+		uint32_t time = micros();
+		FRESULT readStatus = f_read(&file, nextBuf, bufferSize, &nextBufferEntries);
+		platform->GetMassStorage()->Accessed(accessClass, nextBufferEntries, micros() - time);
+		nextBufferValid = (readStatus == FR_OK);	// if it failed, ReadBuffer will try again and report the error
+	}
+}
+
+// Throw away the buffered data before a block read. FatFs has read beyond the position of our caller if we
+// had anything buffered, so go back to that position.
+bool FileStore::DiscardBuffers()
+{
+	const bool readAhead = bufferPointer < (int)lastBufferEntry || (nextBufferValid && nextBufferEntries != 0);
+	bufferPointer = lastBufferEntry = 0;
+	nextBufferValid = false;
+	return !readAhead || f_lseek(&file, bytesRead) == FR_OK;
+}
+
 // Single character read via the buffer
 bool FileStore::Read(char& b)
 {
@@ -2027,8 +3048,15 @@ bool FileStore::Read(char& b)
 		return false;
 	}
 
-	if (bufferPointer >= FILE_BUF_LEN)
+	if (abandoned)
 	{
+		b = 0;
+		return false;
+	}
+
+	if (bufferPointer >= (int)lastBufferEntry)
+	{
+		// This also picks up anything that the writer of the file has written since we last caught up with it
 		bool ok = ReadBuffer();
 		if (!ok)
 		{
@@ -2036,7 +3064,7 @@ bool FileStore::Read(char& b)
 		}
 	}
 
-	if (bufferPointer >= lastBufferEntry)
+	if (bufferPointer >= (int)lastBufferEntry)
 	{
 		b = 0;  // Good idea?
 		return false;
@@ -2057,9 +3085,20 @@ int FileStore::Read(char* extBuf, unsigned int nBytes)
 		platform->Message(BOTH_ERROR_MESSAGE, "Attempt to read from a non-open file.\n");
 		return -1;
 	}
-	bufferPointer = FILE_BUF_LEN;	// invalidate the buffer
+	if (abandoned)
+	{
+		return -1;
+	}
+	if (!DiscardBuffers())
+	{
+		platform->Message(BOTH_ERROR_MESSAGE, "Error reading file.\n");
+		return -1;
+	}
+	FollowWriter();
 	UINT bytes_read;
+	uint32_t time = micros();
 	FRESULT readStatus = f_read(&file, extBuf, nBytes, &bytes_read);
+	platform->GetMassStorage()->Accessed(accessClass, bytes_read, micros() - time);
 	if (readStatus)
 	{
 		platform->Message(BOTH_ERROR_MESSAGE, "Error reading file.\n");
@@ -2093,7 +3132,7 @@ bool FileStore::Write(char b)
 	}
 	buf[bufferPointer] = b;
 	bufferPointer++;
-	if (bufferPointer >= FILE_BUF_LEN)
+	if (bufferPointer >= (int)bufferSize)
 	{
 		return WriteBuffer();
 	}
@@ -2139,6 +3178,7 @@ bool FileStore::InternalWriteBlock(const char *s, unsigned int len)
 	uint32_t time = micros();
  	FRESULT writeStatus = f_write(&file, s, len, &bytesWritten);
 	time = micros() - time;
+	platform->GetMassStorage()->Accessed(accessClass, bytesWritten, time);
 	if (time > longestWriteTime)
 	{
 		longestWriteTime = time;
@@ -2179,8 +3219,9 @@ uint32_t FileStore::longestWriteTime = 0;
 
 // Serial/USB class
 
-Line::Line(Stream& p_iface) : iface(p_iface)
+Line::Line(Stream& p_iface, uint16_t p_inBufsize) : inBufsize(p_inBufsize), iface(p_iface)
 {
+	inBuffer = new char[inBufsize];
 }
 
 int8_t Line::Status() const
@@ -2198,7 +3239,7 @@ void Line::InjectString(char* string)
 	int i = 0;
 	while(string[i])
 	{
-		inBuffer[(inputGetIndex + inputNumChars) % lineInBufsize] = string[i];
+		inBuffer[(inputGetIndex + inputNumChars) % inBufsize] = string[i];
 		inputNumChars++;
 		i++;
 	}
@@ -2209,11 +3250,30 @@ int Line::Read(char& b)
 	if (inputNumChars == 0)
 		return 0;
 	b = inBuffer[inputGetIndex];
-	inputGetIndex = (inputGetIndex + 1) % lineInBufsize;
+	inputGetIndex = (inputGetIndex + 1) % inBufsize;
 	--inputNumChars;
 	return 1;
 }
 
+// Read characters up to and including the end of the next line, as far as they have arrived.
+// Return the number of characters read, which is zero if there are none.
+size_t Line::ReadLine(char *buf, size_t maxLength)
+{
+	size_t n = 0;
+	while (n < maxLength && inputNumChars != 0)
+	{
+		const char c = inBuffer[inputGetIndex];
+		inputGetIndex = (inputGetIndex + 1) % inBufsize;
+		--inputNumChars;
+		buf[n++] = c;
+		if (c == '\n' || c == 0)
+		{
+			break;
+		}
+	}
+	return n;
+}
+
 void Line::Init()
 {
 	inputGetIndex = 0;
@@ -2223,25 +3283,32 @@ void Line::Init()
 	ignoringOutputLine = false;
 	inWrite = 0;
 	outputColumn = 0;
+	bytesRead = bytesWritten = 0;
+	inputHighWater = 0;
+	lastReportTime = millis();
 }
 
 void Line::Spin()
 {
 	// Read the serial data in blocks to avoid excessive flow control
-	if (inputNumChars <= lineInBufsize / 2)
+	if (inputNumChars <= inBufsize / 2)
 	{
-		int16_t target = iface.available() + (int16_t) inputNumChars;
-		if (target > lineInBufsize)
+		while (inputNumChars < inBufsize)
 		{
-			target = lineInBufsize;
+			// Copy as much as will fit before the end of the buffer, then go round again to fill the start
+			const uint16_t putIndex = (inputGetIndex + inputNumChars) % inBufsize;
+			const size_t space = min<size_t>(inBufsize - inputNumChars, inBufsize - putIndex);
+			const size_t n = iface.readAvailable(inBuffer + putIndex, space);
+			if (n == 0)
+			{
+				break;
+			}
+			inputNumChars += n;
+			bytesRead += n;
 		}
-		while ((int16_t) inputNumChars < target)
+		if (inputNumChars > inputHighWater)
 		{
-			int incomingByte = iface.read();
-			if (incomingByte < 0)
-				break;
-			inBuffer[(inputGetIndex + inputNumChars) % lineInBufsize] = (char) incomingByte;
-			++inputNumChars;
+			inputHighWater = inputNumChars;
 		}
 	}
 
@@ -2249,9 +3316,10 @@ void Line::Spin()
 }
 
 // Write a character to USB.
-// If 'block' is true then we don't return until we have either written it to the USB port or put it in the buffer.
+// If 'block' is true then we don't return until we have put it in the buffer.
 // Otherwise, if the buffer is full then we append ".\n" to the end of it, return immediately and ignore the rest
 // of the data we are asked to print until we get a new line.
+// Characters are buffered and sent a line at a time, because each write to the USB port sends a packet.
 void Line::Write(char b, bool block)
 {
 	if (b == '\n')
@@ -2283,53 +3351,53 @@ void Line::Write(char b, bool block)
 	{
 		for(;;)
 		{
+			if (   outputNumChars + 2 < lineOutBufSize							// save 2 spaces in the output buffer
+				|| (outputNumChars < lineOutBufSize && (block || b == '\n'))	//...unless doing blocking output or writing newline
+			   )
+			{
+				outBuffer[(outputGetIndex + outputNumChars) % lineOutBufSize] = b;
+				++outputNumChars;
+				break;
+			}
+
+			// The buffer is full, so try to make room in it
+			const uint16_t oldNumChars = outputNumChars;
 			TryFlushOutput();
+			if (outputNumChars != oldNumChars)
+			{
+				continue;
+			}
 			if (block)
 			{
 				iface.flush();
+				continue;
 			}
 
-			// FIXME: Remember to open an issue for the core patches on Arduino's GitHub site
-			if (outputNumChars == 0 && iface.canWrite() != 0)
-			{
-				// We can write the character directly into the output buffer
-				++inWrite;
-				iface.write(b);
-				--inWrite;
-				break;
-			}
-			else if (   outputNumChars + 2 < lineOutBufSize							// save 2 spaces in the output buffer
-					 || (outputNumChars < lineOutBufSize && (block || b == '\n'))	//...unless doing blocking output or writing newline
-					)
+			if (outputNumChars + 2 == lineOutBufSize)
 			{
-				outBuffer[(outputGetIndex + outputNumChars) % lineOutBufSize] = b;
+				// We still have our 2 free characters, so append ".\n" to the line to indicate it was incomplete
+				outBuffer[(outputGetIndex + outputNumChars) % lineOutBufSize] = '.';
+				++outputNumChars;
+				outBuffer[(outputGetIndex + outputNumChars) % lineOutBufSize] = '\n';
 				++outputNumChars;
-				break;
 			}
-			else if (!block)
+			else
 			{
-				if (outputNumChars + 2 == lineOutBufSize)
-				{
-					// We still have our 2 free characters, so append ".\n" to the line to indicate it was incomplete
-					outBuffer[(outputGetIndex + outputNumChars) % lineOutBufSize] = '.';
-					++outputNumChars;
-					outBuffer[(outputGetIndex + outputNumChars) % lineOutBufSize] = '\n';
-					++outputNumChars;
-				}
-				else
-				{
-					// As we don't have 2 spare characters in the buffer, we can't have written any of the current line.
-					// So ignore the whole line.
-				}
-				ignoringOutputLine = true;
-				break;
+				// As we don't have 2 spare characters in the buffer, we can't have written any of the current line.
+				// So ignore the whole line.
 			}
+			ignoringOutputLine = true;
+			break;
 		}
 
-		TryFlushOutput();
-		if (block)
+		// Send complete lines straight away. Anything else goes when the buffer fills up or on the next Spin.
+		if (b == '\n')
 		{
-			iface.flush();
+			TryFlushOutput();
+			if (block)
+			{
+				iface.flush();
+			}
 		}
 	}
 	// else discard the character
@@ -2343,21 +3411,39 @@ void Line::Write(const char* b, bool block)
 	}
 }
 
+// Send as much of the output buffer as the interface will take without waiting, in as few writes as possible
 void Line::TryFlushOutput()
 {
-	//debug
-	//while (SerialUSB.canWrite() == 0) {}
-	//end debug
-
-	// FIXME: Remember to open an issue for the core patches on Arduino's GitHub site
-	while (outputNumChars != 0 && iface.canWrite() != 0)
+	while (outputNumChars != 0)
 	{
+		const size_t space = iface.canWrite();
+		if (space == 0)
+		{
+			break;
+		}
+
+		// FIXME: Remember to open an issue for the core patches on Arduino's GitHub site
+		const size_t chunk = min<size_t>(min<size_t>(space, outputNumChars), lineOutBufSize - outputGetIndex);
 		++inWrite;
-		iface.write(outBuffer[outputGetIndex]);
+		iface.write(reinterpret_cast<const uint8_t *>(outBuffer + outputGetIndex), chunk);
 		--inWrite;
-		outputGetIndex = (outputGetIndex + 1) % lineOutBufSize;
-		--outputNumChars;
+		outputGetIndex = (outputGetIndex + chunk) % lineOutBufSize;
+		outputNumChars -= chunk;
+		bytesWritten += chunk;
 	}
 }
 
+// Report and reset the transfer statistics. Sending M122 before and after streaming a file gives the sustained rate.
+void Line::Diagnostics(const char *name)
+{
+	const uint32_t now = millis();
+	const float interval = max<float>((float)(now - lastReportTime) * 0.001, 0.001);
+	reprap.GetPlatform()->AppendMessage(BOTH_MESSAGE, "%s: received %u bytes (%.0f/sec), sent %u bytes (%.0f/sec), input buffer high water %u of %u\n",
+											name, bytesRead, (float)bytesRead/interval, bytesWritten, (float)bytesWritten/interval,
+											inputHighWater, inBufsize);
+	bytesRead = bytesWritten = 0;
+	inputHighWater = inputNumChars;
+	lastReportTime = now;
+}
+
 // End
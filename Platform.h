@@ -51,6 +51,7 @@ Licence: GPL
 #include "Arduino.h"
 #include "SD_HSMCI.h"
 #include "MCP4461.h"
+#include "FlashLog.h"
 
 /**************************************************************************************************/
 
@@ -182,13 +183,19 @@ const float defaultPidMaxes[HEATERS] = {255, 180, 180, 180, 180, 180};			// maxi
 const unsigned int adOversampleBits = 1;					// number of bits we oversample when reading temperatures
 
 // Define the number of temperature readings we average for each thermistor. This should be a power of 2 and at least 4 ** adOversampleBits.
-// Keep numThermistorReadingsAveraged * NUM_HEATERS * 2ms no greater than HEAT_SAMPLE_TIME or the PIDs won't work well.
-const unsigned int numThermistorReadingsAveraged = (HEATERS > 3) ? 32 : 64;
+// Every thermistor is read on each 1ms tick, so keep numThermistorReadingsAveraged * 1ms no greater than HEAT_SAMPLE_TIME or the PIDs won't work well.
+const unsigned int numThermistorReadingsAveraged = 64;
 const unsigned int adRangeReal = 4095;						// the ADC that measures temperatures gives an int this big as its max value
 const unsigned int adRangeVirtual = ((adRangeReal + 1) << adOversampleBits) - 1;	// the max value we can get using oversampling
 const unsigned int adDisconnectedReal = adRangeReal - 3;	// we consider an ADC reading at/above this value to indicate that the thermistor is disconnected
 const unsigned int adDisconnectedVirtual = adDisconnectedReal << adOversampleBits;
 
+// Temperatures are looked up in a table per heater that holds the ADC reading at each of these temperatures.
+// Readings outside the table are converted by the thermistor formula.
+const float thermistorTableMinTemperature = 0.0;
+const float thermistorTableStep = 5.0;
+const size_t thermistorTableLength = 81;				// up to 400C
+
 #define HOT_BED 0 	// The index of the heated bed; set to -1 if there is no heated bed
 #define E0_HEATER 1 //the index of the first extruder heater
 #define E1_HEATER 2 //the index of the second extruder heater
@@ -202,12 +209,36 @@ const unsigned int adDisconnectedVirtual = adDisconnectedReal << adOversampleBit
 // File handling
 
 #define MAX_FILES (10)		// must be large enough to handle the max number of simultaneous web requests + file being printed
-#define FILE_BUF_LEN (256)
+#define FILE_BUF_LEN (256)						// buffer size of files that are not being printed
+#define SECTOR_LEN (512)						// SD card sector size, large transfers should be aligned to it
+#define READ_AHEAD_BUF_LEN (2 * SECTOR_LEN)		// size of each of the pair of buffers the file being printed reads ahead into
+#define READ_AHEAD_BUFFERS (2)					// pool of read-ahead buffers, enough for the file being printed
+#define FAST_SEEK_MIN_LENGTH (256 * 1024)		// files at least this long get a cluster link map table when they are seeked
+#define LINK_MAP_TABLES (4)						// number of cluster link map tables, i.e. files that can seek fast at the same time
+#define LINK_MAP_LENGTH (66)					// entries per cluster link map table, enough for files in up to 32 fragments
+#define DIR_CACHE_DIRECTORIES (2)				// number of directory listings kept in RAM
+#define DIR_CACHE_ENTRIES (64)					// entries per cached directory, larger directories are listed from the card
+#define DIR_CACHE_NAME_SPACE (1536)				// characters of file names per cached directory
 #define WEB_DIR "0:/www/" 						// Place to find web files on the SD card
 #define GCODE_DIR "0:/gcodes/" 					// Ditto - g-codes
 #define SYS_DIR "0:/sys/" 						// Ditto - system files
 #define TEMP_DIR "0:/tmp/" 						// Ditto - temporary files
 
+// Classes of SD card access, in order of priority. While a file is being printed, the classes that can wait may only
+// transfer their budget of bytes per main loop iteration on average, so that reading the print file is never held up
+// for long. A transfer larger than the budget is allowed, but the class then waits until later loops have paid for it.
+enum SdAccessClass
+{
+	sdAccessPrint = 0,			// the file being printed
+	sdAccessUpload = 1,			// files uploaded by HTTP or FTP
+	sdAccessWebFile = 2,		// files sent by HTTP or FTP
+	sdAccessFileInfo = 3,		// G-code file information scans
+	sdAccessOther = 4,			// configuration, macros and everything else
+	numSdAccessClasses
+};
+
+const int32_t sdAccessBudgets[numSdAccessClasses] = { 0, 512, 512, 0, 0 };	// bytes per loop while printing, 0 means no limit
+
 #define MAC_ADDRESS {0xBE, 0xEF, 0xDE, 0xAD, 0xFE, 0xED}
 
 
@@ -220,11 +251,14 @@ const unsigned int adDisconnectedVirtual = adDisconnectedReal << adOversampleBit
 
 const int atxPowerPin = 12;						// Arduino Due pin number that controls the ATX power on/off
 
-const uint16_t lineInBufsize = 256;				// use a power of 2 for good performance
+const uint16_t usbLineInBufsize = 1024;			// USB input buffer, large enough to hold several lines of G-code streamed by the host
+const uint16_t auxLineInBufsize = 256;			// aux port input buffer
 const uint16_t lineOutBufSize = 2048;			// ideally this should be large enough to hold the results of an M503 command,
 												// but could be reduced if we ever need the memory
 const size_t messageStringLength = 256;			// max length of a message chunk sent via Message or AppendMessage
 
+const float nvSaveDelay = 2.0;					// seconds the auto-saved settings must stay unchanged before we write them to flash
+
 /****************************************************************************************************/
 
 enum EndStopHit
@@ -282,6 +316,7 @@ public:
 
 	int8_t Status() const; // Returns OR of IOStatus
 	int Read(char& b);
+	size_t ReadLine(char *buf, size_t maxLength);
 	void Write(char b, bool block = false);
 	void Write(const char* s, bool block = false);
 
@@ -290,24 +325,30 @@ friend class RepRap;
 
 protected:
 
-	Line(Stream& p_iface);
+	Line(Stream& p_iface, uint16_t p_inBufsize);
 	void Init();
 	void Spin();
 	void InjectString(char* string);
 	unsigned int GetOutputColumn() const { return outputColumn; }
+	void Diagnostics(const char *name);
 
 private:
 	void TryFlushOutput();
 
-	// Although the sam3x usb interface code already has a 512-byte buffer, adding this extra 256-byte buffer
-	// increases the speed of uploading to the SD card by 10%
-	char inBuffer[lineInBufsize];
+	// Although the sam3x usb interface code already has a 512-byte buffer, adding this extra buffer increases
+	// the speed of uploading to the SD card. Data is moved in and out of both buffers in blocks.
+	char *inBuffer;
+	const uint16_t inBufsize;
 	char outBuffer[lineOutBufSize];
 	uint16_t inputGetIndex;
 	uint16_t inputNumChars;
 	uint16_t outputGetIndex;
 	uint16_t outputNumChars;
 
+	uint32_t bytesRead, bytesWritten;		// transfer statistics for M122
+	uint16_t inputHighWater;
+	uint32_t lastReportTime;
+
 	uint8_t inWrite;
 	bool ignoringOutputLine;
 	unsigned int outputColumn;
@@ -323,15 +364,34 @@ public:
 	uint8_t day;
 	uint8_t month;
 	uint16_t year;
+	uint8_t hours;
+	uint8_t minutes;
+	uint8_t seconds;
 	char fileName[FILENAME_LENGTH];
 };
 
+// The position of a directory listing. Every caller that reads a listing across several calls owns one of these,
+// so that several listings can be read at the same time.
+class DirectoryIterator
+{
+	friend class MassStorage;
+
+	char directory[FILENAME_LENGTH];	// the directory being listed, without the trailing '/'
+	int cacheSlot;						// the cached directory we are reading, or -1 if we are reading the card
+	uint32_t generation;				// generation of the cached directory when we started reading it
+	size_t nextEntry;					// number of entries we have returned
+	DIR dir;							// FatFs directory object, used if the directory is too large to cache
+};
+
 class MassStorage
 {
 public:
 
   bool FindFirst(const char *directory, FileInfo &file_info);
   bool FindNext(FileInfo &file_info);
+  bool FindFirst(const char *directory, FileInfo &file_info, DirectoryIterator *iterator);
+  bool FindNext(FileInfo &file_info, DirectoryIterator *iterator);
+  bool GetFileInfo(const char *directory, const char *fileName, FileInfo &file_info);
   const char* GetMonthName(const uint8_t month);
   const char* CombineName(const char* directory, const char* fileName);
   bool Delete(const char* directory, const char* fileName);
@@ -341,6 +401,14 @@ public:
   bool FileExists(const char *file) const;
   bool PathExists(const char *path) const;
   bool PathExists(const char* directory, const char* subDirectory);
+  bool CanAccess(SdAccessClass cls, size_t bytes);								// May a client that can wait transfer this many bytes now?
+  void Accessed(SdAccessClass cls, size_t bytes, uint32_t microseconds);		// Record a transfer
+  bool CardBusy() const;														// Is the card still programming data we wrote?
+  DWORD *BuildLinkMap(FIL *file);												// Give a file a cluster link map table for fast seeks
+  void ReleaseLinkMap(DWORD *table);
+  byte *AllocateReadAheadBuffer();												// Take a READ_AHEAD_BUF_LEN buffer from the pool
+  void ReleaseReadAheadBuffer(byte *buffer);
+  void DirectoryChanged();														// Forget the cached directory listings
 
 friend class Platform;
 
@@ -348,13 +416,63 @@ protected:
 
   MassStorage(Platform* p);
   void Init();
+  void Spin();
+  void Diagnostics();
 
 private:
 
   Platform* platform;
   FATFS fileSystem;
 
-  DIR *findDir;
+  bool limitAccess;											// true while a file is being printed
+  int32_t accessCredit[numSdAccessClasses];				// bytes the class may still transfer, negative while it pays off a transfer
+  bool waiting[numSdAccessClasses];							// true if a client of this class has been deferred
+  uint32_t waitingSince[numSdAccessClasses];				// when the first deferral happened, in microseconds
+  uint32_t transfers[numSdAccessClasses];
+  uint32_t bytesTransferred[numSdAccessClasses];
+  uint32_t busyTime[numSdAccessClasses];					// total microseconds spent in FatFs
+  uint32_t deferrals[numSdAccessClasses];
+  uint32_t waits[numSdAccessClasses];
+  uint32_t totalWaitTime[numSdAccessClasses];				// total microseconds that deferred clients waited
+  uint32_t longestWaitTime[numSdAccessClasses];
+  uint32_t busyDeferrals;									// deferrals because the card was still programming
+
+  DWORD linkMaps[LINK_MAP_TABLES][LINK_MAP_LENGTH];		// pool of cluster link map tables for FatFs fast seeks
+  bool linkMapInUse[LINK_MAP_TABLES];
+  uint32_t linkMapsBuilt, linkMapsTooSmall, linkMapShortages;
+
+  uint32_t readAheadBuffers[READ_AHEAD_BUFFERS][READ_AHEAD_BUF_LEN/sizeof(uint32_t)];	// word-aligned so FatFs can transfer whole sectors into them
+  bool readAheadBufferInUse[READ_AHEAD_BUFFERS];
+  uint32_t readAheadShortages;
+
+  struct CachedEntry
+  {
+	uint32_t size;
+	uint16_t date, time;				// in FAT format
+	uint16_t nameOffset;				// index of the name in the names of the cached directory
+	uint8_t attributes;
+  };
+
+  struct CachedDirectory
+  {
+	char directory[FILENAME_LENGTH];	// without the trailing '/'
+	bool valid;
+	uint32_t generation;				// different every time the directory is read, so that iterators notice changes
+	uint32_t lastUsed;					// millis() when we last read from it, to choose the one to replace
+	size_t numEntries;
+	CachedEntry entries[DIR_CACHE_ENTRIES];
+	char names[DIR_CACHE_NAME_SPACE];
+  };
+
+  int FindCachedDirectory(const char *directory);
+  int GetCachedDirectory(const char *directory);
+  bool ReadDirectory(DIR *dir, FILINFO &entry);
+
+  CachedDirectory dirCache[DIR_CACHE_DIRECTORIES];
+  uint32_t dirCacheGeneration;
+  uint32_t dirCacheHits, dirCacheLoads, dirCacheOverflows, dirCacheInvalidations;
+
+  DirectoryIterator *findIterator;
 
   char combinedNameBuff[FILENAME_LENGTH];
   StringRef combinedName;
@@ -380,6 +498,10 @@ public:
 	float FractionRead() const;						// How far in we are
 	void Duplicate();								// Create a second reference to this file
 	bool Flush();									// Write remaining buffer data
+	bool IsGrowing() const;							// Is this file still being written through another FileStore?
+	bool WasAbandoned() const;						// Was the writing of this file abandoned while we were reading it?
+	void Abandon();									// Tell readers of this file that it will not be completed
+	void SetAccessClass(SdAccessClass cls);			// Tell the SD card scheduler who is using this file
 	static float GetAndClearLongestWriteTime();		// Return the longest time it took to write a block to a file, in milliseconds
 
 friend class Platform;
@@ -393,19 +515,34 @@ protected:
 private:
 
 	bool inUse;
-	byte buf[FILE_BUF_LEN];
+	byte ownBuf[FILE_BUF_LEN];		// the buffer we use unless we have read-ahead buffers from the MassStorage pool
+	byte *buf;						// the buffer being read or written, either ownBuf or a read-ahead buffer
+	byte *nextBuf;					// the buffer being read ahead into, or NULL if we don't read ahead
+	unsigned int bufferSize;		// size of buf and nextBuf
 	int bufferPointer;
 	unsigned long bytesRead;
 
 	bool ReadBuffer();
+	void ReadAhead();
+	bool DiscardBuffers();
+	void ReleaseReadAheadBuffers();
 	bool WriteBuffer();
 	bool InternalWriteBlock(const char *s, unsigned int len);
+	bool FollowWriter();
+	void ReleaseReaders(bool abandoned);
+	void UseLinkMap();
 
 	FIL file;
 	Platform* platform;
 	bool writing;
 	unsigned int lastBufferEntry;
+	unsigned int nextBufferEntries;	// number of bytes in nextBuf
+	bool nextBufferValid;			// true if nextBuf holds the data that follows buf
 	unsigned int openCount;
+	SdAccessClass accessClass;
+	FileStore *writer;				// if we are reading a file that is still being written, the FileStore writing it
+	bool abandoned;					// true if the writer gave up before completing the file
+	DWORD *linkMap;					// cluster link map table from the MassStorage pool, or NULL if we seek the slow way
 
 	static uint32_t longestWriteTime;
 };
@@ -459,6 +596,7 @@ public:
 	float kI, kD, kP, kT, kS;
 	float fullBand, pidMin, pidMax;
 	float thermistorSeriesR;
+	float thermistorShC;							// Steinhart-Hart C coefficient, or zero to use just the beta equation
 	float adcLowOffset, adcHighOffset;
 
 	float GetBeta() const { return thermistorBeta; }
@@ -631,6 +769,7 @@ public:
   float MotorCurrent(size_t drive) const;
   void SetIdleCurrentFactor(float f);
   float GetIdleCurrentFactor() const { return idleCurrentFactor; }
+  void SaveMotorCurrents();
   float DriveStepsPerUnit(int8_t drive) const;
   void SetDriveStepsPerUnit(int8_t drive, float value);
   float Acceleration(int8_t drive) const;
@@ -713,6 +852,7 @@ private:
   // The SAM3X doesn't have EEPROM so we save the data to flash. This unfortunately means that it gets cleared
   // every time we reprogram the firmware. So there is no need to cater for writing one version of this
   // struct and reading back another.
+  // SoftwareResetData is written at a fixed address. FlashData is saved as records in the settings log that follows it.
 
   struct SoftwareResetData
   {
@@ -727,8 +867,9 @@ private:
 
   struct FlashData
   {
-	  static const uint16_t magicValue = 0x59B2;	// value we use to recognise that the flash data has been written
-	  static const uint32_t nvAddress = SoftwareResetData::nvAddress + sizeof(struct SoftwareResetData);
+	  static const uint16_t magicValue = 0x59B3;	// value we use to recognise that the flash data has been written
+	  static const uint32_t logAddress = 1024;		// address in flash of the settings log, page aligned and after SoftwareResetData
+	  static const uint32_t logBankLength = 4096;	// length of each of the two banks of the settings log
 
 	  uint16_t magic;
 
@@ -751,6 +892,29 @@ private:
   FlashData nvData;
   bool autoSaveEnabled;
 
+  // Each part of nvData is saved as a record of its own in the settings log, so that changing one parameter
+  // appends one small record. Arrays whose elements change separately use one record per element.
+  struct NvRecord
+  {
+	  uint16_t key;									// key of the record, or of the first element's record
+	  uint8_t *data;								// the data in nvData
+	  uint16_t length;								// length of the data, or of one element
+	  uint16_t count;								// number of elements
+  };
+
+  static const uint16_t nvMagicKey = 0;				// key of the record holding the magic value
+  bool GetNvRecord(size_t index, uint16_t& key, uint8_t*& data, uint16_t& length);
+
+  FlashLog nvLog;
+
+  // Auto-saved settings are written to the log by Spin once they have stopped changing, one record per call
+  void ScheduleNvWrite();
+  bool WriteNvDataRecord();
+
+  bool nvDataDirty;								// nvData has changed since it was last written
+  float nvDataChangedTime;						// when it last changed
+  size_t nvWriteRecord;							// index of the next record to write
+
   float lastTime;
   float longWait;
   float addToTime;
@@ -768,6 +932,17 @@ private:
 
   void SetSlowestDrive();
   void UpdateMotorCurrent(size_t drive);
+  void SpinDigipots();
+  void FlushDigipots(uint32_t drives = 0xFFFFFFFF);
+  uint16_t PotValue(float current) const;
+
+  // The digipot wipers that set the motor currents are written from Spin, one I2C byte per call, so that enabling
+  // and idling the motors never waits for the I2C bus. Only the latest value asked for each wiper is sent.
+  enum class PotWriteState : uint8_t { idle, sendingCommand, sendingData, stopping };
+  static const uint16_t potValueUnknown = 0xFFFF;
+  static const uint32_t potWriteTimeout = 5;	// milliseconds the TWI may take over one step before we reset it
+  void StartDigipotWrite(Twi *twi);
+  void SetPotWriteState(PotWriteState state);
 
   int8_t stepPins[DRIVES];
   int8_t directionPins[DRIVES];
@@ -785,6 +960,15 @@ private:
   float idleCurrentFactor;
   MCP4461 mcpDuet;
   MCP4461 mcpExpansion;
+  uint16_t potValues[DRIVES];				// the wiper value wanted for each drive
+  uint16_t potValuesSent[DRIVES];			// the wiper value last written for each drive, or potValueUnknown
+  uint32_t potsPending;						// bitmap of drives whose wiper value has not been sent yet
+  PotWriteState potWriteState;
+  uint32_t potWriteStateTime;				// millis() when potWriteState was last changed
+  size_t potWriteDrive;						// the drive whose wiper is being written
+  uint16_t potWriteValue;					// the wiper value being written
+  uint8_t potWriteData;						// the data byte of that write
+  uint32_t potWrites, potWritesCoalesced, potWritesFailed;
   size_t slowestDrive;
 
 
@@ -813,6 +997,9 @@ private:
 // HEATERS - Bed is assumed to be the first
 
   int GetRawTemperature(byte heater) const;
+  float CalcTemperature(size_t heater, int rawTemp) const;
+  float CalcReading(size_t heater, float temperature) const;
+  void UpdateThermistorTable(size_t heater);
 
   int8_t tempSensePins[HEATERS];
   int8_t heatOnPins[HEATERS];
@@ -849,13 +1036,16 @@ private:
 
   adc_channel_num_t heaterAdcChannels[HEATERS];
   adc_channel_num_t zProbeAdcChannel;
+  volatile uint32_t adcChannelMask;					// the channels that the ADC converts in one burst on each tick
   uint32_t thermistorOverheatSums[HEATERS];
+  float thermistorTables[HEATERS][thermistorTableLength];	// ADC reading at each table temperature, highest reading first
+  bool thermistorTableValid[HEATERS];
   uint8_t tickState;
-  uint8_t currentHeater;
   int debugCode;
 
+  void UpdateAdcChannels();
   static uint16_t GetAdcReading(adc_channel_num_t chan);
-  static void StartAdcConversion(adc_channel_num_t chan);
+  void StartAdcConversions();
   static adc_channel_num_t PinToAdcChannel(int pin);
 
   char messageStringBuffer[messageStringLength];
@@ -900,7 +1090,6 @@ public:
 	}
 
 	bool Write(const char *s, unsigned int len)
-	//pre(len <= 256)
 	{
 		return f->Write(s, len);
 	}
@@ -930,6 +1119,24 @@ public:
 		return f->Length();
 	}
 
+	bool IsGrowing() const
+	{
+		return f != NULL && f->IsGrowing();
+	}
+
+	bool WasAbandoned() const
+	{
+		return f != NULL && f->WasAbandoned();
+	}
+
+	void Abandon()
+	{
+		if (f != NULL)
+		{
+			f->Abandon();
+		}
+	}
+
 	// Assignment operator
 	void CopyFrom(const FileData& other)
 	{
@@ -1210,7 +1417,7 @@ inline void Platform::SetMACAddress(uint8_t mac[])
 	}
 	if (changed && autoSaveEnabled)
 	{
-		WriteNvData();
+		ScheduleNvWrite();
 	}
 }
 
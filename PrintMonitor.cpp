@@ -226,6 +226,8 @@ bool PrintMonitor::GetFileInfo(const char *directory, const char *fileName, Gcod
 	FileStore *f = reprap.GetPlatform()->GetFileStore(directory, fileName, false);
 	if (f != NULL)
 	{
+		f->SetAccessClass(sdAccessFileInfo);
+
 		// Try to find the object height by looking for the last G1 Zxxx command in the file
 		info.fileSize = f->Length();
 		info.objectHeight = 0.0;
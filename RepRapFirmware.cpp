@@ -175,6 +175,17 @@ RepRap::RepRap() : active(false), debug(0), stopped(false), spinningModule(noMod
 
 	toolList = NULL;
 	chamberHeater = -1;
+
+	statusSeq = 0;
+	for(size_t i = 0; i < numStatusFields; i++)
+	{
+		statusFieldSeqs[i] = 0;
+	}
+	for(size_t i = 0; i < numStatusFragments; i++)
+	{
+		statusFragmentValid[i] = false;
+	}
+	fragmentsFormatted = fragmentsReused = 0;
 }
 
 void RepRap::Init()
@@ -347,6 +358,8 @@ void RepRap::Diagnostics()
 	gCodes->Diagnostics();
 	network->Diagnostics();
 	webserver->Diagnostics();
+	platform->AppendMessage(BOTH_MESSAGE, "Status sections formatted: %u, shared: %u\n", fragmentsFormatted, fragmentsReused);
+	fragmentsFormatted = fragmentsReused = 0;
 }
 
 // Turn off the heaters, disable the motors, and
@@ -437,6 +450,7 @@ void RepRap::AddTool(Tool* tool)
 		toolList->AddTool(tool);
 	}
 	tool->UpdateExtruderAndHeaterCount(activeExtruders, activeHeaters);
+	ToolsChanged();
 }
 
 void RepRap::DeleteTool(Tool* tool)
@@ -488,6 +502,7 @@ void RepRap::DeleteTool(Tool* tool)
 	{
 		t->UpdateExtruderAndHeaterCount(activeExtruders, activeHeaters);
 	}
+	ToolsChanged();
 }
 
 void RepRap::SelectTool(int toolNumber)
@@ -500,6 +515,8 @@ void RepRap::SelectTool(int toolNumber)
 		{
 			tool->Activate(currentTool);
 			currentTool = tool;
+			StatusFieldChanged(statusTool);
+			StatusFieldChanged(statusCoords);		// the reported coordinates include the tool offset
 			return;
 		}
 		tool = tool->Next();
@@ -512,6 +529,8 @@ void RepRap::SelectTool(int toolNumber)
 		StandbyTool(currentTool->Number());
 	}
 	currentTool = NULL;
+	StatusFieldChanged(statusTool);
+	StatusFieldChanged(statusCoords);
 }
 
 void RepRap::PrintTool(int toolNumber, StringRef& reply)
@@ -539,6 +558,8 @@ void RepRap::StandbyTool(int toolNumber)
 			if (currentTool == tool)
 			{
 				currentTool = NULL;
+				StatusFieldChanged(statusTool);
+				StatusFieldChanged(statusCoords);
 			}
 			return;
 		}
@@ -629,57 +650,32 @@ void RepRap::Tick()
 // Type 1 is the ordinary JSON status response.
 // Type 2 is the same except that static parameters are also included.
 // Type 3 is the same but instead of static parameters we report print estimation values.
-void RepRap::GetStatusResponse(StringRef& response, uint8_t type, bool forWebserver)
+// If changedSince is non-zero, only those sections are reported that have changed after the given status sequence number.
+// The current status sequence number is always reported as "statusSeq", so that clients can pass it back on the next request.
+void RepRap::GetStatusResponse(StringRef& response, uint8_t type, bool forWebserver, unsigned int changedSince)
 {
+	if (changedSince > statusSeq)
+	{
+		// The client must have seen a previous session, so send everything
+		changedSince = 0;
+	}
+
 	// Machine status
 	char ch = GetStatusCharacter();
-	response.printf("{\"status\":\"%c\",\"coords\":{", ch);
+	response.printf("{\"status\":\"%c\",\"statusSeq\":%u", ch, statusSeq);
 
 	/* Coordinates */
+	if (StatusFieldChangedSince(statusCoords, changedSince))
 	{
-		float liveCoordinates[DRIVES + 1];
-		if (currentTool != NULL)
-		{
-			const float *offset = currentTool->GetOffset();
-			for (size_t i = 0; i < AXES; ++i)
-			{
-				liveCoordinates[i] += offset[i];
-			}
-		}
-		move->LiveCoordinates(liveCoordinates);
-
-		// Homed axes
-		response.catf("\"axesHomed\":[%d,%d,%d]",
-				(gCodes->GetAxisIsHomed(0)) ? 1 : 0,
-				(gCodes->GetAxisIsHomed(1)) ? 1 : 0,
-				(gCodes->GetAxisIsHomed(2)) ? 1 : 0);
-
-		// Actual and theoretical extruder positions since power up, last G92 or last M23
-		response.catf(",\"extr\":");		// announce actual extruder positions
-		ch = '[';
-		for (uint8_t extruder = 0; extruder < GetExtrudersInUse(); extruder++)
-		{
-			response.catf("%c%.1f", ch, liveCoordinates[AXES + extruder]);
-			ch = ',';
-		}
-		if (ch == '[')
-		{
-			response.cat("[");
-		}
-
-		// XYZ positions
-		response.cat("],\"xyz\":");
-		ch = '[';
-		for (uint8_t axis = 0; axis < AXES; axis++)
-		{
-			response.catf("%c%.2f", ch, liveCoordinates[axis]);
-			ch = ',';
-		}
+		AppendStatusFragment(response, fragmentCoords);
 	}
 
 	// Current tool number
-	int toolNumber = (currentTool == NULL) ? -1 : currentTool->Number();
-	response.catf("]},\"currentTool\":%d", toolNumber);
+	if (StatusFieldChangedSince(statusTool, changedSince))
+	{
+		int toolNumber = (currentTool == NULL) ? -1 : currentTool->Number();
+		response.catf(",\"currentTool\":%d", toolNumber);
+	}
 
 	/* Output - only reported once */
 	{
@@ -714,23 +710,9 @@ void RepRap::GetStatusResponse(StringRef& response, uint8_t type, bool forWebser
 	}
 
 	/* Parameters */
+	if (StatusFieldChangedSince(statusParams, changedSince))
 	{
-		// ATX power
-		response.catf(",\"params\":{\"atxPower\":%d", platform->AtxPower() ? 1 : 0);
-
-		// Cooling fan value
-		float fanValue = (gCodes->CoolingInverted() ? 1.0 - platform->GetFanValue() : platform->GetFanValue());
-		response.catf(",\"fanPercent\":%.2f", fanValue * 100.0);
-
-		// Speed and Extrusion factors
-		response.catf(",\"speedFactor\":%.2f,\"extrFactors\":", move->GetSpeedFactor() * 100.0);
-		ch = '[';
-		for (uint8_t extruder = 0; extruder < GetExtrudersInUse(); extruder++)
-		{
-			response.catf("%c%.2f", ch, move->GetExtrusionFactor(extruder) * 100.0);
-			ch = ',';
-		}
-		response.cat((ch == '[') ? "[]}" : "]}");
+		AppendStatusFragment(response, fragmentParams);
 	}
 
 	// G-code reply sequence for webserver
@@ -767,77 +749,16 @@ void RepRap::GetStatusResponse(StringRef& response, uint8_t type, bool forWebser
 	}
 
 	/* Temperatures */
+	if (StatusFieldChangedSince(statusTemps, changedSince))
 	{
-		response.cat(",\"temps\":{");
-
-		/* Bed */
-#if HOT_BED != -1
-		{
-			response.catf("\"bed\":{\"current\":%.1f,\"active\":%.1f,\"state\":%d},",
-					heat->GetTemperature(HOT_BED), heat->GetActiveTemperature(HOT_BED),
-					heat->GetStatus(HOT_BED));
-		}
-#endif
-
-		/* Chamber */
-		if (chamberHeater != -1)
-		{
-			response.catf("\"chamber\":{\"current\":%.1f,", heat->GetTemperature(chamberHeater));
-			response.catf("\"active\":%.1f,", heat->GetActiveTemperature(chamberHeater));
-			response.catf("\"state\":%d},", static_cast<int>(heat->GetStatus(chamberHeater)));
-		}
-
-		/* Heads */
-		{
-			response.cat("\"heads\":{\"current\":");
-
-			// Current temperatures
-			ch = '[';
-			for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
-			{
-				response.catf("%c%.1f", ch, heat->GetTemperature(heater));
-				ch = ',';
-			}
-			response.cat((ch == '[') ? "[]" : "]");
-
-			// Active temperatures
-			response.catf(",\"active\":");
-			ch = '[';
-			for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
-			{
-				response.catf("%c%.1f", ch, heat->GetActiveTemperature(heater));
-				ch = ',';
-			}
-			response.cat((ch == '[') ? "[]" : "]");
-
-			// Standby temperatures
-			response.catf(",\"standby\":");
-			ch = '[';
-			for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
-			{
-				response.catf("%c%.1f", ch, heat->GetStandbyTemperature(heater));
-				ch = ',';
-			}
-			response.cat((ch == '[') ? "[]" : "]");
-
-			// Heater statuses (0=off, 1=standby, 2=active, 3=fault)
-			response.cat(",\"state\":");
-			ch = '[';
-			for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
-			{
-				response.catf("%c%d", ch, static_cast<int>(heat->GetStatus(heater)));
-				ch = ',';
-			}
-			response.cat((ch == '[') ? "[]" : "]");
-		}
-		response.cat("}}");
+		AppendStatusFragment(response, fragmentTemps);
 	}
 
 	// Time since last reset
 	response.catf(",\"time\":%.1f", platform->Time());
 
 	/* Extended Status Response */
-	if (type == 2)
+	if (type == 2 && StatusFieldChangedSince(statusStatic, changedSince))
 	{
 		// Cold Extrude/Retract
 		response.catf(",\"coldExtrudeTemp\":%1.f", ColdExtrude() ? 0 : HOT_ENOUGH_TO_EXTRUDE);
@@ -1092,109 +1013,17 @@ void RepRap::GetLegacyStatusResponse(StringRef& response, uint8_t type, int seq)
 		{
 			ch = 'S';
 		}
-		response.printf("{\"status\":\"%c\",\"heaters\":", ch);
-
-		// Send the heater actual temperatures
-		const Heat *heat = reprap.GetHeat();
-#if HOT_BED != -1
-		ch = ',';
-		response.catf("[%.1f", heat->GetTemperature(HOT_BED));
-#else
-		ch = '[';
-#endif
-		for (size_t heater = E0_HEATER; heater < reprap.GetHeatersInUse(); heater++)
-		{
-			response.catf("%c%.1f", ch, heat->GetTemperature(heater));
-			ch = ',';
-		}
-		response.cat((ch == '[') ? "[]" : "]");
-
-		// Send the heater active temperatures
-		response.catf(",\"active\":");
-#if HOT_BED != -1
-		ch = ',';
-		response.catf("[%.1f", heat->GetActiveTemperature(HOT_BED));
-#else
-		ch = '[';
-#endif
-		for (size_t heater = E0_HEATER; heater < reprap.GetHeatersInUse(); heater++)
-		{
-			response.catf("%c%.1f", ch, heat->GetActiveTemperature(heater));
-			ch = ',';
-		}
-		response.cat((ch == '[') ? "[]" : "]");
-
-		// Send the heater standby temperatures
-		response.catf(",\"standby\":");
-#if HOT_BED != -1
-		ch = ',';
-		response.catf("[%.1f", heat->GetStandbyTemperature(HOT_BED));
-#else
-		ch = '[';
-#endif
-		for (size_t heater = E0_HEATER; heater < reprap.GetHeatersInUse(); heater++)
-		{
-			response.catf("%c%.1f", ch, heat->GetStandbyTemperature(heater));
-			ch = ',';
-		}
-		response.cat((ch == '[') ? "[]" : "]");
-
-		// Send the heater statuses (0=off, 1=standby, 2=active)
-		response.cat(",\"hstat\":");
-#if HOT_BED != -1
-		ch = ',';
-		response.catf("[%d", static_cast<int>(heat->GetStatus(HOT_BED)));
-#else
-		ch = '[';
-#endif
-		for (size_t heater = E0_HEATER; heater < reprap.GetHeatersInUse(); heater++)
-		{
-			response.catf("%c%d", ch, static_cast<int>(heat->GetStatus(heater)));
-			ch = ',';
-		}
-		response.cat((ch == '[') ? "[]" : "]");
-
-		// Send XYZ positions
-		float liveCoordinates[DRIVES + 1];
-		reprap.GetMove()->LiveCoordinates(liveCoordinates);
-		const Tool* currentTool = reprap.GetCurrentTool();
-		if (currentTool != NULL)
-		{
-			const float *offset = currentTool->GetOffset();
-			for (size_t i = 0; i < AXES; ++i)
-			{
-				liveCoordinates[i] += offset[i];
-			}
-		}
-		response.catf(",\"pos\":");		// announce the XYZ position
-		ch = '[';
-		for (size_t drive = 0; drive < AXES; drive++)
-		{
-			response.catf("%c%.2f", ch, liveCoordinates[drive]);
-			ch = ',';
-		}
+		response.printf("{\"status\":\"%c\"", ch);
+		AppendStatusFragment(response, fragmentLegacyTemps);
 
-		// Send extruder total extrusion since power up, last G92 or last M23
-		response.cat("],\"extr\":");		// announce the extruder positions
-		ch = '[';
-		for (size_t drive = 0; drive < reprap.GetExtrudersInUse(); drive++)		// loop through extruders
-		{
-			response.catf("%c%.1f", ch, liveCoordinates[drive + AXES]);
-			ch = ',';
-		}
-		response.cat((ch == ']') ? "[]" : "]");
+		// Send XYZ positions and extruder total extrusion since power up, last G92 or last M23
+		AppendStatusFragment(response, fragmentLegacyCoords);
 
 		// Send the speed and extruder override factors
-		response.catf(",\"sfactor\":%.2f,\"efactor\":", move->GetSpeedFactor() * 100.0);
-		ch = '[';
-		for (size_t i = 0; i < reprap.GetExtrudersInUse(); ++i)
-		{
-			response.catf("%c%.2f", ch, move->GetExtrusionFactor(i) * 100.0);
-			ch = ',';
-		}
-		response.cat((ch == '[') ? "[]" : "]");
+		AppendStatusFragment(response, fragmentLegacyParams);
 
 		// Send the current tool number
+		const Tool* currentTool = reprap.GetCurrentTool();
 		int toolNumber = (currentTool == NULL) ? 0 : currentTool->Number();
 		response.catf(",\"tool\":%d", toolNumber);
 	}
@@ -1298,6 +1127,282 @@ void RepRap::GetLegacyStatusResponse(StringRef& response, uint8_t type, int seq)
 	response.cat("}");
 }
 
+// Append a section of a status response. Formatting the coordinates, temperatures and factors is the expensive part
+// of building a status response, so each section is formatted once and then shared between all the HTTP, WebSocket,
+// AUX and USB clients that ask for it, until the module that owns the data flags it as changed. The change checks in
+// Move::Spin and Heat::Spin run once per main loop, so that is how often these sections can become out of date.
+void RepRap::AppendStatusFragment(StringRef& response, StatusFragment fragment)
+{
+	static const StatusField fragmentFields[numStatusFragments] =
+	{
+		statusCoords, statusParams, statusTemps,		// JSON status response
+		statusTemps, statusCoords, statusParams			// legacy status response
+	};
+
+	const unsigned int seq = statusFieldSeqs[fragmentFields[fragment]];
+	if (statusFragmentValid[fragment] && statusFragmentSeqs[fragment] == seq)
+	{
+		++fragmentsReused;
+		response.cat(statusFragments[fragment]);
+		return;
+	}
+
+	StringRef cached(statusFragments[fragment], STATUS_FRAGMENT_LENGTH);
+	cached.Clear();
+	FormatStatusFragment(cached, fragment);
+	++fragmentsFormatted;
+	if (cached.strlen() + 1 < cached.Length())
+	{
+		statusFragmentSeqs[fragment] = seq;
+		statusFragmentValid[fragment] = true;
+		response.cat(cached.Pointer());
+	}
+	else
+	{
+		// The section doesn't fit in the cache, e.g. because a lot of heaters are in use, so don't share it
+		statusFragmentValid[fragment] = false;
+		FormatStatusFragment(response, fragment);
+	}
+}
+
+void RepRap::FormatStatusFragment(StringRef& response, StatusFragment fragment)
+{
+	char ch;
+	float liveCoordinates[DRIVES + 1];
+	switch (fragment)
+	{
+	case fragmentCoords:
+	case fragmentLegacyCoords:
+		move->LiveCoordinates(liveCoordinates);
+		if (currentTool != NULL)
+		{
+			const float *offset = currentTool->GetOffset();
+			for (size_t i = 0; i < AXES; ++i)
+			{
+				liveCoordinates[i] += offset[i];
+			}
+		}
+
+		if (fragment == fragmentCoords)
+		{
+			response.cat(",\"coords\":{");
+
+			// Homed axes
+			response.catf("\"axesHomed\":[%d,%d,%d]",
+					(gCodes->GetAxisIsHomed(0)) ? 1 : 0,
+					(gCodes->GetAxisIsHomed(1)) ? 1 : 0,
+					(gCodes->GetAxisIsHomed(2)) ? 1 : 0);
+
+			// Actual and theoretical extruder positions since power up, last G92 or last M23
+			response.catf(",\"extr\":");		// announce actual extruder positions
+			ch = '[';
+			for (uint8_t extruder = 0; extruder < GetExtrudersInUse(); extruder++)
+			{
+				response.catf("%c%.1f", ch, liveCoordinates[AXES + extruder]);
+				ch = ',';
+			}
+			if (ch == '[')
+			{
+				response.cat("[");
+			}
+
+			// XYZ positions
+			response.cat("],\"xyz\":");
+			ch = '[';
+			for (uint8_t axis = 0; axis < AXES; axis++)
+			{
+				response.catf("%c%.2f", ch, liveCoordinates[axis]);
+				ch = ',';
+			}
+			response.cat("]}");
+		}
+		else
+		{
+			response.catf(",\"pos\":");		// announce the XYZ position
+			ch = '[';
+			for (size_t drive = 0; drive < AXES; drive++)
+			{
+				response.catf("%c%.2f", ch, liveCoordinates[drive]);
+				ch = ',';
+			}
+
+			// Send extruder total extrusion since power up, last G92 or last M23
+			response.cat("],\"extr\":");		// announce the extruder positions
+			ch = '[';
+			for (size_t drive = 0; drive < GetExtrudersInUse(); drive++)		// loop through extruders
+			{
+				response.catf("%c%.1f", ch, liveCoordinates[drive + AXES]);
+				ch = ',';
+			}
+			response.cat((ch == '[') ? "[]" : "]");
+		}
+		break;
+
+	case fragmentParams:
+		{
+			// ATX power
+			response.catf(",\"params\":{\"atxPower\":%d", platform->AtxPower() ? 1 : 0);
+
+			// Cooling fan value
+			float fanValue = (gCodes->CoolingInverted() ? 1.0 - platform->GetFanValue() : platform->GetFanValue());
+			response.catf(",\"fanPercent\":%.2f", fanValue * 100.0);
+
+			// Speed and Extrusion factors
+			response.catf(",\"speedFactor\":%.2f,\"extrFactors\":", move->GetSpeedFactor() * 100.0);
+			ch = '[';
+			for (uint8_t extruder = 0; extruder < GetExtrudersInUse(); extruder++)
+			{
+				response.catf("%c%.2f", ch, move->GetExtrusionFactor(extruder) * 100.0);
+				ch = ',';
+			}
+			response.cat((ch == '[') ? "[]}" : "]}");
+		}
+		break;
+
+	case fragmentLegacyParams:
+		response.catf(",\"sfactor\":%.2f,\"efactor\":", move->GetSpeedFactor() * 100.0);
+		ch = '[';
+		for (size_t i = 0; i < GetExtrudersInUse(); ++i)
+		{
+			response.catf("%c%.2f", ch, move->GetExtrusionFactor(i) * 100.0);
+			ch = ',';
+		}
+		response.cat((ch == '[') ? "[]" : "]");
+		break;
+
+	case fragmentTemps:
+		response.cat(",\"temps\":{");
+
+		/* Bed */
+#if HOT_BED != -1
+		{
+			response.catf("\"bed\":{\"current\":%.1f,\"active\":%.1f,\"state\":%d},",
+					heat->GetTemperature(HOT_BED), heat->GetActiveTemperature(HOT_BED),
+					heat->GetStatus(HOT_BED));
+		}
+#endif
+
+		/* Chamber */
+		if (chamberHeater != -1)
+		{
+			response.catf("\"chamber\":{\"current\":%.1f,", heat->GetTemperature(chamberHeater));
+			response.catf("\"active\":%.1f,", heat->GetActiveTemperature(chamberHeater));
+			response.catf("\"state\":%d},", static_cast<int>(heat->GetStatus(chamberHeater)));
+		}
+
+		/* Heads */
+		{
+			response.cat("\"heads\":{\"current\":");
+
+			// Current temperatures
+			ch = '[';
+			for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
+			{
+				response.catf("%c%.1f", ch, heat->GetTemperature(heater));
+				ch = ',';
+			}
+			response.cat((ch == '[') ? "[]" : "]");
+
+			// Active temperatures
+			response.catf(",\"active\":");
+			ch = '[';
+			for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
+			{
+				response.catf("%c%.1f", ch, heat->GetActiveTemperature(heater));
+				ch = ',';
+			}
+			response.cat((ch == '[') ? "[]" : "]");
+
+			// Standby temperatures
+			response.catf(",\"standby\":");
+			ch = '[';
+			for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
+			{
+				response.catf("%c%.1f", ch, heat->GetStandbyTemperature(heater));
+				ch = ',';
+			}
+			response.cat((ch == '[') ? "[]" : "]");
+
+			// Heater statuses (0=off, 1=standby, 2=active, 3=fault)
+			response.cat(",\"state\":");
+			ch = '[';
+			for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
+			{
+				response.catf("%c%d", ch, static_cast<int>(heat->GetStatus(heater)));
+				ch = ',';
+			}
+			response.cat((ch == '[') ? "[]" : "]");
+		}
+		response.cat("}}");
+		break;
+
+	case fragmentLegacyTemps:
+		// Send the heater actual temperatures
+		response.cat(",\"heaters\":");
+#if HOT_BED != -1
+		ch = ',';
+		response.catf("[%.1f", heat->GetTemperature(HOT_BED));
+#else
+		ch = '[';
+#endif
+		for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
+		{
+			response.catf("%c%.1f", ch, heat->GetTemperature(heater));
+			ch = ',';
+		}
+		response.cat((ch == '[') ? "[]" : "]");
+
+		// Send the heater active temperatures
+		response.catf(",\"active\":");
+#if HOT_BED != -1
+		ch = ',';
+		response.catf("[%.1f", heat->GetActiveTemperature(HOT_BED));
+#else
+		ch = '[';
+#endif
+		for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
+		{
+			response.catf("%c%.1f", ch, heat->GetActiveTemperature(heater));
+			ch = ',';
+		}
+		response.cat((ch == '[') ? "[]" : "]");
+
+		// Send the heater standby temperatures
+		response.catf(",\"standby\":");
+#if HOT_BED != -1
+		ch = ',';
+		response.catf("[%.1f", heat->GetStandbyTemperature(HOT_BED));
+#else
+		ch = '[';
+#endif
+		for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
+		{
+			response.catf("%c%.1f", ch, heat->GetStandbyTemperature(heater));
+			ch = ',';
+		}
+		response.cat((ch == '[') ? "[]" : "]");
+
+		// Send the heater statuses (0=off, 1=standby, 2=active)
+		response.cat(",\"hstat\":");
+#if HOT_BED != -1
+		ch = ',';
+		response.catf("[%d", static_cast<int>(heat->GetStatus(HOT_BED)));
+#else
+		ch = '[';
+#endif
+		for (size_t heater = E0_HEATER; heater < GetHeatersInUse(); heater++)
+		{
+			response.catf("%c%d", ch, static_cast<int>(heat->GetStatus(heater)));
+			ch = ',';
+		}
+		response.cat((ch == '[') ? "[]" : "]");
+		break;
+
+	default:
+		break;
+	}
+}
+
 // Copy some parameter text, stopping at the first control character or when the destination buffer is full, and removing trailing spaces
 void RepRap::CopyParameterText(const char* src, char *dst, size_t length)
 {
@@ -1374,6 +1479,73 @@ void RepRap::GetNameResponse(StringRef& response) const
 	response.cat("}");
 }
 
+// Get the compact status datagram sent by UDP telemetry. The fields are selected by the M586 F parameter.
+void RepRap::GetTelemetryResponse(StringRef& response, unsigned int fields, uint32_t seq) const
+{
+	response.copy("{\"name\":");
+	EncodeString(response, myName, 2, false);
+	if (fields & telemetryState)
+	{
+		response.catf(",\"seq\":%u,\"status\":\"%c\",\"uptime\":%.0f", seq, GetStatusCharacter(), platform->Time());
+	}
+
+	if (fields & telemetryTemps)
+	{
+		char ch = '[';
+		response.cat(",\"temps\":");
+		for (size_t heater = 0; heater < GetHeatersInUse(); heater++)
+		{
+			response.catf("%c%.1f", ch, heat->GetTemperature(heater));
+			ch = ',';
+		}
+		response.cat((ch == '[') ? "[]" : "]");
+
+		ch = '[';
+		response.cat(",\"active\":");
+		for (size_t heater = 0; heater < GetHeatersInUse(); heater++)
+		{
+			response.catf("%c%.1f", ch, heat->GetActiveTemperature(heater));
+			ch = ',';
+		}
+		response.cat((ch == '[') ? "[]" : "]");
+	}
+
+	if (fields & telemetryProgress)
+	{
+		response.catf(",\"progress\":%.1f", (gCodes->PrintingAFile()) ? gCodes->FractionOfFilePrinted() * 100.0 : 0.0);
+	}
+
+	if (fields & telemetryPosition)
+	{
+		float liveCoordinates[DRIVES + 1];
+		move->LiveCoordinates(liveCoordinates);
+		if (currentTool != NULL)
+		{
+			const float *offset = currentTool->GetOffset();
+			for (size_t i = 0; i < AXES; ++i)
+			{
+				liveCoordinates[i] += offset[i];
+			}
+		}
+		response.catf(",\"xyz\":[%.2f,%.2f,%.2f]", liveCoordinates[X_AXIS], liveCoordinates[Y_AXIS], liveCoordinates[Z_AXIS]);
+	}
+
+	if (fields & telemetryErrors)
+	{
+		// One bit for each heater that has faulted
+		unsigned int faults = 0;
+		for (size_t heater = 0; heater < GetHeatersInUse(); heater++)
+		{
+			if (heat->GetStatus(heater) == Heat::HS_fault)
+			{
+				faults |= (1u << heater);
+			}
+		}
+		response.catf(",\"heaterFaults\":%u", faults);
+	}
+	response.cat("}");
+}
+
 // Get the list of files in the specified directory in JSON format
 void RepRap::GetFilesResponse(StringRef& response, const char* dir, bool flagsDirs) const
 {
@@ -1526,6 +1698,7 @@ void RepRap::SetName(const char* nm)
 
 	// Set new DHCP hostname
 	network->SetHostname(myName);
+	StatusFieldChanged(statusStatic);
 }
 
 //*************************************************************************************************
@@ -54,6 +54,18 @@ static const char *moduleName[] =
 	"none"
 };
 
+// Sections of the JSON status response whose changes are tracked. The module that owns the data flags a section
+// when its content changes, so that clients can ask only for the sections that changed since their last request.
+enum StatusField
+{
+	statusCoords = 0,		// axes homed, extruder and XYZ positions (Move)
+	statusTool = 1,			// current tool (tool management)
+	statusParams = 2,		// ATX power, fan, speed and extrusion factors (Platform, GCodes)
+	statusTemps = 3,		// heater temperatures and states (Heat)
+	statusStatic = 4,		// type 2 fields: cold extrusion, name, Z probe and tool mapping
+	numStatusFields
+};
+
 // Warn of what's to come, so we can use pointers to classes...
 
 class Network;
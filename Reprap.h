@@ -82,11 +82,15 @@ class RepRap
     uint16_t GetExtrudersInUse() const;
     uint16_t GetHeatersInUse() const;
 
-    void GetStatusResponse(StringRef& response, uint8_t type, bool forWebserver);
+    void GetStatusResponse(StringRef& response, uint8_t type, bool forWebserver, unsigned int changedSince = 0);
     void GetConfigResponse(StringRef& response);
     void GetLegacyStatusResponse(StringRef &response, uint8_t type, int seq);
     void GetNameResponse(StringRef& response) const;
     void GetFilesResponse(StringRef& response, const char* dir, bool flagsDirs) const;
+    void GetTelemetryResponse(StringRef& response, unsigned int fields, uint32_t seq) const;
+
+    void StatusFieldChanged(StatusField field);
+    unsigned int GetStatusSeq() const;
 
     void Beep(int freq, int ms);
     void SetMessage(const char *msg);
@@ -98,12 +102,28 @@ class RepRap
     const StringRef& GetGcodeReply();
 
     static void CopyParameterText(const char* src, char *dst, size_t length);
+    static void EncodeString(StringRef& response, const char* src, size_t spaceToLeave, bool allowControlChars);
 
   private:
 
-    static void EncodeString(StringRef& response, const char* src, size_t spaceToLeave, bool allowControlChars);
+    // Sections of the status responses that are expensive to format and are shared between all clients
+    enum StatusFragment
+    {
+        fragmentCoords = 0,			// "coords" object of the JSON status response
+        fragmentParams = 1,			// "params" object of the JSON status response
+        fragmentTemps = 2,			// "temps" object of the JSON status response
+        fragmentLegacyTemps = 3,	// heater temperatures and states of the legacy status response
+        fragmentLegacyCoords = 4,	// XYZ and extruder positions of the legacy status response
+        fragmentLegacyParams = 5,	// speed and extrusion factors of the legacy status response
+        numStatusFragments
+    };
+
+    void AppendStatusFragment(StringRef& response, StatusFragment fragment);
+    void FormatStatusFragment(StringRef& response, StatusFragment fragment);
   
     char GetStatusCharacter() const;
+    bool StatusFieldChangedSince(StatusField field, unsigned int seq) const;
+    void ToolsChanged();
     unsigned int GetReplySeq() const;
 
     Platform* platform;
@@ -143,6 +163,14 @@ class RepRap
     StringRef gcodeReply;
     unsigned int replySeq;							// The current reply sequence number
     unsigned int webSeq, auxSeq;					// The last-known reply sequence number for web and AUX
+
+    unsigned int statusSeq;							// Incremented whenever a section of the status response changes
+    unsigned int statusFieldSeqs[numStatusFields];	// The value of statusSeq when each section last changed
+
+    char statusFragments[numStatusFragments][STATUS_FRAGMENT_LENGTH];	// Formatted sections, shared by all status requests
+    unsigned int statusFragmentSeqs[numStatusFragments];				// The section sequence number each fragment was formatted at
+    bool statusFragmentValid[numStatusFragments];
+    unsigned int fragmentsFormatted, fragmentsReused;					// Statistics for M122
 };
 
 inline Platform* RepRap::GetPlatform() const { return platform; }
@@ -160,12 +188,12 @@ inline Tool* RepRap::GetCurrentTool() { return currentTool; }
 inline uint16_t RepRap::GetExtrudersInUse() const { return activeExtruders; }
 inline uint16_t RepRap::GetHeatersInUse() const { return activeHeaters; }
 
-inline void RepRap::SetChamberHeater(int8_t heater) { chamberHeater = heater; }
+inline void RepRap::SetChamberHeater(int8_t heater) { chamberHeater = heater; StatusFieldChanged(statusTemps); }
 inline int8_t RepRap::GetChamberHeater() const { return chamberHeater; }
 
 inline bool RepRap::ColdExtrude() { return coldExtrude; }
-inline void RepRap::AllowColdExtrude() { coldExtrude = true; }
-inline void RepRap::DenyColdExtrude() { coldExtrude = false; }
+inline void RepRap::AllowColdExtrude() { coldExtrude = true; StatusFieldChanged(statusStatic); }
+inline void RepRap::DenyColdExtrude() { coldExtrude = false; StatusFieldChanged(statusStatic); }
 
 inline void RepRap::GetExtruderCapabilities(bool canDrive[], const bool directions[]) const
 {
@@ -211,6 +239,19 @@ inline uint16_t RepRap::GetTicksInSpinState() const { return ticksInSpinState; }
 inline const StringRef& RepRap::GetGcodeReply() { webSeq = replySeq; return gcodeReply; }
 inline unsigned int RepRap::GetReplySeq() const { return replySeq; }
 
+inline void RepRap::StatusFieldChanged(StatusField field) { statusFieldSeqs[field] = ++statusSeq; }
+inline unsigned int RepRap::GetStatusSeq() const { return statusSeq; }
+inline bool RepRap::StatusFieldChangedSince(StatusField field, unsigned int seq) const { return seq == 0 || statusFieldSeqs[field] > seq; }
+
+// Adding or deleting a tool changes the number of extruders and heaters in most sections of the status response
+inline void RepRap::ToolsChanged()
+{
+	StatusFieldChanged(statusCoords);
+	StatusFieldChanged(statusParams);
+	StatusFieldChanged(statusTemps);
+	StatusFieldChanged(statusStatic);
+}
+
 #endif
 
 
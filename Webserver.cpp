@@ -45,14 +45,36 @@
  	 	 	 returned as absolute positions instead of relative to the previous gcode. A client
  	 	 	 may also request different status responses by specifying the "type" keyword, followed
  	 	 	 by a custom status response type. Also see "M105 S1".
+ 	 	 	 If this request is sent with the "Upgrade: websocket" header, the connection is turned
+ 	 	 	 into a WebSocket and the requested status response type is pushed to the client as a
+ 	 	 	 text frame at the interval configured by M552 T. Each frame is built only once per
+ 	 	 	 interval and shared by all subscribers of the same type.
+
+ rr_status?type=xxx&since=yyy
+ 	 	 	 Returns only those sections of the status response that have changed since the status
+ 	 	 	 sequence number yyy, which is reported as "statusSeq" in every status response.
+ 	 	 	 Passing 0 returns the full response. Also see "M408 R".
 
  rr_files?dir=xxx
  	 	 	 Returns a listing of the filenames in the /gcode directory of the SD card. 'dir' is a
  	 	 	 directory path relative to the root of the SD card. If the 'dir' variable is not present,
- 	 	 	 it defaults to the /gcode directory.
+ 	 	 	 it defaults to the /gcode directory. The listing is sent using chunked transfer encoding,
+ 	 	 	 so it is not limited in length; the directory is read a chunk at a time on each call to Spin.
 
  rr_reply    Returns the last-known G-code reply as plain text (not encapsulated as JSON).
 
+ rr_network  Returns the network statistics that M122 reports: connections, bytes and TCP windows sent
+ 	 	 	 per protocol, retransmits, shortages of connections, transactions and send buffers, and
+ 	 	 	 the LWIP TCP and pool counters. The counters are never reset.
+
+ rr_gcode?gcode=xxx
+ 	 	 	 Queues the URL-encoded G-code xxx and returns the free space in the G-code buffer as buff.
+ 	 	 	 G-codes may also be sent in the body of a POST request, one per line and as many as
+ 	 	 	 wanted. The body is fed into the G-code buffer as fast as the G-codes are executed; while
+ 	 	 	 the buffer is full the TCP receive window is held closed, so the sender has to wait.
+ 	 	 	 Once the whole body has been queued, a JSON response with err (1 if a line was too long
+ 	 	 	 and has been skipped), lines (number of lines queued) and buff is returned.
+
  rr_upload?name=xxx
  	 	 	 Upload a specified file using a POST request. The payload of this request has to be
  	 	 	 the file content. Only one file may be uploaded at once. When the upload has finished,
@@ -97,6 +119,8 @@ static const char* badEscapeResponse = "bad escape";
 
 const float pasvPortTimeout = 10.0;	 					// seconds to wait for the FTP data port
 
+static const char* webSocketGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";	// see RFC 6455
+
 
 //********************************************************************************************
 //
@@ -108,7 +132,8 @@ const float pasvPortTimeout = 10.0;	 					// seconds to wait for the FTP data po
 
 // Constructor and initialisation
 Webserver::Webserver(Platform* p, Network *n) : platform(p), network(n),
-		webserverActive(false), readingConnection(NULL)
+		webserverActive(false), readingConnection(NULL), numStatusSubscribers(0),
+		statusPushInterval(defaultStatusPushInterval)
 {
 	httpInterpreter = new HttpInterpreter(p, this, n);
 	ftpInterpreter = new FtpInterpreter(p, this, n);
@@ -121,6 +146,8 @@ void Webserver::Init()
 	gcodeReadIndex = gcodeWriteIndex = 0;
 	lastTime = platform->Time();
 	longWait = lastTime;
+	lastStatusPushTime = lastTime;
+	numStatusSubscribers = 0;
 	webserverActive = true;
 
 	// initialise all protocol handlers
@@ -199,6 +226,16 @@ void Webserver::Spin()
 					// CloseRequest() will call the disconnect events and close the connection
 					network->CloseTransaction();
 				}
+				// Connections that have been upgraded to WebSockets don't speak HTTP any more
+				else if (interpreter == httpInterpreter && IsStatusSubscriber(req->GetConnection()))
+				{
+					ProcessWebSocketData(req);
+				}
+				// Bulk G-code submissions are fed into the G-code buffer as space becomes available
+				else if (interpreter == httpInterpreter && httpInterpreter->IsGcodePostConnection(req->GetConnection()))
+				{
+					httpInterpreter->ProcessGcodePostData(req);
+				}
 				// Check for fast uploads
 				else if (interpreter->DoingFastUpload())
 				{
@@ -214,32 +251,35 @@ void Webserver::Spin()
 					network->SendAndClose(NULL, true);
 					telnetInterpreter->RemainingDataSent();
 				}
-				// Process other messages
+				// Process other messages, one packet buffer per call
 				else
 				{
-					char c;
-					for (uint16_t i=0; i<500; i++)
+					char *data;
+					unsigned int length;
+					if (req->ReadBuffer(data, length))
 					{
-						if (req->Read(c))
+						// Each ProtocolInterpreter must take care of the current NetworkTransaction and remove
+						// it from the ready transactions by either calling SendAndClose() or CloseRequest().
+						unsigned int bytesProcessed;
+						if (interpreter->DataFromClient(data, length, bytesProcessed))
 						{
-							// Each ProtocolInterpreter must take care of the current NetworkTransaction and remove
-							// it from the ready transactions by either calling SendAndClose() or CloseRequest().
-							if (interpreter->CharFromClient(c))
-							{
-								readingConnection = NULL;
-								break;
-							}
-						}
-						else
-						{
-							// We ran out of data before finding a complete request.
-							// This happens when the incoming message length exceeds the TCP MSS.
-							// Check if we need to process another packet on the same connection.
-							readingConnection = (interpreter->NeedMoreData()) ? req->GetConnection() : NULL;
-							network->CloseTransaction();
-							break;
+							readingConnection = NULL;
+
+							// The rest of the data must be processed next time, either from this transaction if it is
+							// still ready or from the one the Network class has moved pipelined requests to.
+							// The headers of a POST rr_gcode only start the request, which is counted when its body is done.
+							const bool bodyFollows = (interpreter == httpInterpreter && httpInterpreter->IsGcodePostConnection(req->GetConnection()));
+							network->RequestProcessed(req, length - bytesProcessed, !bodyFollows);
 						}
 					}
+					else
+					{
+						// We ran out of data before finding a complete request.
+						// This happens when the incoming message length exceeds the TCP MSS.
+						// Check if we need to process another packet on the same connection.
+						readingConnection = (interpreter->NeedMoreData()) ? req->GetConnection() : NULL;
+						network->CloseTransaction();
+					}
 				}
 			}
 			else
@@ -249,6 +289,10 @@ void Webserver::Spin()
 			}
 		}
 
+		// Send the next part of a file list and the latest status to our WebSocket clients
+		httpInterpreter->ContinueFilesResponse();
+		PushStatus();
+
 		network->Unlock();
 		platform->ClassReport(longWait);
 	}
@@ -266,6 +310,8 @@ void Webserver::Exit()
 void Webserver::Diagnostics()
 {
 	platform->AppendMessage(BOTH_MESSAGE, "Webserver Diagnostics:\n");
+	platform->AppendMessage(BOTH_MESSAGE, "WebSocket status subscribers: %d of %d, push interval %.2fs\n",
+			numStatusSubscribers, maxStatusSubscribers, statusPushInterval);
 }
 
 // Process a null-terminated gcode
@@ -410,6 +456,11 @@ void Webserver::StoreGcodeData(const char* data, size_t len)
 // Handle immediate disconnects here (cs will be freed after this call)
 void Webserver::ConnectionLost(const ConnectionState *cs)
 {
+	// WebSocket connections and streamed file lists are tracked by their ConnectionState, so forget about it now
+	RemoveStatusSubscriber(cs);
+	httpInterpreter->CancelFilesResponse(cs);
+	httpInterpreter->CancelGcodePost(cs);
+
 	// See which connection caused this event
 	uint32_t remoteIP = cs->GetRemoteIP();
 	uint16_t remotePort = cs->GetRemotePort();
@@ -497,18 +548,425 @@ void Webserver::AppendResponseToWebInterface(const char *s)
 	telnetInterpreter->HandleGcodeReply(s);
 }
 
+// WebSocket status push
+
+static inline uint32_t RotateLeft(uint32_t x, unsigned int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+// Process one 64-byte block of SHA-1 input
+static void Sha1ProcessBlock(uint32_t hash[5], const uint8_t *block)
+{
+	uint32_t w[80];
+	for(size_t i=0; i<16; i++)
+	{
+		w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) | ((uint32_t)block[4 * i + 2] << 8) | block[4 * i + 3];
+	}
+	for(size_t i=16; i<80; i++)
+	{
+		w[i] = RotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+
+	uint32_t a = hash[0], b = hash[1], c = hash[2], d = hash[3], e = hash[4];
+	for(size_t i=0; i<80; i++)
+	{
+		uint32_t f, k;
+		if (i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if (i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if (i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		uint32_t temp = RotateLeft(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = RotateLeft(b, 30);
+		b = a;
+		a = temp;
+	}
+
+	hash[0] += a;
+	hash[1] += b;
+	hash[2] += c;
+	hash[3] += d;
+	hash[4] += e;
+}
+
+// Compute the Sec-WebSocket-Accept value, which is the base64-encoded SHA-1 hash of the client key and the WebSocket GUID.
+// The key must not be longer than 64 characters and 'acceptKey' must be able to hold 29 characters.
+static void GetWebSocketAcceptKey(const char *key, char *acceptKey)
+{
+	// Concatenate the key and the GUID and apply the SHA-1 padding (at most three blocks)
+	uint8_t message[192];
+	size_t keyLength = strlen(key), guidLength = strlen(webSocketGuid);
+	size_t length = keyLength + guidLength;
+	memcpy(message, key, keyLength);
+	memcpy(message + keyLength, webSocketGuid, guidLength);
+
+	size_t paddedLength = ((length + 8) / 64 + 1) * 64;
+	memset(message + length, 0, paddedLength - length);
+	message[length] = 0x80;
+	const uint32_t bitLength = length * 8;
+	message[paddedLength - 4] = bitLength >> 24;
+	message[paddedLength - 3] = bitLength >> 16;
+	message[paddedLength - 2] = bitLength >> 8;
+	message[paddedLength - 1] = bitLength;
+
+	uint32_t hash[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	for(size_t offset=0; offset<paddedLength; offset += 64)
+	{
+		Sha1ProcessBlock(hash, message + offset);
+	}
+
+	uint8_t digest[21];
+	for(size_t i=0; i<20; i++)
+	{
+		digest[i] = hash[i / 4] >> (24 - 8 * (i % 4));
+	}
+	digest[20] = 0;
+
+	// Base64-encode the 20-byte digest, which results in 27 characters plus one padding character
+	static const char* base64Chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t j = 0;
+	for(size_t i=0; i<21; i += 3)
+	{
+		uint32_t triple = ((uint32_t)digest[i] << 16) | ((uint32_t)digest[i + 1] << 8) | digest[i + 2];
+		acceptKey[j++] = base64Chars[(triple >> 18) & 0x3F];
+		acceptKey[j++] = base64Chars[(triple >> 12) & 0x3F];
+		acceptKey[j++] = base64Chars[(triple >> 6) & 0x3F];
+		acceptKey[j++] = base64Chars[triple & 0x3F];
+	}
+	acceptKey[27] = '=';
+	acceptKey[28] = 0;
+}
+
+// Register a connection that has been upgraded to a WebSocket
+bool Webserver::AddStatusSubscriber(ConnectionState *cs, uint8_t type)
+{
+	if (numStatusSubscribers == maxStatusSubscribers)
+	{
+		return false;
+	}
+
+	statusSubscribers[numStatusSubscribers].cs = cs;
+	statusSubscribers[numStatusSubscribers].type = type;
+	statusSubscribers[numStatusSubscribers].frameState = wsHeader;
+	statusSubscribers[numStatusSubscribers].bytesRead = 0;
+	numStatusSubscribers++;
+	return true;
+}
+
+void Webserver::RemoveStatusSubscriber(const ConnectionState *cs)
+{
+	for(size_t i=0; i<numStatusSubscribers; i++)
+	{
+		if (statusSubscribers[i].cs == cs)
+		{
+			numStatusSubscribers--;
+			statusSubscribers[i] = statusSubscribers[numStatusSubscribers];
+			break;
+		}
+	}
+}
+
+bool Webserver::IsStatusSubscriber(const ConnectionState *cs) const
+{
+	for(size_t i=0; i<numStatusSubscribers; i++)
+	{
+		if (statusSubscribers[i].cs == cs)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+Webserver::StatusSubscriber *Webserver::FindStatusSubscriber(const ConnectionState *cs)
+{
+	for(size_t i=0; i<numStatusSubscribers; i++)
+	{
+		if (statusSubscribers[i].cs == cs)
+		{
+			return &statusSubscribers[i];
+		}
+	}
+	return NULL;
+}
+
+bool Webserver::HasStatusSubscriber(uint32_t remoteIP) const
+{
+	for(size_t i=0; i<numStatusSubscribers; i++)
+	{
+		if (statusSubscribers[i].cs->GetRemoteIP() == remoteIP)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Deal with the frames sent by a WebSocket client. We only care about control frames, and skip the payload of any others.
+// A packet may hold several frames, and a frame may be split over several packets, so we read the frames a byte at a time
+// and keep the state of the one being read in the subscriber. Client frames are always masked.
+void Webserver::ProcessWebSocketData(NetworkTransaction *req)
+{
+	StatusSubscriber *sub = FindStatusSubscriber(req->GetConnection());
+	bool replied = false;
+	char c;
+	while (sub != NULL && req->Read(c))
+	{
+		switch (sub->frameState)
+		{
+		case wsHeader:
+			sub->header[sub->bytesRead++] = c;
+			if (sub->bytesRead == 2)
+			{
+				const bool isControlFrame = (sub->header[0] & 0x08) != 0;
+				const uint8_t length = sub->header[1] & 0x7F;
+				if ((sub->header[1] & 0x80) == 0 || (isControlFrame && length > ARRAY_SIZE(sub->pingPayload)))
+				{
+					CloseWebSocket(req, 1002);		// protocol error
+					return;
+				}
+				if (length == 127)
+				{
+					CloseWebSocket(req, 1009);		// we never accept frames this large
+					return;
+				}
+				sub->payloadLength = (length == 126) ? 0 : length;
+				sub->frameState = (length == 126) ? wsExtendedLength : wsMask;
+				sub->bytesRead = 0;
+			}
+			break;
+
+		case wsExtendedLength:
+			sub->payloadLength = (sub->payloadLength << 8) | (uint8_t)c;
+			if (++sub->bytesRead == 2)
+			{
+				sub->frameState = wsMask;
+				sub->bytesRead = 0;
+			}
+			break;
+
+		case wsMask:
+			sub->mask[sub->bytesRead++] = c;
+			if (sub->bytesRead == ARRAY_SIZE(sub->mask))
+			{
+				sub->frameState = wsPayload;
+				sub->bytesRead = 0;
+				if (sub->payloadLength == 0 && !WebSocketFrameComplete(req, sub, replied))
+				{
+					return;
+				}
+			}
+			break;
+
+		case wsPayload:
+			if ((sub->header[0] & 0x0F) == 0x09)
+			{
+				sub->pingPayload[sub->bytesRead] = c ^ sub->mask[sub->bytesRead % ARRAY_SIZE(sub->mask)];
+			}
+			if (++sub->bytesRead == sub->payloadLength && !WebSocketFrameComplete(req, sub, replied))
+			{
+				return;
+			}
+			break;
+		}
+	}
+
+	if (replied)
+	{
+		network->SendAndClose(NULL, true);
+	}
+	else
+	{
+		network->CloseTransaction();
+	}
+}
+
+// Act on a WebSocket frame that has been read completely and get ready for the next one.
+// Return false if the connection is being closed, in which case the transaction has been dealt with.
+bool Webserver::WebSocketFrameComplete(NetworkTransaction *req, StatusSubscriber *sub, bool& replied)
+{
+	sub->frameState = wsHeader;
+	sub->bytesRead = 0;
+	switch (sub->header[0] & 0x0F)
+	{
+	case 0x08:
+		// Close frame - confirm it and close the connection
+		CloseWebSocket(req, 0);
+		return false;
+
+	case 0x09:
+		// Ping frame - reply with a pong frame carrying the same payload
+		req->Write((char)0x8A);
+		req->Write((char)sub->payloadLength);
+		req->Write(sub->pingPayload, sub->payloadLength);
+		replied = true;
+		return true;
+
+	default:
+		// Data frames and pongs are not used, so discard them
+		return true;
+	}
+}
+
+// Send a close frame, with a status code unless it is 0, and close the connection
+void Webserver::CloseWebSocket(NetworkTransaction *req, uint16_t statusCode)
+{
+	RemoveStatusSubscriber(req->GetConnection());
+	req->Write((char)0x88);
+	if (statusCode == 0)
+	{
+		req->Write((char)0x00);
+	}
+	else
+	{
+		req->Write((char)0x02);
+		req->Write((char)(statusCode >> 8));
+		req->Write((char)(statusCode & 0xFF));
+	}
+	network->SendAndClose(NULL);
+}
+
+// Build a WebSocket text frame containing the status response of the given type.
+// The JSON response is written behind the space reserved for the frame header, and we return a pointer to the start of the frame.
+const char* Webserver::BuildStatusFrame(char *buffer, uint8_t type, size_t& length) const
+{
+	StringRef response(buffer + 4, jsonReplyLength);
+	reprap.GetStatusResponse(response, type, true);
+
+	const size_t payloadLength = response.strlen();
+	if (payloadLength < 126)
+	{
+		buffer[2] = 0x81;
+		buffer[3] = payloadLength;
+		length = payloadLength + 2;
+		return buffer + 2;
+	}
+
+	buffer[0] = 0x81;
+	buffer[1] = 126;
+	buffer[2] = payloadLength >> 8;
+	buffer[3] = payloadLength & 0xFF;
+	length = payloadLength + 4;
+	return buffer;
+}
+
+// Send a status frame to each WebSocket client if the push interval has elapsed.
+// The frame for each status type is built only once and shared by all clients that asked for it.
+void Webserver::PushStatus()
+{
+	if (numStatusSubscribers == 0 || statusPushInterval <= 0.0)
+	{
+		return;
+	}
+
+	const float now = platform->Time();
+	if (now - lastStatusPushTime < statusPushInterval)
+	{
+		return;
+	}
+	lastStatusPushTime = now;
+
+	char frameBuffer[jsonReplyLength + 4];
+	for(uint8_t type=1; type<=3; type++)
+	{
+		const char *frame = NULL;
+		size_t frameLength = 0;
+		for(size_t i=0; i<numStatusSubscribers; i++)
+		{
+			ConnectionState *cs = statusSubscribers[i].cs;
+			if (statusSubscribers[i].type != type || cs->sendingTransaction != NULL)
+			{
+				// Either this client wants another response type or it hasn't received the last frame yet
+				continue;
+			}
+
+			NetworkTransaction *pending = network->GetTransaction();
+			if (pending != NULL && pending->GetConnection() == cs)
+			{
+				// Process the incoming data of this client first
+				continue;
+			}
+
+			if (!network->CanAcquireTransaction())
+			{
+				return;
+			}
+
+			if (frame == NULL)
+			{
+				frame = BuildStatusFrame(frameBuffer, type, frameLength);
+			}
+
+			if (network->AcquireHttpTransaction(cs))
+			{
+				network->GetTransaction()->Write(frame, frameLength);
+				network->SendAndClose(NULL, true);
+			}
+		}
+	}
+}
+
 //********************************************************************************************
 //
 //********************** Generic Procotol Interpreter implementation *************************
 //
 //********************************************************************************************
 
+// Process a block of data from the client. Returns true as soon as CharFromClient does, in which case bytesProcessed
+// tells the caller how much of the data has been used. Interpreters may override this to deal with runs of ordinary
+// characters in one go instead of passing every single character through their state machine.
+bool ProtocolInterpreter::DataFromClient(const char *data, unsigned int length, unsigned int& bytesProcessed)
+{
+	bytesProcessed = 0;
+	while (bytesProcessed < length)
+	{
+		if (CharFromClient(data[bytesProcessed++]))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Return the number of characters at the start of data before the first null or delimiter character
+unsigned int ProtocolInterpreter::ScanPlainText(const char *data, unsigned int length, const char *delimiters)
+{
+	unsigned int i = 0;
+	while (i < length && data[i] != 0 && strchr(delimiters, data[i]) == NULL)
+	{
+		++i;
+	}
+	return i;
+}
+
 ProtocolInterpreter::ProtocolInterpreter(Platform *p, Webserver *ws, Network *n)
 	: platform(p), webserver(ws), network(n)
 {
 	uploadState = notUploading;
 	uploadPointer = NULL;
 	uploadLength = 0;
+	uploadBuffer = NULL;
+	uploadBufferLength = 0;
+	uploadBufferedBytes = 0;
 	filenameBeingUploaded[0] = 0;
 }
 
@@ -519,6 +977,7 @@ bool ProtocolInterpreter::StartUpload(FileStore *file)
 
 	if (file != NULL)
 	{
+		file->SetAccessClass(sdAccessUpload);
 		fileBeingUploaded.Set(file);
 		uploadState = uploadOK;
 		return true;
@@ -541,19 +1000,32 @@ bool ProtocolInterpreter::StoreUploadData(const char* data, unsigned int len)
 	return false;
 }
 
-// Try to flush upload buffer and return true if all data has been flushed
+// Try to flush upload buffer and return true if all data has been flushed.
+// The received data is gathered in the staging buffer, which is written to the file only when it is full. Because uploads
+// start at the beginning of the file, every write then covers whole sectors at a sector boundary, so FatFs can write them
+// straight to the card without reading them first. We write at most once per call, and the network transaction holding
+// the remaining data is not released before it has been copied, so the TCP window stays closed until we can accept more.
 bool ProtocolInterpreter::FlushUploadData()
 {
 	if (uploadState == uploadOK && uploadLength != 0)
 	{
-		// Write some uploaded data to file (never write more than 256 bytes at once)
-		unsigned int len = min<unsigned int>(uploadLength, 256);
-		if (!fileBeingUploaded.Write(uploadPointer, len))
+		if (uploadBufferedBytes == uploadBufferLength)
 		{
-			platform->Message(HOST_MESSAGE, "Could not flush upload data!\n");
-			uploadState = uploadError;
+			if (!platform->GetMassStorage()->CanAccess(sdAccessUpload, uploadBufferedBytes))
+			{
+				return false;		// let the print file have the SD card first, we will be called again
+			}
+			if (!WriteUploadBuffer())
+			{
+				uploadPointer = NULL;
+				uploadLength = 0;
+				return true;
+			}
 		}
 
+		const unsigned int len = min<unsigned int>(uploadLength, uploadBufferLength - uploadBufferedBytes);
+		memcpy(uploadBuffer + uploadBufferedBytes, uploadPointer, len);
+		uploadBufferedBytes += len;
 		uploadPointer += len;
 		uploadLength -= len;
 
@@ -563,10 +1035,27 @@ bool ProtocolInterpreter::FlushUploadData()
 	return true;
 }
 
+// Write the content of the staging buffer to the upload file
+bool ProtocolInterpreter::WriteUploadBuffer()
+{
+	if (uploadBufferedBytes != 0)
+	{
+		if (!fileBeingUploaded.Write(uploadBuffer, uploadBufferedBytes))
+		{
+			platform->Message(HOST_MESSAGE, "Could not flush upload data!\n");
+			uploadState = uploadError;
+			return false;
+		}
+		uploadBufferedBytes = 0;
+	}
+	return true;
+}
+
 void ProtocolInterpreter::CancelUpload()
 {
 	if (fileBeingUploaded.IsLive())
 	{
+		fileBeingUploaded.Abandon();	// stop anyone printing this file from reading past what we have written
 		fileBeingUploaded.Close();		// cancel any pending file upload
 		if (strlen(filenameBeingUploaded) != 0)
 		{
@@ -576,6 +1065,7 @@ void ProtocolInterpreter::CancelUpload()
 	filenameBeingUploaded[0] = 0;
 	uploadPointer = NULL;
 	uploadLength = 0;
+	uploadBufferedBytes = 0;
 	uploadState = notUploading;
 }
 
@@ -610,23 +1100,24 @@ void ProtocolInterpreter::FinishUpload(uint32_t fileLength)
 	// Write the remaining data
 	if (uploadState == uploadOK)
 	{
-		while (uploadLength > 0)
+		while (uploadLength > 0 && uploadState == uploadOK)
 		{
-			unsigned int len = min<unsigned int>(uploadLength, 256);
-			if (!fileBeingUploaded.Write(uploadPointer, len))
+			if (uploadBufferedBytes == uploadBufferLength)
 			{
-				uploadState = uploadError;
-				platform->Message(HOST_MESSAGE, "Could not write remaining data while finishing upload!\n");
-				break;
+				WriteUploadBuffer();	// finishing an upload cannot be postponed
 			}
+			FlushUploadData();
+		}
 
-			uploadLength -= len;
-			uploadPointer += len;
+		if (uploadState == uploadOK && !WriteUploadBuffer())
+		{
+			platform->Message(HOST_MESSAGE, "Could not write remaining data while finishing upload!\n");
 		}
 	}
 
 	uploadPointer = NULL;
 	uploadLength = 0;
+	uploadBufferedBytes = 0;
 
 	if (uploadState == uploadOK && !fileBeingUploaded.Flush())
 	{
@@ -642,6 +1133,10 @@ void ProtocolInterpreter::FinishUpload(uint32_t fileLength)
 	}
 
 	// Close the file
+	if (uploadState == uploadError)
+	{
+		fileBeingUploaded.Abandon();
+	}
 	if (!fileBeingUploaded.Close())
 	{
 		uploadState = uploadError;
@@ -671,6 +1166,10 @@ Webserver::HttpInterpreter::HttpInterpreter(Platform *p, Webserver *ws, Network
 {
 	uploadingTextData = false;
 	numContinuationBytes = 0;
+	filesResponseCs = NULL;
+	gcodePostCs = NULL;
+	uploadBuffer = reinterpret_cast<char *>(new uint32_t[uploadBufferSize / sizeof(uint32_t)]);	// word-aligned for the HSMCI DMA
+	uploadBufferLength = uploadBufferSize;
 }
 
 // File Uploads
@@ -796,8 +1295,45 @@ void Webserver::HttpInterpreter::SendFile(const char* nameOfFileToSend)
 		}
 	}
 
+	// See if the client asked for only a part of the file, e.g. to resume an interrupted download.
+	// We support a single byte range only, so requests for multiple ranges get the whole file.
+	const uint32_t fileLength = fileToSend->Length();
+	uint32_t firstByte = 0, lastByte = (fileLength == 0) ? 0 : fileLength - 1;
+	bool partial = false;
+	const char *range = GetHeaderValue("Range");
+	if (range != NULL && !StringEquals(nameOfFileToSend, FOUR04_FILE))
+	{
+		switch (ParseRange(range, fileLength, firstByte, lastByte))
+		{
+			case rangeValid:
+				partial = true;
+				break;
+
+			case rangeUnsatisfiable:
+			{
+				fileToSend->Close();
+				NetworkTransaction *req = network->GetTransaction();
+				req->Write("HTTP/1.1 416 Requested Range Not Satisfiable\n");
+				req->Printf("Content-Range: bytes */%lu\n", fileLength);
+				req->Write("Content-Length: 0\nConnection: close\n\n");
+				network->SendAndClose(NULL);
+				return;
+			}
+
+			default:
+				break;
+		}
+	}
+
+	if (partial && !fileToSend->Seek(firstByte))
+	{
+		fileToSend->Close();
+		RejectMessage("seek failed", 500);
+		return;
+	}
+
 	NetworkTransaction *req = network->GetTransaction();
-	req->Write("HTTP/1.1 200 OK\n");
+	req->Write((partial) ? "HTTP/1.1 206 Partial Content\n" : "HTTP/1.1 200 OK\n");
 
 	const char* contentType;
 	bool zip = false;
@@ -832,15 +1368,90 @@ void Webserver::HttpInterpreter::SendFile(const char* nameOfFileToSend)
 	}
 	req->Printf("Content-Type: %s\n", contentType);
 
-	if (zip && fileToSend != NULL)
+	if (zip)
 	{
 		req->Write("Content-Encoding: gzip\n");
-		req->Printf("Content-Length: %lu", fileToSend->Length());
 	}
 
-	req->Write("Connection: close\n\n");
-	network->SendAndClose(fileToSend);
-}
+	const uint32_t bytesToSend = (fileLength == 0) ? 0 : lastByte - firstByte + 1;
+	req->Write("Accept-Ranges: bytes\n");
+	if (partial)
+	{
+		req->Printf("Content-Range: bytes %lu-%lu/%lu\n", firstByte, lastByte, fileLength);
+	}
+	// Static files always have an accurate Content-Length, so the client may send its next request on this connection
+	const bool keepOpen = ClientWantsKeepAlive();
+	req->Printf("Content-Length: %lu\n", bytesToSend);
+	req->Printf("Connection: %s\n\n", keepOpen ? "keep-alive" : "close");
+	network->SendAndClose(fileToSend, keepOpen, bytesToSend);
+}
+
+// Parse the value of a Range header, which may look like "bytes=100-199", "bytes=100-" or "bytes=-100".
+// On success firstByte and lastByte hold the inclusive range clipped to the length of the file.
+Webserver::HttpInterpreter::RangeResult Webserver::HttpInterpreter::ParseRange(const char* range, uint32_t fileLength,
+		uint32_t& firstByte, uint32_t& lastByte) const
+{
+	if (!StringStartsWith(range, "bytes="))
+	{
+		return rangeIgnored;
+	}
+	range += 6;
+	while (*range == ' ')
+	{
+		range++;
+	}
+	if (strchr(range, ',') != NULL)
+	{
+		return rangeIgnored;		// multiple ranges are not supported
+	}
+
+	char *endPtr;
+	if (*range == '-')
+	{
+		// Suffix range, i.e. the last N bytes of the file
+		const unsigned long suffixLength = strtoul(range + 1, &endPtr, 10);
+		if (endPtr == range + 1)
+		{
+			return rangeIgnored;
+		}
+		if (suffixLength == 0 || fileLength == 0)
+		{
+			return rangeUnsatisfiable;
+		}
+		firstByte = (suffixLength >= fileLength) ? 0 : fileLength - suffixLength;
+		lastByte = fileLength - 1;
+		return rangeValid;
+	}
+
+	const unsigned long first = strtoul(range, &endPtr, 10);
+	if (endPtr == range || *endPtr != '-')
+	{
+		return rangeIgnored;
+	}
+	if (first >= fileLength)
+	{
+		return rangeUnsatisfiable;
+	}
+
+	const char *lastPtr = endPtr + 1;
+	unsigned long last = strtoul(lastPtr, &endPtr, 10);
+	if (endPtr == lastPtr)
+	{
+		last = fileLength - 1;		// open-ended range
+	}
+	else if (last < first)
+	{
+		return rangeIgnored;
+	}
+	else if (last >= fileLength)
+	{
+		last = fileLength - 1;
+	}
+
+	firstByte = first;
+	lastByte = last;
+	return rangeValid;
+}
 
 void Webserver::HttpInterpreter::SendGCodeReply()
 {
@@ -862,6 +1473,15 @@ void Webserver::HttpInterpreter::SendJsonResponse(const char* command)
 		return;
 	}
 
+	// File lists may be much longer than our JSON buffer, so they are streamed to the client in chunks.
+	// Only one list can be streamed at a time, so any other client gets as much as fits into the buffer.
+	if (StringEquals(command, "files") && IsAuthenticated() && filesResponseCs == NULL)
+	{
+		UpdateAuthentication();
+		StartFilesResponse((numQualKeys != 0 && StringEquals(qualifiers[0].key, "dir")) ? qualifiers[0].value : platform->GetGCodeDir());
+		return;
+	}
+
 	// See if we can find a suitable JSON response
 	NetworkTransaction *req = network->GetTransaction();
 	bool keepOpen = false;
@@ -895,15 +1515,7 @@ void Webserver::HttpInterpreter::SendJsonResponse(const char* command)
 	if (mayKeepOpen)
 	{
 		// Check that the browser wants to persist the connection too
-		for (size_t i = 0; i < numHeaderKeys; ++i)
-		{
-			if (StringEquals(headers[i].key, "Connection"))
-			{
-// Comment out the following line to disable persistent connections
-				keepOpen = StringEquals(headers[i].value, "keep-alive");
-				break;
-			}
-		}
+		keepOpen = ClientWantsKeepAlive();
 	}
 	req->Write("HTTP/1.1 200 OK\n");
 	req->Write("Content-Type: application/json\n");
@@ -914,6 +1526,97 @@ void Webserver::HttpInterpreter::SendJsonResponse(const char* command)
 	network->SendAndClose(NULL, keepOpen);
 }
 
+// Send the HTTP header and the first chunk of a file list. The remaining chunks are sent by ContinueFilesResponse.
+void Webserver::HttpInterpreter::StartFilesResponse(const char* dir)
+{
+	NetworkTransaction *req = network->GetTransaction();
+	filesResponseCs = req->GetConnection();
+	filesResponseFirst = true;
+	filesResponseHaveEntry = platform->GetMassStorage()->FindFirst(dir, filesResponseEntry, &filesResponseDir);
+
+	req->Write("HTTP/1.1 200 OK\n");
+	req->Write("Content-Type: application/json\n");
+	req->Write("Transfer-Encoding: chunked\n");
+	req->Write("Connection: close\n\n");
+	SendFilesChunk(dir);
+}
+
+// Send the next chunk of a file list once the previous one has gone out
+void Webserver::HttpInterpreter::ContinueFilesResponse()
+{
+	if (filesResponseCs == NULL || filesResponseCs->sendingTransaction != NULL)
+	{
+		return;
+	}
+
+	NetworkTransaction *pending = network->GetTransaction();
+	if (pending != NULL && pending->GetConnection() == filesResponseCs)
+	{
+		// Process the incoming data of this client first
+		return;
+	}
+
+	if (network->CanAcquireTransaction() && network->AcquireHttpTransaction(filesResponseCs))
+	{
+		SendFilesChunk(NULL);
+	}
+}
+
+void Webserver::HttpInterpreter::CancelFilesResponse(const ConnectionState *cs)
+{
+	if (cs == filesResponseCs)
+	{
+		filesResponseCs = NULL;
+	}
+}
+
+// Read as many directory entries as fit into one chunk and send them. If 'dir' is not NULL, this is the first chunk.
+// The connection is closed after the last chunk has been sent.
+void Webserver::HttpInterpreter::SendFilesChunk(const char* dir)
+{
+	char chunkBuffer[filesChunkLength];
+	StringRef chunk(chunkBuffer, ARRAY_SIZE(chunkBuffer));
+	chunk.Clear();
+	if (dir != NULL)
+	{
+		chunk.copy("{\"dir\":");
+		RepRap::EncodeString(chunk, dir, 3, false);
+		chunk.cat(",\"files\":[");
+	}
+
+	// Leave enough space for every character to be escaped, plus the separator, the quotes and the closing brackets
+	while (filesResponseHaveEntry && chunk.strlen() + 2 * strlen(filesResponseEntry.fileName) + 6 < chunk.Length())
+	{
+		if (!filesResponseFirst)
+		{
+			chunk.cat(",");
+		}
+		RepRap::EncodeString(chunk, filesResponseEntry.fileName, 3, false);
+		filesResponseFirst = false;
+		filesResponseHaveEntry = platform->GetMassStorage()->FindNext(filesResponseEntry, &filesResponseDir);
+	}
+
+	if (!filesResponseHaveEntry)
+	{
+		chunk.cat("]}");
+	}
+
+	NetworkTransaction *req = network->GetTransaction();
+	req->Printf("%x\r\n", chunk.strlen());
+	req->Write(chunk);
+	req->Write("\r\n");
+	if (filesResponseHaveEntry)
+	{
+		network->SendAndClose(NULL, true);
+	}
+	else
+	{
+		req->Write("0\r\n\r\n");
+		filesResponseCs = NULL;
+		network->SendAndClose(NULL);
+	}
+}
+
 //----------------------------------------------------------------------------------------------------
 
 // Input from the client
@@ -984,7 +1687,14 @@ bool Webserver::HttpInterpreter::GetJsonResponse(const char* request, StringRef&
 					type = 1;
 				}
 
-				reprap.GetStatusResponse(response, type, true);
+				// If the client tells us the last status sequence number it has seen, send only what has changed since then
+				unsigned int changedSince = 0;
+				if (numQualKeys >= 2 && StringEquals(qualifiers[1].key, "since"))
+				{
+					changedSince = strtoul(qualifiers[1].value, NULL, 10);
+				}
+
+				reprap.GetStatusResponse(response, type, true, changedSince);
 			}
 			else
 			{
@@ -1041,7 +1751,7 @@ bool Webserver::HttpInterpreter::GetJsonResponse(const char* request, StringRef&
 		}
 		else if (StringEquals(request, "files"))
 		{
-			// TODO: get rid of GetFilesResponse and write directly to NetworkTransaction!
+			// Only used while another file list is being streamed, see SendJsonResponse
 			const char* dir = (StringEquals(key, "dir")) ? value : platform->GetGCodeDir();
 			reprap.GetFilesResponse(response, dir, false);
 		}
@@ -1076,6 +1786,10 @@ bool Webserver::HttpInterpreter::GetJsonResponse(const char* request, StringRef&
 		{
 			reprap.GetConfigResponse(response);
 		}
+		else if (StringEquals(request, "network"))
+		{
+			network->GetStatisticsResponse(response);
+		}
 		else
 		{
 			found = false;
@@ -1445,25 +2159,7 @@ bool Webserver::HttpInterpreter::CharFromClient(char c)
 
 		if (uploadedBytes == postFileLength)
 		{
-			StoreUploadData(clientMessage + (clientPointer - uploadedBytes), uploadedBytes);
-			FinishUpload(postFileLength);
-
-			SendJsonResponse("upload");
-
-			// Reset state
-			uint32_t remoteIP = network->GetTransaction()->GetRemoteIP();
-			for(unsigned int i=0; i<numActiveSessions; i++)
-			{
-				if (sessions[i].ip == remoteIP && sessions[i].isPostUploading)
-				{
-					sessions[i].isPostUploading = false;
-					sessions[i].lastQueryTime = platform->Time();
-					break;
-				}
-			}
-			uploadState = notUploading;
-			ResetState();
-
+			FinishPostUpload();
 			return true;
 		}
 
@@ -1480,6 +2176,84 @@ bool Webserver::HttpInterpreter::CharFromClient(char c)
 	return false;
 }
 
+// Process a block of data from the client. Runs of characters that cannot change the state of the parser are copied
+// to clientMessage in one go, and only the characters in between are passed to CharFromClient.
+bool Webserver::HttpInterpreter::DataFromClient(const char *data, unsigned int length, unsigned int& bytesProcessed)
+{
+	bytesProcessed = 0;
+	while (bytesProcessed < length)
+	{
+		if (state == doingPost)
+		{
+			unsigned int runLength = min<unsigned int>(length - bytesProcessed, postFileLength - uploadedBytes);
+			runLength = min<unsigned int>(runLength, ARRAY_UPB(clientMessage) - clientPointer);
+			memcpy(clientMessage + clientPointer, data + bytesProcessed, runLength);
+			clientPointer += runLength;
+			uploadedBytes += runLength;
+			bytesProcessed += runLength;
+
+			if (uploadedBytes == postFileLength)
+			{
+				FinishPostUpload();
+				return true;
+			}
+		}
+		else
+		{
+			const char *delimiters;
+			switch (state)
+			{
+				case doingCommandWord:		delimiters = "\n\r \t"; break;
+				case doingFilename:			delimiters = "\n\r \t?%"; break;
+				case doingQualifierKey:		delimiters = "\n\r \t=%&"; break;
+				case doingQualifierValue:	delimiters = "\n\r \t%&+"; break;
+				case doingHeaderKey:		delimiters = "\n\r:"; break;
+				case doingHeaderValue:		delimiters = "\n\r"; break;
+				default:					delimiters = NULL; break;
+			}
+
+			if (delimiters != NULL)
+			{
+				// Leave at least one byte of space, so that CharFromClient can report an overflow
+				unsigned int runLength = ScanPlainText(data + bytesProcessed, length - bytesProcessed, delimiters);
+				runLength = min<unsigned int>(runLength, ARRAY_UPB(clientMessage) - clientPointer);
+				memcpy(clientMessage + clientPointer, data + bytesProcessed, runLength);
+				clientPointer += runLength;
+				bytesProcessed += runLength;
+			}
+		}
+
+		if (bytesProcessed < length && CharFromClient(data[bytesProcessed++]))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// All the data of a POST upload has been received, so store it and send the response
+void Webserver::HttpInterpreter::FinishPostUpload()
+{
+	StoreUploadData(clientMessage + (clientPointer - uploadedBytes), uploadedBytes);
+	FinishUpload(postFileLength);
+
+	SendJsonResponse("upload");
+
+	// Reset state
+	uint32_t remoteIP = network->GetTransaction()->GetRemoteIP();
+	for(unsigned int i=0; i<numActiveSessions; i++)
+	{
+		if (sessions[i].ip == remoteIP && sessions[i].isPostUploading)
+		{
+			sessions[i].isPostUploading = false;
+			sessions[i].lastQueryTime = platform->Time();
+			break;
+		}
+	}
+	uploadState = notUploading;
+	ResetState();
+}
+
 // Process the message received so far. We have reached the end of the headers.
 // Return true if the message is complete, false if we want to continue receiving data (i.e. postdata)
 bool Webserver::HttpInterpreter::ProcessMessage()
@@ -1501,6 +2275,12 @@ bool Webserver::HttpInterpreter::ProcessMessage()
 
 	if (StringEquals(commandWords[0], "GET"))
 	{
+		const char *upgrade = GetHeaderValue("Upgrade");
+		if (upgrade != NULL && StringEquals(upgrade, "websocket"))
+		{
+			return UpgradeToWebSocket(commandWords[1]);
+		}
+
 		if (StringStartsWith(commandWords[1], KO_START))
 		{
 			SendJsonResponse(commandWords[1] + KO_FIRST);
@@ -1513,81 +2293,251 @@ bool Webserver::HttpInterpreter::ProcessMessage()
 		{
 			SendFile(commandWords[1]);
 		}
-		return true;
+		return true;
+	}
+	else if (StringEquals(commandWords[0], "POST"))
+	{
+		bool isUploadRequest = (StringEquals(commandWords[1], KO_START "upload"));
+		isUploadRequest |= (commandWords[1][0] == '/' && StringEquals(commandWords[1] + 1, KO_START "upload"));
+		if (isUploadRequest)
+		{
+			if (numQualKeys > 0 && StringEquals(qualifiers[0].key, "name"))
+			{
+				// We cannot upload more than one file at once
+				if (uploadState == uploadOK)
+				{
+					return RejectMessage("cannot upload more than one file at once");
+				}
+
+				// See how many bytes we expect to read
+				bool contentLengthFound = false;
+				for(size_t i=0; i<numHeaderKeys; i++)
+				{
+					if (StringEquals(headers[i].key, "Content-Length"))
+					{
+						postFileLength = atoi(headers[i].value);
+						contentLengthFound = true;
+						break;
+					}
+				}
+
+				// Start POST file upload
+				if (contentLengthFound)
+				{
+					FileStore *file = platform->GetFileStore("0:/", qualifiers[0].value, true);
+					if (StartUpload(file))
+					{
+						// Start new file upload
+						uploadingTextData = false;
+						uploadedBytes = numContinuationBytes = 0;
+
+						strncpy(filenameBeingUploaded, qualifiers[0].value, ARRAY_SIZE(filenameBeingUploaded));
+						filenameBeingUploaded[ARRAY_UPB(filenameBeingUploaded)] = 0;
+
+						// Set POST variables only if we actually need to store data
+						if (postFileLength > 0)
+						{
+							uint32_t remoteIP = network->GetTransaction()->GetRemoteIP();
+							uint16_t remotePort = network->GetTransaction()->GetRemotePort();
+							for(size_t i=0; i<numActiveSessions; i++)
+							{
+								if (sessions[i].ip == remoteIP)
+								{
+									sessions[i].postPort = remotePort;
+									sessions[i].isPostUploading = true;
+									break;
+								}
+							}
+							state = doingPost;
+
+							return false;
+						}
+
+						// User has uploaded an empty file - we should have finished here already
+						FinishUpload(0);
+						SendJsonResponse("upload");
+						return true;
+					}
+					return RejectMessage("could not start file upload");
+				}
+			}
+			return RejectMessage("invalid POST upload request");
+		}
+
+		bool isGcodeRequest = (StringEquals(commandWords[1], KO_START "gcode"));
+		isGcodeRequest |= (commandWords[1][0] == '/' && StringEquals(commandWords[1] + 1, KO_START "gcode"));
+		if (isGcodeRequest)
+		{
+			return StartGcodePost();
+		}
+		return RejectMessage("only rr_upload and rr_gcode are supported for POST requests");
+	}
+	else
+	{
+		return RejectMessage("Unknown message type");
+	}
+}
+
+// Start receiving the body of a POST rr_gcode request, which holds newline-separated G-codes.
+// The body is processed by ProcessGcodePostData as space in the G-code buffer becomes available.
+bool Webserver::HttpInterpreter::StartGcodePost()
+{
+	if (!IsAuthenticated())
+	{
+		return RejectMessage("not authorized", 403);
+	}
+
+	if (gcodePostCs != NULL)
+	{
+		return RejectMessage("G-code submission already in progress", 503);
+	}
+
+	const char *contentLength = GetHeaderValue("Content-Length");
+	if (contentLength == NULL)
+	{
+		return RejectMessage("Content-Length required", 411);
+	}
+
+	UpdateAuthentication();
+	gcodePostCs = network->GetTransaction()->GetConnection();
+	gcodePostBytesLeft = strtoul(contentLength, NULL, 10);
+	gcodePostLineLength = gcodePostLines = 0;
+	gcodePostLineComplete = gcodePostInComment = gcodePostOverflow = false;
+	gcodePostKeepAlive = ClientWantsKeepAlive();
+
+	if (gcodePostBytesLeft == 0)
+	{
+		SendGcodePostResponse();
+	}
+	return true;
+}
+
+// Feed the body of a POST rr_gcode request into the G-code buffer. When the buffer is full, the rest of the data is left
+// in the transaction, which is deferred so that other connections are served meanwhile. Because LWIP isn't told that
+// we have processed the data, the TCP receive window closes and the client has to wait until we catch up.
+void Webserver::HttpInterpreter::ProcessGcodePostData(NetworkTransaction *req)
+{
+	// Store the line we had no room for last time first
+	if (gcodePostLineComplete && !FlushGcodePostLine())
+	{
+		network->DeferTransaction();
+		return;
+	}
+
+	char *data;
+	unsigned int length;
+	while (gcodePostBytesLeft != 0)
+	{
+		if (!req->ReadBuffer(data, length))
+		{
+			// We have processed all the data of this transaction, so wait for the next packet
+			network->CloseTransaction();
+			return;
+		}
+
+		const unsigned int bodyLength = min<unsigned int>(length, gcodePostBytesLeft);
+		unsigned int bytesProcessed = 0;
+		while (bytesProcessed < bodyLength)
+		{
+			const char c = data[bytesProcessed++];
+			if (c == '\n')
+			{
+				gcodePostLineComplete = true;
+				if (!FlushGcodePostLine())
+				{
+					break;
+				}
+			}
+			else if (c == ';')
+			{
+				gcodePostInComment = true;
+			}
+			else if (!gcodePostInComment && c != '\r')
+			{
+				if (gcodePostLineLength < ARRAY_UPB(gcodePostLine))
+				{
+					gcodePostLine[gcodePostLineLength++] = c;
+				}
+				else
+				{
+					// Don't store a truncated G-code, skip the whole line instead
+					platform->Message(BOTH_ERROR_MESSAGE, "Webserver: GCode local buffer overflow.\n");
+					gcodePostLineLength = 0;
+					gcodePostInComment = true;
+					gcodePostOverflow = true;
+				}
+			}
+		}
+
+		gcodePostBytesLeft -= bytesProcessed;
+		req->UnreadBuffer(length - bytesProcessed);
+		if (gcodePostLineComplete)
+		{
+			// The G-code buffer is full, so try again later
+			network->DeferTransaction();
+			return;
+		}
+	}
+
+	// We have the whole body, so store the last line in case it was not terminated
+	if (gcodePostLineLength != 0)
+	{
+		gcodePostLineComplete = true;
+		if (!FlushGcodePostLine())
+		{
+			network->DeferTransaction();
+			return;
+		}
 	}
-	else if (StringEquals(commandWords[0], "POST"))
+
+	SendGcodePostResponse();
+	network->RequestProcessed(req, 0);
+}
+
+// Store the line assembled from a POST rr_gcode body. Returns false if there is no room for it in the G-code buffer yet.
+bool Webserver::HttpInterpreter::FlushGcodePostLine()
+{
+	if (gcodePostLineLength != 0)
 	{
-		bool isUploadRequest = (StringEquals(commandWords[1], KO_START "upload"));
-		isUploadRequest |= (commandWords[1][0] == '/' && StringEquals(commandWords[1] + 1, KO_START "upload"));
-		if (isUploadRequest)
+		if (webserver->GetGcodeBufferSpace() <= gcodePostLineLength)
 		{
-			if (numQualKeys > 0 && StringEquals(qualifiers[0].key, "name"))
-			{
-				// We cannot upload more than one file at once
-				if (uploadState == uploadOK)
-				{
-					return RejectMessage("cannot upload more than one file at once");
-				}
+			return false;
+		}
 
-				// See how many bytes we expect to read
-				bool contentLengthFound = false;
-				for(size_t i=0; i<numHeaderKeys; i++)
-				{
-					if (StringEquals(headers[i].key, "Content-Length"))
-					{
-						postFileLength = atoi(headers[i].value);
-						contentLengthFound = true;
-						break;
-					}
-				}
+		gcodePostLine[gcodePostLineLength] = 0;
+		webserver->ProcessGcode(gcodePostLine);
+		gcodePostLineLength = 0;
+		++gcodePostLines;
+	}
 
-				// Start POST file upload
-				if (contentLengthFound)
-				{
-					FileStore *file = platform->GetFileStore("0:/", qualifiers[0].value, true);
-					if (StartUpload(file))
-					{
-						// Start new file upload
-						uploadingTextData = false;
-						uploadedBytes = numContinuationBytes = 0;
+	gcodePostLineComplete = false;
+	gcodePostInComment = false;
+	return true;
+}
 
-						strncpy(filenameBeingUploaded, qualifiers[0].value, ARRAY_SIZE(filenameBeingUploaded));
-						filenameBeingUploaded[ARRAY_UPB(filenameBeingUploaded)] = 0;
+// Send the response to a POST rr_gcode request once its whole body has been queued
+void Webserver::HttpInterpreter::SendGcodePostResponse()
+{
+	char jsonResponseBuffer[64];
+	StringRef jsonResponse(jsonResponseBuffer, ARRAY_SIZE(jsonResponseBuffer));
+	jsonResponse.printf("{\"err\":%d,\"lines\":%u,\"buff\":%u}", (gcodePostOverflow) ? 1 : 0, gcodePostLines, webserver->GetGcodeBufferSpace());
 
-						// Set POST variables only if we actually need to store data
-						if (postFileLength > 0)
-						{
-							uint32_t remoteIP = network->GetTransaction()->GetRemoteIP();
-							uint16_t remotePort = network->GetTransaction()->GetRemotePort();
-							for(size_t i=0; i<numActiveSessions; i++)
-							{
-								if (sessions[i].ip == remoteIP)
-								{
-									sessions[i].postPort = remotePort;
-									sessions[i].isPostUploading = true;
-									break;
-								}
-							}
-							state = doingPost;
+	NetworkTransaction *req = network->GetTransaction();
+	req->Write("HTTP/1.1 200 OK\n");
+	req->Write("Content-Type: application/json\n");
+	req->Printf("Content-Length: %u\n", jsonResponse.strlen());
+	req->Printf("Connection: %s\n\n", gcodePostKeepAlive ? "keep-alive" : "close");
+	req->Write(jsonResponse);
+	network->SendAndClose(NULL, gcodePostKeepAlive);
 
-							return false;
-						}
+	gcodePostCs = NULL;
+}
 
-						// User has uploaded an empty file - we should have finished here already
-						FinishUpload(0);
-						SendJsonResponse("upload");
-						return true;
-					}
-					return RejectMessage("could not start file upload");
-				}
-			}
-			return RejectMessage("invalid POST upload request");
-		}
-		return RejectMessage("only rr_upload is supported for POST requests");
-	}
-	else
+void Webserver::HttpInterpreter::CancelGcodePost(const ConnectionState *cs)
+{
+	if (cs == gcodePostCs)
 	{
-		return RejectMessage("Unknown message type");
+		gcodePostCs = NULL;
 	}
 }
 
@@ -1605,6 +2555,87 @@ bool Webserver::HttpInterpreter::RejectMessage(const char* response, unsigned in
 	return true;
 }
 
+// Return the value of the specified header or NULL if the client didn't send it
+const char* Webserver::HttpInterpreter::GetHeaderValue(const char* key) const
+{
+	for(size_t i=0; i<numHeaderKeys; i++)
+	{
+		if (StringEquals(headers[i].key, key))
+		{
+			return headers[i].value;
+		}
+	}
+	return NULL;
+}
+
+// Check whether the client asked us to keep the connection open after the response
+bool Webserver::HttpInterpreter::ClientWantsKeepAlive() const
+{
+	const char *connection = GetHeaderValue("Connection");
+	return connection != NULL && StringEquals(connection, "keep-alive");
+}
+
+// Turn the current connection into a WebSocket that receives status frames. Only rr_status may be requested this way.
+// Always returns true, because the request is complete either way.
+bool Webserver::HttpInterpreter::UpgradeToWebSocket(const char* command)
+{
+	if (command[0] == '/')
+	{
+		command++;
+	}
+	if (!StringEquals(command, KO_START "status"))
+	{
+		return RejectMessage("only rr_status may be upgraded to a WebSocket", 400);
+	}
+
+	const char *key = GetHeaderValue("Sec-WebSocket-Key");
+	if (key == NULL || strlen(key) > 64)
+	{
+		return RejectMessage("missing or invalid Sec-WebSocket-Key", 400);
+	}
+
+	if (!IsAuthenticated() && reprap.NoPasswordSet())
+	{
+		Authenticate();
+	}
+	if (!IsAuthenticated())
+	{
+		return RejectMessage("not authenticated", 403);
+	}
+	UpdateAuthentication();
+
+	uint8_t type = 1;
+	if (numQualKeys != 0 && StringEquals(qualifiers[0].key, "type"))
+	{
+		int requestedType = atoi(qualifiers[0].value);
+		if (requestedType >= 1 && requestedType <= 3)
+		{
+			type = requestedType;
+		}
+	}
+
+	NetworkTransaction *req = network->GetTransaction();
+	if (!webserver->AddStatusSubscriber(req->GetConnection(), type))
+	{
+		return RejectMessage("too many WebSocket clients", 503);
+	}
+
+	char acceptKey[29];
+	GetWebSocketAcceptKey(key, acceptKey);
+
+	req->Write("HTTP/1.1 101 Switching Protocols\n");
+	req->Write("Upgrade: websocket\n");
+	req->Write("Connection: Upgrade\n");
+	req->Printf("Sec-WebSocket-Accept: %s\n\n", acceptKey);
+	network->SendAndClose(NULL, true);
+
+	if (reprap.Debug(moduleWebserver))
+	{
+		platform->Message(HOST_MESSAGE, "Webserver: WebSocket established for status type %d\n", type);
+	}
+	return true;
+}
+
 // Authenticate current IP and return true on success
 bool Webserver::HttpInterpreter::Authenticate()
 {
@@ -1667,7 +2698,8 @@ void Webserver::HttpInterpreter::CheckSessions()
 	const float time = platform->Time();
 	for(int i=numActiveSessions - 1; i>=0; i--)
 	{
-		if (!sessions[i].isPostUploading && (time - sessions[i].lastQueryTime) > httpSessionTimeout)
+		if (!sessions[i].isPostUploading && (time - sessions[i].lastQueryTime) > httpSessionTimeout
+				&& !webserver->HasStatusSubscriber(sessions[i].ip))
 		{
 			for(int k=numActiveSessions - 1; k > i; k--)
 			{
@@ -1686,9 +2718,13 @@ void Webserver::HttpInterpreter::CheckSessions()
 //********************************************************************************************
 
 Webserver::FtpInterpreter::FtpInterpreter(Platform *p, Webserver *ws, Network *n)
-	: ProtocolInterpreter(p, ws, n), state(authenticating), clientPointer(0)
+	: ProtocolInterpreter(p, ws, n), state(authenticating), clientPointer(0), restartOffset(0)
 {
 	strcpy(currentDir, "/");
+
+	// FTP clients stream large files, so give them a bigger staging buffer and write more sectors at once
+	uploadBuffer = reinterpret_cast<char *>(new uint32_t[ftpUploadBufferSize / sizeof(uint32_t)]);	// word-aligned for the HSMCI DMA
+	uploadBufferLength = ftpUploadBufferSize;
 }
 
 void Webserver::FtpInterpreter::ConnectionEstablished()
@@ -1812,10 +2848,31 @@ bool Webserver::FtpInterpreter::CharFromClient(char c)
 	return false;
 }
 
+// Process a block of data from the client, copying everything up to the end of the line in one go
+bool Webserver::FtpInterpreter::DataFromClient(const char *data, unsigned int length, unsigned int& bytesProcessed)
+{
+	bytesProcessed = 0;
+	while (bytesProcessed < length)
+	{
+		unsigned int runLength = ScanPlainText(data + bytesProcessed, length - bytesProcessed, "\r\n");
+		runLength = min<unsigned int>(runLength, ARRAY_UPB(clientMessage) - clientPointer);
+		memcpy(clientMessage + clientPointer, data + bytesProcessed, runLength);
+		clientPointer += runLength;
+		bytesProcessed += runLength;
+
+		if (bytesProcessed < length && CharFromClient(data[bytesProcessed++]))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 void Webserver::FtpInterpreter::ResetState()
 {
 	clientPointer = 0;
 	strcpy(currentDir, "/");
+	restartOffset = 0;
 
 	network->CloseDataPort();
 	CancelUpload();
@@ -1941,7 +2998,8 @@ void Webserver::FtpInterpreter::ProcessLine()
 				SendReply(227, ftpResponse);
 			}
 			// PASV commands are not supported in this state
-			else if (StringEquals(clientMessage, "LIST") || StringStartsWith(clientMessage, "RETR") || StringStartsWith(clientMessage, "STOR"))
+			else if (StringEquals(clientMessage, "LIST") || StringEquals(clientMessage, "MLSD")
+						|| StringStartsWith(clientMessage, "RETR") || StringStartsWith(clientMessage, "STOR"))
 			{
 				SendReply(425, "Use PASV first.");
 			}
@@ -2064,6 +3122,21 @@ void Webserver::FtpInterpreter::ProcessLine()
 					}
 				}
 			}
+			// get file size or modification time
+			else if (StringStartsWith(clientMessage, "SIZE") || StringStartsWith(clientMessage, "MDTM"))
+			{
+				SendFileInfo();
+			}
+			// list the facts of a single file or directory
+			else if (StringStartsWith(clientMessage, "MLST"))
+			{
+				SendFileFacts();
+			}
+			// set the position from which the next RETR starts
+			else if (StringStartsWith(clientMessage, "REST"))
+			{
+				SetRestartOffset();
+			}
 			// no op
 			else if (StringEquals(clientMessage, "NOOP"))
 			{
@@ -2105,43 +3178,26 @@ void Webserver::FtpInterpreter::ProcessLine()
 			// list directory entries
 			if (StringEquals(clientMessage, "LIST"))
 			{
-				// send response via main port
-				strncpy(ftpResponse, "150 Here comes the directory listing.\r\n", ftpResponseLength);
-				NetworkTransaction *ftp_req = network->GetTransaction();
-				ftp_req->Write(ftpResponse);
-				network->SendAndClose(NULL, true);
-
-				// send file list via data port
-				if (network->AcquireDataTransaction())
-				{
-					FileInfo file_info;
-					if (platform->GetMassStorage()->FindFirst(currentDir, file_info))
-					{
-						NetworkTransaction *data_req = network->GetTransaction();
-						char line[300];
-
-						do {
-							// Example for a typical UNIX-like file list:
-							// "drwxr-xr-x    2 ftp      ftp             0 Apr 11 2013 bin\r\n"
-							char dirChar = (file_info.isDirectory) ? 'd' : '-';
-							snprintf(line, ARRAY_SIZE(line), "%crw-rw-rw- 1 ftp ftp %13d %s %02d %04d %s\r\n",
-									dirChar, file_info.size, platform->GetMassStorage()->GetMonthName(file_info.month),
-									file_info.day, file_info.year, file_info.fileName);
-
-							// Fortunately we don't need to bother with output buffer chunks any more...
-							data_req->Write(line);
-						} while (platform->GetMassStorage()->FindNext(file_info));
-					}
-
-					network->SendAndClose(NULL);
-					state = doingPasvIO;
-				}
-				else
-				{
-					SendReply(500, "Unknown error.");
-					network->CloseDataPort();
-					state = authenticated;
-				}
+				SendDirectoryListing(false);
+			}
+			// list directory entries in machine-readable format
+			else if (StringEquals(clientMessage, "MLSD"))
+			{
+				SendDirectoryListing(true);
+			}
+			// report file size and modification time on the control connection
+			else if (StringStartsWith(clientMessage, "SIZE") || StringStartsWith(clientMessage, "MDTM"))
+			{
+				SendFileInfo();
+			}
+			else if (StringStartsWith(clientMessage, "MLST"))
+			{
+				SendFileFacts();
+			}
+			// clients may send REST after PASV, so accept it here as well
+			else if (StringStartsWith(clientMessage, "REST"))
+			{
+				SetRestartOffset();
 			}
 			// upload a file
 			else if (StringStartsWith(clientMessage, "STOR"))
@@ -2149,6 +3205,16 @@ void Webserver::FtpInterpreter::ProcessLine()
 				FileStore *file;
 
 				ReadFilename(4);
+				if (restartOffset != 0)
+				{
+					// Files are always created from scratch, so we cannot append to a partial upload
+					restartOffset = 0;
+					SendReply(554, "Restarted uploads are not supported.");
+					network->CloseDataPort();
+					state = authenticated;
+					break;
+				}
+
 				if (filename[0] == '/')
 				{
 					file = platform->GetFileStore(NULL, filename, true);
@@ -2188,13 +3254,22 @@ void Webserver::FtpInterpreter::ProcessLine()
 					fs = platform->GetFileStore(currentDir, filename, false);
 				}
 
+				const unsigned long startOffset = restartOffset;
+				restartOffset = 0;
 				if (fs == NULL)
 				{
 					SendReply(550, "Failed to open file.");
 				}
+				else if (startOffset > fs->Length() || (startOffset != 0 && !fs->Seek(startOffset)))
+				{
+					fs->Close();
+					SendReply(554, "Invalid restart position.");
+					network->CloseDataPort();
+					state = authenticated;
+				}
 				else
 				{
-					snprintf(ftpResponse, ftpResponseLength, "Opening data connection for %s (%lu bytes).", filename, fs->Length());
+					snprintf(ftpResponse, ftpResponseLength, "Opening data connection for %s (%lu bytes).", filename, fs->Length() - startOffset);
 					SendReply(150, ftpResponse);
 
 					if (network->AcquireDataTransaction())
@@ -2260,10 +3335,169 @@ void Webserver::FtpInterpreter::SendFeatures()
 	NetworkTransaction *req = network->GetTransaction();
 	req->Write("211-Features:\r\n");
 	req->Write("PASV\r\n");		// support PASV mode
+	req->Write("REST STREAM\r\n");	// support restarting downloads
+	req->Write("SIZE\r\n");			// report file sizes
+	req->Write("MDTM\r\n");			// report modification times
+	req->Write("MLSD\r\n");			// machine-readable directory listings
+	req->Write("MLST type*;size*;modify*;\r\n");
 	req->Write("211 End\r\n");
 	network->SendAndClose(NULL, true);
 }
 
+// Send the listing of the current directory via the data port, either in the format of 'ls -l' for LIST or in the
+// machine-readable format of RFC 3659 for MLSD. The lines are gathered into blocks before they are written.
+void Webserver::FtpInterpreter::SendDirectoryListing(bool machineReadable)
+{
+	// send response via main port
+	strncpy(ftpResponse, "150 Here comes the directory listing.\r\n", ftpResponseLength);
+	NetworkTransaction *ftp_req = network->GetTransaction();
+	ftp_req->Write(ftpResponse);
+	network->SendAndClose(NULL, true);
+
+	// send file list via data port
+	if (network->AcquireDataTransaction())
+	{
+		MassStorage *storage = platform->GetMassStorage();
+		FileInfo file_info;
+		if (storage->FindFirst(currentDir, file_info))
+		{
+			NetworkTransaction *data_req = network->GetTransaction();
+			char chunk[ftpListingChunkLength];
+			size_t chunkLength = 0;
+
+			do {
+				char line[300];
+				int lineLength;
+				if (machineReadable)
+				{
+					// Example: "type=file;size=1234;modify=20150101120000; test.g\r\n"
+					if (file_info.isDirectory)
+					{
+						lineLength = snprintf(line, ARRAY_SIZE(line), "type=dir;modify=%04u%02u%02u%02u%02u%02u; %s\r\n",
+								file_info.year, file_info.month, file_info.day, file_info.hours, file_info.minutes, file_info.seconds,
+								file_info.fileName);
+					}
+					else
+					{
+						lineLength = snprintf(line, ARRAY_SIZE(line), "type=file;size=%lu;modify=%04u%02u%02u%02u%02u%02u; %s\r\n",
+								file_info.size, file_info.year, file_info.month, file_info.day, file_info.hours, file_info.minutes,
+								file_info.seconds, file_info.fileName);
+					}
+				}
+				else
+				{
+					// Example for a typical UNIX-like file list:
+					// "drwxr-xr-x    2 ftp      ftp             0 Apr 11 2013 bin\r\n"
+					char dirChar = (file_info.isDirectory) ? 'd' : '-';
+					lineLength = snprintf(line, ARRAY_SIZE(line), "%crw-rw-rw- 1 ftp ftp %13lu %s %02d %04d %s\r\n",
+							dirChar, file_info.size, storage->GetMonthName(file_info.month),
+							file_info.day, file_info.year, file_info.fileName);
+				}
+				lineLength = min<int>(lineLength, ARRAY_UPB(line));
+
+				if (chunkLength + lineLength > ARRAY_SIZE(chunk))
+				{
+					data_req->Write(chunk, chunkLength);
+					chunkLength = 0;
+				}
+				memcpy(chunk + chunkLength, line, lineLength);
+				chunkLength += lineLength;
+			} while (storage->FindNext(file_info));
+
+			data_req->Write(chunk, chunkLength);
+		}
+
+		network->SendAndClose(NULL);
+		state = doingPasvIO;
+	}
+	else
+	{
+		SendReply(500, "Unknown error.");
+		network->CloseDataPort();
+		state = authenticated;
+	}
+}
+
+// Process a SIZE or MDTM command, which ask for the size or the modification time of a file
+void Webserver::FtpInterpreter::SendFileInfo()
+{
+	FileInfo info;
+	info.fileName[0] = 0;
+	ReadFilename(4);
+	if (!platform->GetMassStorage()->GetFileInfo((filename[0] == '/') ? NULL : currentDir, filename, info) || info.isDirectory)
+	{
+		SendReply(550, "Could not get file information.");
+	}
+	else
+	{
+		if (StringStartsWith(clientMessage, "SIZE"))
+		{
+			snprintf(ftpResponse, ftpResponseLength, "%lu", info.size);
+		}
+		else
+		{
+			snprintf(ftpResponse, ftpResponseLength, "%04u%02u%02u%02u%02u%02u",
+					info.year, info.month, info.day, info.hours, info.minutes, info.seconds);
+		}
+		SendReply(213, ftpResponse);
+	}
+}
+
+// Process an MLST command, which reports the same facts as MLSD for a single entry on the control connection
+void Webserver::FtpInterpreter::SendFileFacts()
+{
+	char facts[300];
+	ReadFilename(4);
+	if (filename[0] == 0)
+	{
+		// No argument means the current directory
+		snprintf(facts, ARRAY_SIZE(facts), "type=cdir; %s", currentDir);
+	}
+	else
+	{
+		FileInfo info;
+		info.fileName[0] = 0;
+		if (!platform->GetMassStorage()->GetFileInfo((filename[0] == '/') ? NULL : currentDir, filename, info))
+		{
+			SendReply(550, "Could not get file information.");
+			return;
+		}
+
+		if (info.isDirectory)
+		{
+			snprintf(facts, ARRAY_SIZE(facts), "type=dir;modify=%04u%02u%02u%02u%02u%02u; %s",
+					info.year, info.month, info.day, info.hours, info.minutes, info.seconds, filename);
+		}
+		else
+		{
+			snprintf(facts, ARRAY_SIZE(facts), "type=file;size=%lu;modify=%04u%02u%02u%02u%02u%02u; %s",
+					info.size, info.year, info.month, info.day, info.hours, info.minutes, info.seconds, filename);
+		}
+	}
+
+	// The facts line must start with a space
+	NetworkTransaction *req = network->GetTransaction();
+	req->Printf("250-Listing %s\r\n %s\r\n250 End\r\n", (filename[0] == 0) ? currentDir : filename, facts);
+	network->SendAndClose(NULL, true);
+}
+
+// Process a REST command, which sets the file offset from which the next RETR starts
+void Webserver::FtpInterpreter::SetRestartOffset()
+{
+	char *endPtr;
+	const unsigned long offset = strtoul(clientMessage + 4, &endPtr, 10);
+	if (endPtr == clientMessage + 4)
+	{
+		SendReply(501, "Invalid restart position.");
+	}
+	else
+	{
+		restartOffset = offset;
+		snprintf(ftpResponse, ftpResponseLength, "Restarting at %lu. Send RETR to initiate transfer.", restartOffset);
+		SendReply(350, ftpResponse);
+	}
+}
+
 void Webserver::FtpInterpreter::ReadFilename(int start)
 {
 	int filenameLength = 0;
@@ -2434,6 +3668,26 @@ bool Webserver::TelnetInterpreter::CharFromClient(char c)
 	return false;
 }
 
+// Process a block of data from the client, copying everything up to the end of the line in one go
+bool Webserver::TelnetInterpreter::DataFromClient(const char *data, unsigned int length, unsigned int& bytesProcessed)
+{
+	bytesProcessed = 0;
+	while (bytesProcessed < length)
+	{
+		unsigned int runLength = ScanPlainText(data + bytesProcessed, length - bytesProcessed, "\r\n#");
+		runLength = min<unsigned int>(runLength, ARRAY_UPB(clientMessage) - clientPointer);
+		memcpy(clientMessage + clientPointer, data + bytesProcessed, runLength);
+		clientPointer += runLength;
+		bytesProcessed += runLength;
+
+		if (bytesProcessed < length && CharFromClient(data[bytesProcessed++]))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 void Webserver::TelnetInterpreter::ResetState()
 {
 	state = authenticating;
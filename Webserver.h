@@ -30,7 +30,7 @@ Licence: GPL
 #ifndef WEBSERVER_H
 #define WEBSERVER_H
 
-const unsigned int gcodeBufferLength = 512;		// size of our gcode ring buffer, preferably a power of 2
+const unsigned int gcodeBufferLength = 2048;		// size of our gcode ring buffer, preferably a power of 2
 
 /* HTTP */
 
@@ -39,20 +39,30 @@ const unsigned int gcodeBufferLength = 512;		// size of our gcode ring buffer, p
 
 const unsigned int webUploadBufferSize = 2300;	// maximum size of HTTP GET upload packets (webMessageLength - 700)
 const unsigned int webMessageLength = 3000;		// maximum length of the web message we accept after decoding
+const unsigned int uploadBufferSize = 2048;		// size of the staging buffer for HTTP uploads (must be a multiple of 512)
 
 const unsigned int maxCommandWords = 4;			// max number of space-separated words in the command
 const unsigned int maxQualKeys = 5;				// max number of key/value pairs in the qualifier
 const unsigned int maxHeaders = 16;				// max number of key/value pairs in the headers
 
 const unsigned int jsonReplyLength = 2048;		// size of buffer used to hold JSON reply
+const unsigned int filesChunkLength = 1024;		// maximum size of each chunk of a streamed file list
+const unsigned int gcodePostLineSize = 100;		// maximum length of a line in a POST rr_gcode body including the null, same as GCODE_LENGTH
 
 const unsigned int maxSessions = 8;				// maximum number of simultaneous HTTP sessions
 const unsigned int httpSessionTimeout = 30;		// HTTP session timeout in seconds
 
+/* WebSocket */
+
+const unsigned int maxStatusSubscribers = 4;		// maximum number of WebSocket connections receiving status pushes
+const float defaultStatusPushInterval = 0.25;		// default interval between two status pushes in seconds
+
 /* FTP */
 
 const unsigned int ftpResponseLength = 128;		// maximum FTP response length
 const unsigned int ftpMessageLength = 128;		// maximum line length for incoming FTP commands
+const unsigned int ftpUploadBufferSize = 4096;	// size of the staging buffer for FTP uploads (must be a multiple of 512)
+const unsigned int ftpListingChunkLength = 1024;	// directory listings are written to the data port in blocks of this size
 
 /* Telnet */
 
@@ -73,6 +83,7 @@ class ProtocolInterpreter
 		virtual void ConnectionEstablished() { }
 		virtual void ConnectionLost(uint32_t remoteIP, uint16_t remotePort, uint16_t localPort) { }
 		virtual bool CharFromClient(const char c) = 0;
+		virtual bool DataFromClient(const char *data, unsigned int length, unsigned int& bytesProcessed);
 		virtual void ResetState() = 0;
 		virtual bool NeedMoreData();
 
@@ -100,9 +111,15 @@ class ProtocolInterpreter
 	    char filenameBeingUploaded[FILENAME_LENGTH];
 	    const char *uploadPointer;							// pointer to start of uploaded data not yet written to file
 	    unsigned int uploadLength;							// amount of data not yet written to file
+	    char *uploadBuffer;									// staging buffer, so that we can write whole sectors to the file
+	    unsigned int uploadBufferLength;					// size of the staging buffer
+	    unsigned int uploadBufferedBytes;					// amount of data in the staging buffer
+
+	    static unsigned int ScanPlainText(const char *data, unsigned int length, const char *delimiters);
 
 	    virtual bool StartUpload(FileStore *file);
 	    virtual bool StoreUploadData(const char* data, unsigned int len);
+	    bool WriteUploadBuffer();
 		bool IsUploading() const;
 	    virtual void FinishUpload(uint32_t fileLength);
 };
@@ -124,6 +141,9 @@ class Webserver
     void ConnectionLost(const ConnectionState *cs);
     void ConnectionError();
 
+    void SetStatusPushInterval(float interval);
+    float GetStatusPushInterval() const;
+
     friend class Platform;
 
   protected:
@@ -138,6 +158,7 @@ class Webserver
 			HttpInterpreter(Platform *p, Webserver *ws, Network *n);
 			void ConnectionLost(uint32_t remoteIP, uint16_t remotePort, uint16_t localPort);
 			bool CharFromClient(const char c);
+			bool DataFromClient(const char *data, unsigned int length, unsigned int& bytesProcessed);
 			void ResetState();
 			bool NeedMoreData();
 
@@ -149,6 +170,13 @@ class Webserver
 			void ResetSessions();
 			void CheckSessions();
 
+			void ContinueFilesResponse();
+			void CancelFilesResponse(const ConnectionState *cs);
+
+			bool IsGcodePostConnection(const ConnectionState *cs) const { return cs == gcodePostCs; }
+			void ProcessGcodePostData(NetworkTransaction *req);
+			void CancelGcodePost(const ConnectionState *cs);
+
 		private:
 
 			// HTTP server state enumeration. The order is important, in particular xxxEsc1 must follow xxx, and xxxEsc2 must follow xxxEsc1.
@@ -177,13 +205,30 @@ class Webserver
 				const char* value;
 			};
 
+			enum RangeResult
+			{
+				rangeIgnored,			// no usable Range header, so send the whole file
+				rangeValid,				// send the part of the file given by the range
+				rangeUnsatisfiable		// the range lies outside the file
+			};
+
 			void SendFile(const char* nameOfFileToSend);
+			RangeResult ParseRange(const char* range, uint32_t fileLength, uint32_t& firstByte, uint32_t& lastByte) const;
 			void SendGCodeReply();
 			void SendJsonResponse(const char* command);
 			bool GetJsonResponse(const char* request, StringRef& response, const char* key, const char* value, size_t valueLength, bool& keepOpen);
 			void GetJsonUploadResponse(StringRef& response);
 			bool ProcessMessage();
+			void FinishPostUpload();
 			bool RejectMessage(const char* s, unsigned int code = 500);
+			const char* GetHeaderValue(const char* key) const;
+			bool ClientWantsKeepAlive() const;
+			bool UpgradeToWebSocket(const char* command);
+			void StartFilesResponse(const char* dir);
+			void SendFilesChunk(const char* dir);
+			bool StartGcodePost();
+			bool FlushGcodePostLine();
+			void SendGcodePostResponse();
 
 			bool Authenticate();
 			bool IsAuthenticated() const;
@@ -218,6 +263,26 @@ class Webserver
 			HttpSession sessions[maxSessions];
 		    unsigned int numActiveSessions;
 
+		    // Chunked file list, which is read from the SD card and sent in parts across several calls to Spin
+
+		    ConnectionState *filesResponseCs;				// connection receiving the file list or NULL if none is being sent
+		    DirectoryIterator filesResponseDir;				// directory being listed
+		    FileInfo filesResponseEntry;					// next entry to be sent
+		    bool filesResponseHaveEntry;					// is filesResponseEntry valid?
+		    bool filesResponseFirst;						// have we sent no entries yet?
+
+		    // Bulk G-code submission, which is fed into the G-code buffer as fast as GCodes consumes it
+
+		    ConnectionState *gcodePostCs;					// connection sending a POST rr_gcode body or NULL if none
+		    uint32_t gcodePostBytesLeft;					// number of body bytes still to be received
+		    char gcodePostLine[gcodePostLineSize];			// line being assembled from the body
+		    unsigned int gcodePostLineLength;				// number of characters in gcodePostLine
+		    bool gcodePostLineComplete;						// is gcodePostLine waiting for space in the G-code buffer?
+		    bool gcodePostInComment;						// are we skipping a comment?
+		    bool gcodePostOverflow;							// was a line too long to be stored?
+		    bool gcodePostKeepAlive;						// did the client ask for a persistent connection?
+		    unsigned int gcodePostLines;					// number of lines stored so far
+
 		protected:
 		    bool uploadingTextData;							// do we need to count UTF-8 continuation bytes?
 		    uint32_t numContinuationBytes;					// number of UTF-8 continuation bytes we have received
@@ -238,6 +303,7 @@ class Webserver
 			void ConnectionEstablished();
 			void ConnectionLost(uint32_t remoteIP, uint16_t remotePort, uint16_t localPort);
 			bool CharFromClient(const char c);
+			bool DataFromClient(const char *data, unsigned int length, unsigned int& bytesProcessed);
 			void ResetState();
 
 			bool DoingFastUpload() const;
@@ -262,10 +328,15 @@ class Webserver
 			char currentDir[FILENAME_LENGTH];
 
 			float portOpenTime;
+			unsigned long restartOffset;		// file offset requested by REST for the next RETR
 
 			void ProcessLine();
 			void SendReply(int code, const char *message, bool keepConnection = true);
 			void SendFeatures();
+			void SetRestartOffset();
+			void SendDirectoryListing(bool machineReadable);
+			void SendFileInfo();
+			void SendFileFacts();
 
 			void ReadFilename(int start);
 			void ChangeDirectory(const char *newDirectory);
@@ -280,6 +351,7 @@ class Webserver
 			void ConnectionEstablished();
 			void ConnectionLost(uint32_t remoteIP, uint16_t remotePort, uint16_t local_port);
 			bool CharFromClient(const char c);
+			bool DataFromClient(const char *data, unsigned int length, unsigned int& bytesProcessed);
 			void ResetState();
 			bool NeedMoreData();
 
@@ -309,6 +381,15 @@ class Webserver
     void LoadGcodeBuffer(const char* gc);
     void StoreGcodeData(const char* data, size_t len);
 
+    // WebSocket status push
+    bool AddStatusSubscriber(ConnectionState *cs, uint8_t type);
+    void RemoveStatusSubscriber(const ConnectionState *cs);
+    bool IsStatusSubscriber(const ConnectionState *cs) const;
+    bool HasStatusSubscriber(uint32_t remoteIP) const;
+    void ProcessWebSocketData(NetworkTransaction *req);
+    void PushStatus();
+    const char* BuildStatusFrame(char *buffer, uint8_t type, size_t& length) const;
+
   private:
 
     // Buffer to hold gcode that is ready for processing
@@ -321,6 +402,31 @@ class Webserver
     bool webserverActive;
     const ConnectionState *readingConnection;
 
+    // Connections that have been upgraded to WebSockets and receive status frames. A frame sent by the client
+    // may be split over several packets, so we keep the state of the frame being read for each of them.
+    enum WebSocketFrameState : uint8_t { wsHeader, wsExtendedLength, wsMask, wsPayload };
+
+    struct StatusSubscriber
+    {
+    	ConnectionState *cs;
+    	uint8_t type;
+    	WebSocketFrameState frameState;			// part of the frame being read
+    	uint8_t header[2];
+    	uint8_t mask[4];
+    	uint16_t payloadLength;
+    	uint16_t bytesRead;						// bytes read of the current part of the frame
+    	char pingPayload[125];					// control frames carry at most 125 bytes of payload
+    };
+
+    StatusSubscriber *FindStatusSubscriber(const ConnectionState *cs);
+    bool WebSocketFrameComplete(NetworkTransaction *req, StatusSubscriber *sub, bool& replied);
+    void CloseWebSocket(NetworkTransaction *req, uint16_t statusCode);
+
+    StatusSubscriber statusSubscribers[maxStatusSubscribers];
+    unsigned int numStatusSubscribers;
+    float statusPushInterval;						// seconds between two status frames, 0 if disabled
+    float lastStatusPushTime;
+
     float lastTime;
     float longWait;
 };
@@ -335,6 +441,9 @@ inline bool Webserver::TelnetInterpreter::NeedMoreData() { return false; }	// we
 inline bool Webserver::TelnetInterpreter::HasRemainingData() const { return sendPending; }
 inline void Webserver::TelnetInterpreter::RemainingDataSent() { sendPending = false; }
 
+inline void Webserver::SetStatusPushInterval(float interval) { statusPushInterval = interval; }
+inline float Webserver::GetStatusPushInterval() const { return statusPushInterval; }
+
 inline unsigned int Webserver::GetGcodeBufferSpace() const { return (gcodeReadIndex - gcodeWriteIndex - 1u) % gcodeBufferLength; }
 
 #endif